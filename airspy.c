@@ -29,6 +29,7 @@
 #include "misc.h"
 #include "multicast.h"
 #include "decimate.h"
+#include "frontend.h"
 #include "status.h"
 #include "dsp.h"
 
@@ -59,18 +60,19 @@ struct sdrstate {
 // decibel limits for power
 float AGC_upper = -15;
 float AGC_lower = -25;
-int ADC_samprate; // Computed from Out_samprate * Decimate
+int ADC_samprate; // Set directly, or from the output rate and --decimate
 float Rate_factor; // Computed from ADC_samprate and Power_alpha
 int Out_samprate = 192000;
-int Decimate = 64;
-int Log_decimate = 6; // Computed from Decimate
+int Log_decimate = 6; // Halfband stages, computed from ADC_samprate and Out_samprate
 const int Bufsize = 16384;
 float const DC_alpha = .001;  // high pass filter coefficient for DC offset estimates, per callback block
 float const Power_alpha= 1.0; // time constant (seconds) for smoothing power and I/Q imbalance estimates
 char *Rundir = "/run/airspy"; // Where 'status' and 'pid' get written
 float Filter_atten;
-int const stage_threshold = 8; // point at which to switch to filter f8
-#define BUFFERSIZE  (1<<19) // Upcalls seem to be 256KB; don't make too big or we may blow out of the cache
+float Passband = 0.4;   // Edge of band protected from aliasing, fraction of output sample rate
+float Rejection = 60;   // Alias rejection in that band, dB
+#define TRANSFER_SAMPLES 65536 // Complex samples per USB upcall (256 KB of 16-bit real A/D samples)
+#define RING_TRANSFERS 8     // Upcalls the sample ring holds; don't make too big or we may blow out of the cache
 
 // Variables set by command line options
 int Blocksize = 350; // Safe for 16-bit samples at 1500 byte MTU
@@ -100,14 +102,17 @@ static struct option Options[] =
    {"decimate", required_argument, NULL, 'c'},
    {"daemonize", no_argument, NULL, 'd'},
    {"frequency", required_argument, NULL, 'f'},
+   {"adc-samprate", required_argument, NULL, 'i'},
    {"offset", required_argument, NULL, 'o'},
+   {"passband", required_argument, NULL, 'p'},
+   {"rejection", required_argument, NULL, 'a'},
    {"samprate", required_argument, NULL, 'r'},
    {"sample-rate", required_argument, NULL, 'r'},
    {"rtp-type", required_argument, NULL, 't'},
    {"verbose", no_argument, NULL, 'v'},
    {NULL, 0, NULL, 0},
   };
-static char Optstring[] = "A:D:I:R:S:T:b:c:df:o:r:t:v";
+static char Optstring[] = "A:D:I:R:S:T:a:b:c:df:i:o:p:r:t:v";
 
 
 // Global variables
@@ -126,21 +131,14 @@ pthread_t Ncmd_thread;
 FILE *Status;
 char *Status_filename;
 char *Pid_filename;
-float Sampbuffer_i[BUFFERSIZE];
-float Sampbuffer_q[BUFFERSIZE];
-pthread_mutex_t Buf_mutex;
-pthread_cond_t Buf_cond;
-int Samp_wp;
+struct iq_ring *Ring; // Conditioned samples from the USB callback to the decimator
 
 
 uint64_t Commands;
 struct state State[256];
 
 // Gain and phase corrections. These will be updated every block
-float gain_q = 1;
-float gain_i = 1;
-float secphi = 1;
-float tanphi = 0;
+struct iq_cond Cond; // DC, gain and phase corrections and Fs/4 shift, updated every block
 
 void decode_airspy_commands(struct sdrstate *,unsigned char *,int);
 void send_airspy_status(struct sdrstate *,int);
@@ -161,6 +159,7 @@ int main(int argc,char *argv[]){
     Locale = "en_US.UTF-8";
   setlocale(LC_ALL,Locale);
 
+  int decimate = 64; // A/D to output ratio, unless -i sets the A/D rate
   int c;
   while((c = getopt_long(argc,argv,Optstring,Options,NULL)) != -1){
     switch(c){
@@ -182,11 +181,14 @@ int main(int argc,char *argv[]){
     case 'T':
       Mcast_ttl = strtol(optarg,NULL,0);
       break;
+    case 'a':
+      Rejection = strtof(optarg,NULL);
+      break;
     case 'b':
       Blocksize = strtol(optarg,NULL,0);
       break;
     case 'c':
-      Decimate = strtol(optarg,NULL,0);
+      decimate = strtol(optarg,NULL,0);
       break;
     case 'd':
       Daemonize++;
@@ -195,9 +197,15 @@ int main(int argc,char *argv[]){
     case 'f':
       Frequency = strtod(optarg,NULL);
       break;
+    case 'i':
+      ADC_samprate = strtol(optarg,NULL,0);
+      break;
     case 'o':
       Offset = strtol(optarg,NULL,0);
       break;
+    case 'p':
+      Passband = strtof(optarg,NULL);
+      break;
     case 'r':
       Out_samprate = strtol(optarg,NULL,0);
       break;
@@ -274,17 +282,22 @@ int main(int argc,char *argv[]){
     }
   }
   
-  ADC_samprate = Decimate * Out_samprate;
-  Rate_factor = 1./(ADC_samprate * Power_alpha);
-  Log_decimate = (int)round(log2(Decimate));
-  if(1<<Log_decimate != Decimate){
-    errmsg("Decimation ratios must currently be a power of 2\n");
+  if(ADC_samprate == 0)
+    ADC_samprate = decimate * Out_samprate;
+  if(Out_samprate <= 0 || ADC_samprate < Out_samprate){
+    errmsg("A/D sample rate %'d must be at least the output rate %'d\n",ADC_samprate,Out_samprate);
     exit(1);
   }
+  Rate_factor = 1./(ADC_samprate * Power_alpha);
+  // Halve the rate as many times as possible with the halfband cascade,
+  // then resample the rest of the way if the ratio isn't a power of 2
+  Log_decimate = 0;
+  while(((long)Out_samprate << (Log_decimate+1)) <= ADC_samprate)
+    Log_decimate++;
   // Fold in scaling from float to short integer
   Filter_atten = 32767. * powf(.5, Log_decimate); // Compensate for +6dB gain in each decimation stage
 
-  if(Decimate == 1){
+  if(ADC_samprate == Out_samprate){
     errmsg("No spectrum shift without decimation");
     Offset = 0; // No reason to offset when not decimating
   }
@@ -363,8 +376,15 @@ int main(int argc,char *argv[]){
   ret = airspy_set_freq(sdr->device,intfreq);
   assert(ret == AIRSPY_SUCCESS);
 
-  pthread_mutex_init(&Buf_mutex,NULL);
-  pthread_cond_init(&Buf_cond,NULL);
+  // Whole USB transfers, rounded up so the decimator's chunks never straddle the end
+  // Count an underrun if the samples stop for four transfer times
+  int ringsize = RING_TRANSFERS * TRANSFER_SAMPLES;
+  ringsize = (ringsize + (1 << Log_decimate) - 1) & ~((1 << Log_decimate) - 1);
+  Ring = create_iq_ring(ringsize,1 + (4000LL * TRANSFER_SAMPLES) / ADC_samprate);
+  if(Ring == NULL){
+    errmsg("Can't allocate %'d sample ring\n",ringsize);
+    exit(1);
+  }
 
 
   time_t tt;
@@ -406,18 +426,42 @@ int main(int argc,char *argv[]){
 	 Rtp.ssrc,
 	 Status_filename);
   
-  errmsg("A/D sample rate %'d Hz; filter bw %'d Hz; decimation ratio %d; output sample rate %'d Hz (%'d bits/sec); Offset %'+d\n",
+  errmsg("A/D sample rate %'d Hz; filter bw %'d Hz; decimation ratio %.3f; output sample rate %'d Hz (%'d bits/sec); Offset %'+d\n",
 	 ADC_samprate,
 	 0,
-	 Decimate,
+	 (double)ADC_samprate / Out_samprate,
 	 Out_samprate,
 	 Out_samprate * sampsize * 2,
 	 Offset * ADC_samprate/4);
 
 
+  // Plan the decimation filter chain before samples start arriving
+  // The cascade's passband is relative to its own output rate, Out_samprate << Log_decimate
+  // as seen from the A/D rate
+  struct hb_cascade * const cascade = create_hb_cascade(Log_decimate,Passband * ((double)Out_samprate * (1 << Log_decimate)) / ADC_samprate,Rejection);
+  if(cascade == NULL){
+    errmsg("Can't plan decimation for passband %.3f\n",Passband);
+    exit(1);
+  }
+  struct resampler *resampler = NULL;
+  if(((long)Out_samprate << Log_decimate) != ADC_samprate){
+    resampler = create_resampler(ADC_samprate,Out_samprate << Log_decimate,Passband,Rejection);
+    if(resampler == NULL){
+      errmsg("Can't resample from %'d to %'d Hz\n",ADC_samprate,Out_samprate);
+      exit(1);
+    }
+  }
+  for(int j=Log_decimate-1; j >= 0; j--)
+    errmsg("decimation stage %d: %s, %d taps, %.1f dB alias rejection\n",
+	   Log_decimate-j,Hb_type_names[cascade->stage[j].type],cascade->stage[j].taps,cascade->stage[j].rejection);
+  if(resampler != NULL)
+    errmsg("resampler: %d/%d, %d phases, %d taps, %.1f dB alias rejection\n",
+	   resampler->interp,resampler->decim,resampler->phases,resampler->taps,resampler->rejection);
+
   ret = airspy_set_sample_type(sdr->device,AIRSPY_SAMPLE_FLOAT32_IQ);
   assert(ret == AIRSPY_SUCCESS);
 
+  init_iq_cond(&Cond,Offset); // Shift up by Fs/4 in software to undo the high offset tuning
   ret = airspy_start_rx(sdr->device,rx_callback,sdr);
   assert(ret == AIRSPY_SUCCESS);
 
@@ -433,41 +477,13 @@ int main(int argc,char *argv[]){
 
   pthread_setname("aspy-decim");
 
-  // Decimation filter states
-  struct hb15_state hb15_state_real[Log_decimate];
-  struct hb15_state hb15_state_imag[Log_decimate];
-  memset(hb15_state_real,0,sizeof(hb15_state_real));
-  memset(hb15_state_imag,0,sizeof(hb15_state_imag));
-  float hb3state_real[Log_decimate];
-  float hb3state_imag[Log_decimate];
-  memset(hb3state_real,0,sizeof(hb3state_real));
-  memset(hb3state_imag,0,sizeof(hb3state_imag));
-
-#if 0
-  // Verify SIMD alignment
-  assert(((uint64_t)hb15_state_real & 15) == 0);
-  assert(((uint64_t)hb15_state_imag & 15) == 0);
-#endif
-
-  // Initialize coefficients here!!!
-  // As experiment, use Goodman/Carey "F8" 15-tap filter
-  // Note word order in array -- [3] is closest to the center, [0] is on the tails
-  for(int i=0; i<Log_decimate; i++){ // For each stage (h(0) is always unity, other h(n) are zero for even n)
-    hb15_state_real[i].coeffs[3] = 490./802;
-    hb15_state_imag[i].coeffs[3] = 490./802;
-    hb15_state_real[i].coeffs[2] = -116./802;
-    hb15_state_imag[i].coeffs[2] = -116./802;
-    hb15_state_real[i].coeffs[1] = 33./802; 
-    hb15_state_imag[i].coeffs[1] = 33./802;    
-    hb15_state_real[i].coeffs[0] = -6./802; 
-    hb15_state_imag[i].coeffs[0] = -6./802;    
-  }
   struct timeval tp;
   gettimeofday(&tp,NULL);
   // Timestamp is in nanoseconds for futureproofing, but time of day is only available in microsec
   sdr->status.timestamp = ((tp.tv_sec - UNIX_EPOCH + GPS_UTC_OFFSET) * 1000000LL + tp.tv_usec) * 1000LL;
 
-  int samp_rp = 0;
+  complex float outbuf[2*Blocksize + 1]; // Room for a packet plus one chunk's output
+  int outcount = 0;
 
   while(1){
     struct rtp_header rtp;
@@ -486,80 +502,67 @@ int main(int argc,char *argv[]){
       dp = hton_status(dp,&sdr->status); // old metadata header, will disappear someday
 
     float output_energy = 0;
-    // NB: We assume that Decimate divides into BUFFERSIZE
-    // They will since both are powers of 2
-    // Wait for enough to be available to send a full packet
-    pthread_mutex_lock(&Buf_mutex);
-    while(((Samp_wp - samp_rp) & (BUFFERSIZE-1)) < Decimate * Blocksize)
-      pthread_cond_wait(&Buf_cond,&Buf_mutex);
-    pthread_mutex_unlock(&Buf_mutex);
-    
-    int remain = Blocksize;
-    while(remain > 0){
-      int chunk = remain;
-      // Don't straddle the end of the circular sample buffer
-      if(samp_rp + chunk * Decimate > BUFFERSIZE)
-	chunk = (BUFFERSIZE - samp_rp) / Decimate;
-
-      // Real channel in-place decimation
-      // First stages can use simple, fast filter; later ones use slower filter
-      // each stage is half the length of the previous one, and puts its output in the first half of its input buffer
-      // so the final outputs are in the first 'chunk' elements of the buffer
-      float *ip = &Sampbuffer_i[samp_rp];
-      int j;
-      for(j=Log_decimate-1;j>=stage_threshold;j--)
-	hb3_block(&hb3state_real[j], ip, ip, chunk<<j);
-
-      for(; j>=0;j--)
-	hb15_block(&hb15_state_real[j], ip, ip, chunk<<j);
-
-      // Imaginary channel decimation
-      float *qp = &Sampbuffer_q[samp_rp];
-      for(j=Log_decimate-1;j>=stage_threshold;j--)
-	hb3_block(&hb3state_imag[j], qp, qp, chunk<<j);
-
-      for(; j>=0;j--)
-	hb15_block(&hb15_state_imag[j], qp, qp, chunk<<j);
-
-      switch(Rtp_type){
-      case IQ_PT:	  // 16-bit integers, little endian with metadata; will eventually become PCM_STEREO (10)
-	{
-	  short *sp = (short *)dp;
-	  for(int i=0;i < chunk; i++){
-	    float s = *ip++ * Filter_atten;
-	    output_energy += s*s;
-	    *sp++ = s; // Clip?
-
-	    s = *qp++ * Filter_atten;
-	    output_energy += s*s;
-	    *sp++ = s; // Clip?
-	  }
-	  dp = (unsigned char *)sp;
+    // Decimate, and resample if necessary, until there's a full packet of output
+    // The resampler yields a varying number of samples per chunk, so leftovers are kept for the next packet
+    while(outcount < Blocksize){
+      int chunk = Blocksize;
+      // Don't straddle the end of the sample ring
+      // We always take multiples of 1<<Log_decimate, which divides into the ring size
+      if((chunk << Log_decimate) > iq_ring_read_contig(Ring))
+	chunk = iq_ring_read_contig(Ring) >> Log_decimate;
+
+      // Wait for enough to be available
+      complex float *ip = iq_ring_read_start(Ring,chunk << Log_decimate);
+
+      // In-place decimation of I and Q together, all stages in one cache-blocked pass
+      // so the halfband outputs are in the first 'chunk' elements of the buffer
+      hb_cascade_block(cascade,ip,ip,chunk);
+      if(resampler != NULL){
+	outcount += resample(resampler,outbuf + outcount,ip,chunk);
+      } else {
+	memcpy(outbuf + outcount,ip,chunk * sizeof(*outbuf));
+	outcount += chunk;
+      }
+      iq_ring_read_done(Ring,chunk << Log_decimate);
+    }
+    complex float const *ip = outbuf;
+    switch(Rtp_type){
+    case IQ_PT:	  // 16-bit integers, little endian with metadata; will eventually become PCM_STEREO (10)
+      {
+	short *sp = (short *)dp;
+	for(int i=0;i < Blocksize; i++){
+	  float s = crealf(*ip) * Filter_atten;
+	  output_energy += s*s;
+	  *sp++ = s; // Clip?
+
+	  s = cimagf(*ip++) * Filter_atten;
+	  output_energy += s*s;
+	  *sp++ = s; // Clip?
 	}
-	break;
-      case IQ_PT12:	  // 12-bit integers, packed big-endian, no metadata header
-	{
-	  for(int i=0;i < chunk; i++){
-	    float s = *ip++ * Filter_atten;
-	    output_energy += s*s;
-	    short si = s; // Clip?
-
-	    s = *qp++ * Filter_atten;
-	    output_energy += s*s;
-	    short sq = s; // Clip?
-
-	    dp[0] = si >> 8;
-	    dp[1] = (si & 0xf0) | ((sq >> 12) & 0xf);
-	    dp[2] = sq >> 4;
-	    dp += 3;
-	  }
+	dp = (unsigned char *)sp;
+      }
+      break;
+    case IQ_PT12:	  // 12-bit integers, packed big-endian, no metadata header
+      {
+	for(int i=0;i < Blocksize; i++){
+	  float s = crealf(*ip) * Filter_atten;
+	  output_energy += s*s;
+	  short si = s; // Clip?
+
+	  s = cimagf(*ip++) * Filter_atten;
+	  output_energy += s*s;
+	  short sq = s; // Clip?
+
+	  dp[0] = si >> 8;
+	  dp[1] = (si & 0xf0) | ((sq >> 12) & 0xf);
+	  dp[2] = sq >> 4;
+	  dp += 3;
 	}
-	break;
       }
-      samp_rp += chunk * Decimate;
-      samp_rp &= (BUFFERSIZE-1);
-      remain -= chunk;
+      break;
     }
+    outcount -= Blocksize;
+    memmove(outbuf,outbuf + Blocksize,outcount * sizeof(*outbuf));
     // Remove scaling factor in power just once per block
     sdr->out_power = output_energy / (32767.0 * 32767.0 * Blocksize);
     if(send(Rtp_sock,buffer,dp - buffer,0) == -1){
@@ -655,7 +658,7 @@ void *display(void *arg){
 
   pthread_setname("airspy-disp");
 
-  fprintf(Status,"               |---Gains dB---|      |----Levels dB --|   |---------Errors---------|           clips\n");
+  fprintf(Status,"               |---Gains dB---|      |----Levels dB --|   |---------Errors---------|           clips   overruns  underruns\n");
   fprintf(Status,"Frequency      LNA  mixer bband          RF   A/D   Out     DC-I   DC-Q  phase  gain\n");
   fprintf(Status,"Hz                                           dBFS  dBFS                    deg    dB\n");   
 
@@ -669,7 +672,7 @@ void *display(void *arg){
     if(stat_point != -1)
       fseeko(Status,stat_point,SEEK_SET);
     
-    fprintf(Status,"%'-15.0lf%3d%7d%6d%'12.1f%'6.1f%'6.1f%9.4f%7.4f%7.2f%6.2f%'16d    %c",
+    fprintf(Status,"%'-15.0lf%3d%7d%6d%'12.1f%'6.1f%'6.1f%9.4f%7.4f%7.2f%6.2f%'16d%'11llu%'11llu    %c",
 	    sdr->status.frequency,
 	    sdr->status.lna_gain,	    
 	    sdr->status.mixer_gain,
@@ -682,6 +685,8 @@ void *display(void *arg){
 	    (180/M_PI) * asin(sdr->sinphi),
 	    10*log10(sdr->imbalance),
 	    sdr->clips,
+	    Ring->overruns,
+	    Ring->underruns,
 	    eol);
     fflush(Status);
     usleep(100000); // 10 Hz
@@ -778,6 +783,8 @@ void send_airspy_status(struct sdrstate *sdr,int full){
   encode_float(&bp,IQ_IMBALANCE,power2dB(sdr->imbalance));
   encode_float(&bp,IQ_PHASE,sdr->sinphi);
   encode_byte(&bp,DIRECT_CONVERSION,Offset == 0); // Direct conversion if offset == 0
+  encode_int64(&bp,INPUT_OVERRUNS,Ring->overruns);
+  encode_int64(&bp,INPUT_UNDERRUNS,Ring->underruns);
   
   // Tuning
   encode_double(&bp,RADIO_FREQUENCY,sdr->status.frequency);
@@ -802,10 +809,6 @@ void send_airspy_status(struct sdrstate *sdr,int full){
 }
 
 
-int rotate_phase = 0;
-
-complex float rotate_phasor = 1;
-
 
 // Callback called with incoming receiver data from A/D
 int rx_callback(airspy_transfer *transfer){
@@ -813,95 +816,34 @@ int rx_callback(airspy_transfer *transfer){
   struct sdrstate *sdr = &AirCD;
 
   int samples = transfer->sample_count;
-  int remain = samples;
-  float *dp = transfer->samples;
-
-  complex float samp_sum = 0;
-  float i_energy=0,q_energy=0;
-  float dotprod = 0;                           // sum of I*Q, for phase balance
-
-  while(remain-- > 0){
-    complex float samp;
-
-    __real__ samp = *dp++;
-    __imag__ samp = *dp++;
-
-    if(__imag__ samp < -1){
-      sdr->clips++;
-      __imag__ samp = -1;
-    }
-    if(__real__ samp < -1){
-      sdr->clips++;
-      __real__ samp = -1;
-    }
-    samp_sum += samp;
-
-    // remove DC offset (which can be fractional)
-    samp -= sdr->DC;
-    
-    // Must correct gain and phase before frequency shift
-    // accumulate I and Q energies before gain correction
-    i_energy += crealf(samp) * crealf(samp);
-    q_energy += cimagf(samp) * cimagf(samp);
-    
-    // Balance gains, keeping constant total energy
-    __real__ samp *= gain_i;
-    __imag__ samp *= gain_q;
-    
-    // Accumulate phase error
-    dotprod += crealf(samp) * cimagf(samp);
-
-    // Correct phase
-    __imag__ samp = secphi * cimagf(samp) - tanphi * crealf(samp);
-    
-#if 0
-    // On Atom CPU, seems slightly slower than swapping/flipping code below
-    samp *= rotate_phasor;
-    rotate_phasor *= _Complex_I;
-    Sampbuffer_i[Samp_wp] = __real__ samp;
-    Sampbuffer_q[Samp_wp] = __imag__ samp;
-
-#else
-    // Optionally increase frequency by Fs/4 to compensate for tuner being high by Fs/4
-    switch(rotate_phase){
-    default:
-    case 0:
-      Sampbuffer_i[Samp_wp] = __real__ samp;
-      Sampbuffer_q[Samp_wp] = __imag__ samp;
-      break;
-    case 1:
-      Sampbuffer_i[Samp_wp] = - __imag__ samp;
-      Sampbuffer_q[Samp_wp] = __real__ samp;
-      break;
-    case 2:
-      Sampbuffer_i[Samp_wp] = - __real__ samp;
-      Sampbuffer_q[Samp_wp] = - __imag__ samp;
-      break;
-    case 3:
-      Sampbuffer_i[Samp_wp] = __imag__ samp;
-      Sampbuffer_q[Samp_wp] = - __real__ samp;
-      break;
-    }
-    rotate_phase += Offset;
-    rotate_phase &= 3; // Modulo 4
-#endif
-
-    Samp_wp = (Samp_wp + 1) & (BUFFERSIZE-1);
-  }
-  pthread_cond_broadcast(&Buf_cond); // Wake him up only after we're done
+  float const *dp = transfer->samples;
+  struct iq_stats stats;
+  memset(&stats,0,sizeof(stats));
+
+  // Condition straight into the sample ring, in two pieces if it wraps
+  int first;
+  complex float * const wp = iq_ring_write_start(Ring,samples,&first);
+  if(wp == NULL)
+    return 0; // Decimator fell behind; dropped and counted as an overrun
+  iq_condition(&Cond,&stats,wp,dp,IQ_F32,1,first);
+  if(first < samples)
+    iq_condition(&Cond,&stats,Ring->buf,dp + 2*first,IQ_F32,1,samples - first);
+  sdr->clips += stats.clips;
+  iq_ring_write_done(Ring,samples); // Wake him up only after we're done
   // Update every block
   // estimates of DC offset, signal powers and phase error
-  sdr->DC += DC_alpha * (samp_sum/samples - sdr->DC);
-  float block_energy = i_energy + q_energy; // Normalize for complex pairs
+  sdr->DC += DC_alpha * (stats.sum/samples - sdr->DC);
+  Cond.DC = sdr->DC;
+  float block_energy = stats.i_energy + stats.q_energy; // Normalize for complex pairs
   if(block_energy > 0){ // Avoid divisions by 0, etc
     sdr->in_power = block_energy/samples; // Average A/D output power per channel  
-    sdr->imbalance += Rate_factor * samples * ((i_energy / q_energy) - sdr->imbalance);
-    float dpn = 2 * dotprod / block_energy;
+    sdr->imbalance += Rate_factor * samples * ((stats.i_energy / stats.q_energy) - sdr->imbalance);
+    float dpn = 2 * stats.dotprod / block_energy;
     sdr->sinphi += Rate_factor * samples * (dpn - sdr->sinphi);
-    gain_q = sqrtf(0.5 * (1 + sdr->imbalance));
-    gain_i = sqrtf(0.5 * (1 + 1./sdr->imbalance));
-    secphi = 1/sqrtf(1 - sdr->sinphi * sdr->sinphi); // sec(phi) = 1/cos(phi)
-    tanphi = sdr->sinphi * secphi;             // tan(phi) = sin(phi) * sec(phi) = sin(phi)/cos(phi)
+    Cond.gain_q = sqrtf(0.5 * (1 + sdr->imbalance));
+    Cond.gain_i = sqrtf(0.5 * (1 + 1./sdr->imbalance));
+    Cond.secphi = 1/sqrtf(1 - sdr->sinphi * sdr->sinphi); // sec(phi) = 1/cos(phi)
+    Cond.tanphi = sdr->sinphi * Cond.secphi;             // tan(phi) = sin(phi) * sec(phi) = sin(phi)/cos(phi)
   }
   return 0;
 }
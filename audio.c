@@ -1,6 +1,6 @@
 // $Id: audio.c,v 1.90 2018/12/24 05:24:47 karn Exp $
 // Audio multicast routines for KA9Q SDR receiver
-// Handles linear 16-bit PCM, mono and stereo
+// Handles linear 16-bit and 32-bit float PCM, mono and stereo, at the rates in PT_table
 // Copyright 2017 Phil Karn, KA9Q
 
 #define _GNU_SOURCE 1
@@ -11,12 +11,17 @@
 #include <string.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 #include "misc.h"
 #include "multicast.h"
 #include "radio.h"
 
-#define PCM_BUFSIZE 480        // 16-bit word count; must fit in Ethernet MTU
+#define PCM_BUFSIZE 960        // Payload bytes; must fit in Ethernet MTU
 #define PACKETSIZE 2048        // Somewhat larger than Ethernet MTU
 
 static short const scaleclip(float const x){
@@ -26,35 +31,105 @@ static short const scaleclip(float const x){
     return SHRT_MIN;
   return (short)(SHRT_MAX * x);
 }
-  
 
-// Send 'size' stereo samples, each in a pair of floats
-int send_stereo_output(struct demod * const demod,float const * buffer,int size){
+// Convert n floats to big-endian 16-bit PCM with scaleclip()'s scaling and clipping
+// Returns nonzero unless every sample is zero
+static int pcm_convert(int16_t * const out,float const * const in,int const n){
+  int i = 0;
+  int not_silent = 0;
+#if defined(__AVX2__)
+  __m256 const scale = _mm256_set1_ps(SHRT_MAX);
+  __m256 const neg1 = _mm256_set1_ps(-1.0);
+  __m256 const minval = _mm256_set1_ps(SHRT_MIN);
+  __m256i const swab = _mm256_setr_epi8(1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14,
+					  1,0,3,2,5,4,7,6,9,8,11,10,13,12,15,14);
+  __m256i any = _mm256_setzero_si256();
+  for(; i + 16 <= n; i += 16){
+    __m256 const x0 = _mm256_loadu_ps(in + i);
+    __m256 const x1 = _mm256_loadu_ps(in + i + 8);
+    // Positive overflow saturates in the pack; -1 and below go to SHRT_MIN as in scaleclip()
+    __m256 const s0 = _mm256_blendv_ps(_mm256_min_ps(_mm256_mul_ps(x0,scale),scale),minval,_mm256_cmp_ps(x0,neg1,_CMP_LE_OQ));
+    __m256 const s1 = _mm256_blendv_ps(_mm256_min_ps(_mm256_mul_ps(x1,scale),scale),minval,_mm256_cmp_ps(x1,neg1,_CMP_LE_OQ));
+    __m256i w = _mm256_packs_epi32(_mm256_cvttps_epi32(s0),_mm256_cvttps_epi32(s1));
+    w = _mm256_permute4x64_epi64(w,0xd8); // packs works within 128-bit lanes
+    w = _mm256_shuffle_epi8(w,swab);
+    _mm256_storeu_si256((__m256i *)(out + i),w);
+    any = _mm256_or_si256(any,w);
+  }
+  not_silent = !_mm256_testz_si256(any,any);
+#endif
+  for(; i < n; i++){
+    out[i] = htons(scaleclip(in[i]));
+    not_silent |= out[i];
+  }
+  return not_silent;
+}
 
+// Copy n floats to big-endian 32-bit float PCM; no clipping, the format has the headroom
+// Returns nonzero unless every sample is zero
+static int float_convert(uint32_t * const out,float const * const in,int const n){
+  int i = 0;
+  uint32_t not_silent = 0;
+#if defined(__AVX2__)
+  __m256i const swab = _mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+					  3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  __m256i any = _mm256_setzero_si256();
+  for(; i + 8 <= n; i += 8){
+    __m256i const w = _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i const *)(in + i)),swab);
+    _mm256_storeu_si256((__m256i *)(out + i),w);
+    any = _mm256_or_si256(any,w);
+  }
+  not_silent = !_mm256_testz_si256(any,any);
+#endif
+  for(; i < n; i++){
+    uint32_t w;
+    memcpy(&w,&in[i],sizeof(w));
+    out[i] = htonl(w);
+    not_silent |= out[i];
+  }
+  return not_silent != 0;
+}
 
+// Send 'size' frames of 'channels' interleaved floats in the channel's output encoding and sample rate
+// All the packets for the block go out in one sendmmsg() call
+// All-zero packets aren't sent, but still advance the timestamp; the next packet sent gets the marker bit
+static int send_pcm(struct demod * const demod,float const *buffer,int size,int const channels){
+  int const type = pt_from_info(demod->output.samprate,channels,demod->output.encoding);
+  if(type < 0)
+    return -1; // No payload type for this combination
+  int const bytes_per_sample = PT_table[type].encoding == F32BE ? sizeof(float) : sizeof(int16_t);
 
   struct rtp_header rtp;
   memset(&rtp,0,sizeof(rtp));
-  rtp.type = PCM_STEREO_PT;         // 16 bit linear, big endian, stereo
   rtp.version = RTP_VERS;
+  rtp.type = type;
   rtp.ssrc = demod->output.rtp.ssrc;
 
-  int16_t PCM_buf[PCM_BUFSIZE];
+  int const frames_per_packet = PCM_BUFSIZE / (bytes_per_sample * channels);
+  int const maxpackets = (size + frames_per_packet - 1) / frames_per_packet;
+  if(maxpackets <= 0)
+    return 0;
+
+  unsigned char packets[maxpackets][PACKETSIZE];
+  struct iovec iov[maxpackets];
+  int npackets = 0;
 
   while(size > 0){
-    int not_silent = 0;
-    int chunk = min(PCM_BUFSIZE,2*size);
-
-    for(int i=0; i < chunk; i ++){
-      float samp = *buffer++;
-      PCM_buf[i] = htons(scaleclip(samp));
-      not_silent |= PCM_buf[i];
-    }      
-    // If packet is all zeroes, don't send it but still increase the timestamp
+    int const frames = min(frames_per_packet,size);
+    int const chunk = frames * channels; // samples
+
+    unsigned char * const packet = packets[npackets];
+    int not_silent;
+    if(bytes_per_sample == sizeof(float))
+      not_silent = float_convert((uint32_t *)(packet + RTP_MIN_SIZE),buffer,chunk);
+    else
+      not_silent = pcm_convert((int16_t *)(packet + RTP_MIN_SIZE),buffer,chunk);
+    buffer += chunk;
+
     rtp.timestamp = demod->output.rtp.timestamp;
-    demod->output.rtp.timestamp += chunk/2; // Increase by sample count
+    demod->output.rtp.timestamp += frames; // Increase by sample count
     if(not_silent){
-      demod->output.rtp.bytes += sizeof(signed short) * chunk;
+      demod->output.rtp.bytes += bytes_per_sample * chunk;
       demod->output.rtp.packets++;
       if(demod->output.silent){
 	demod->output.silent = 0;
@@ -62,76 +137,50 @@ int send_stereo_output(struct demod * const demod,float const * buffer,int size)
       } else
 	rtp.marker = 0;
       rtp.seq = demod->output.rtp.seq++;
-      unsigned char packet[PACKETSIZE],*dp;
-      dp = packet;
-
-      dp = hton_rtp(dp,&rtp);
-      memcpy(dp,PCM_buf,2*chunk);
-      dp += 2*chunk;
-      int r = send(demod->output.data_fd,&packet,dp - packet,0);
-      demod->output.samples += chunk/2; // Count stereo samples
-      if(r < 0){
-	perror("pcm: send");
-	break;
-      }
+      hton_rtp(packet,&rtp);
+      iov[npackets].iov_base = packet;
+      iov[npackets].iov_len = RTP_MIN_SIZE + bytes_per_sample * chunk;
+      npackets++;
+      demod->output.samples += frames;
     } else
       demod->output.silent = 1;
-    size -= chunk/2;
+    size -= frames;
+  }
+#ifdef __linux__
+  struct mmsghdr msgs[npackets];
+  memset(msgs,0,sizeof(msgs));
+  for(int i=0; i < npackets; i++){
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  int sent = 0;
+  while(sent < npackets){
+    int const r = sendmmsg(demod->output.data_fd,msgs + sent,npackets - sent,0);
+    if(r < 0){
+      perror("pcm: sendmmsg");
+      break;
+    }
+    sent += r;
   }
+#else
+  for(int i=0; i < npackets; i++){
+    if(send(demod->output.data_fd,iov[i].iov_base,iov[i].iov_len,0) < 0){
+      perror("pcm: send");
+      break;
+    }
+  }
+#endif
   return 0;
 }
 
+// Send 'size' stereo samples, each in a pair of floats
+int send_stereo_output(struct demod * const demod,float const * buffer,int size){
+  return send_pcm(demod,buffer,size,2);
+}
+
 // Send 'size' mono samples, each in a float
 int send_mono_output(struct demod * const demod,float const * buffer,int size){
-
-  struct rtp_header rtp;
-  memset(&rtp,0,sizeof(rtp));
-  rtp.version = RTP_VERS;
-  rtp.type = PCM_MONO_PT;         // 16 bit linear, big endian, mono
-  rtp.ssrc = demod->output.rtp.ssrc;
-
-  int16_t PCM_buf[PCM_BUFSIZE];
-
-  while(size > 0){
-    int not_silent = 0;
-    int chunk = min(PCM_BUFSIZE,size); // # of mono samples (frames)
-
-    for(int i=0; i < chunk; i++){
-      float samp = *buffer++;
-      PCM_buf[i] = htons(scaleclip(samp));
-      not_silent |= PCM_buf[i];
-    }      
-    // If packet is all zeroes, don't send it but still increase the timestamp
-    rtp.timestamp = demod->output.rtp.timestamp;
-    demod->output.rtp.timestamp += chunk; // Increase by sample count
-    if(not_silent){
-      // Don't send silence, but timestamp is still incremented
-      demod->output.rtp.packets++;
-      demod->output.rtp.bytes += sizeof(signed short) * chunk;
-      if(demod->output.silent){
-	demod->output.silent = 0;
-	rtp.marker = 1;
-      } else
-	rtp.marker = 0;
-      rtp.seq = demod->output.rtp.seq++;
-      unsigned char packet[PACKETSIZE];
-      unsigned char *dp = packet;
-
-      dp = hton_rtp(dp,&rtp);
-      memcpy(dp,PCM_buf,2*chunk);
-      dp += 2 * chunk;
-
-      int r = send(demod->output.data_fd,&packet,dp - packet,0);
-      demod->output.samples += chunk;
-      if(r < 0){
-	perror("pcm: send");
-	break;
-      }
-    } else
-      demod->output.silent = 1;
-    size -= chunk;
-  }
-  return 0;
+  return send_pcm(demod,buffer,size,1);
 }
 
 void output_cleanup(void *p){
@@ -54,6 +54,7 @@ int Status_fd = -1;
 int Ctl_fd = -1;
 
 int Verbose,Dump;
+uint32_t Ssrc; // Select one channel of a multichannel radio; 0 = any
 
 void decode_radio_status(struct control *demod,unsigned char *buffer,int length);
 int preset_mode(struct control * const demod,const char * const mode); // Different from one in radio.c
@@ -217,11 +218,14 @@ void decode_sdr_status(struct control *demod,unsigned char *buffer,int length);
 int main(int argc,char *argv[]){
   int c;
 
-  while((c = getopt(argc,argv,"vd")) != EOF){
+  while((c = getopt(argc,argv,"vds:")) != EOF){
     switch(c){
     case 'v':
       Verbose++;
       break;
+    case 's':
+      Ssrc = strtol(optarg,NULL,0);
+      break;
     }
   }
 
@@ -370,6 +374,8 @@ int main(int argc,char *argv[]){
       struct control ndemod;
       memcpy(&ndemod,demod,sizeof(ndemod));
       decode_radio_status(&ndemod,buffer+1,length-1);
+      if(Ssrc != 0 && ndemod.output.rtp.ssrc != Ssrc)
+	continue; // Some other channel
       // Listen directly to the front end once we know who it is
       if(memcmp(&ndemod.input.metadata_dest_address,&demod->input.metadata_dest_address,sizeof(ndemod.input.metadata_dest_address)) != 0){
 	if(SDR_status_fd > 0){
@@ -786,6 +792,11 @@ int main(int argc,char *argv[]){
     mvwprintw(data,row,col,"%'6llu",demod->input.rtp.dupes);
     col += 7;
 
+    row = 1;
+    mvwprintw(data,row++,col,"%6s","late");
+    mvwprintw(data,row,col,"%'6llu",(long long unsigned)demod->input.late);
+    col += 7;
+
     row = 1;
     mvwprintw(data,row++,col,"%8s","ssrc");
     mvwprintw(data,row++,col,"%8x",demod->input.rtp.ssrc);
@@ -1188,6 +1199,8 @@ int main(int argc,char *argv[]){
       if(demod->opt.agc != old_demod.opt.agc)
 	encode_byte(&bp,AGC_ENABLE,demod->opt.agc);	
 
+      if(Ssrc != 0)
+	encode_int32(&bp,OUTPUT_SSRC,Ssrc);
       demod->output.command_tag = random();
       encode_int(&bp,COMMAND_TAG,demod->output.command_tag);
 
@@ -1273,6 +1286,9 @@ void decode_radio_status(struct control *demod,unsigned char *buffer,int length)
     case INPUT_DUPES:
       demod->input.rtp.dupes = decode_int(cp,optlen);
       break;
+    case INPUT_LATE:
+      demod->input.late = decode_int(cp,optlen);
+      break;
     case OUTPUT_DATA_SOURCE_SOCKET:
       decode_socket(&demod->output.data_source_address,cp,optlen);
       break;
@@ -1426,6 +1442,9 @@ void decode_radio_status(struct control *demod,unsigned char *buffer,int length)
     case OUTPUT_CHANNELS:
       demod->output.channels = decode_int(cp,optlen);
       break;
+    case OUTPUT_ENCODING:
+      demod->output.encoding = decode_int(cp,optlen);
+      break;
     case OUTPUT_LEVEL:
       demod->output.level = decode_float(cp,optlen);
       break;
@@ -35,6 +35,7 @@ struct control {
     struct sockaddr_storage data_source_address; // Source of I/Q data
     struct sockaddr_storage data_dest_address;   // Dest of I/Q data (typically multicast)
     struct rtp_state rtp; // State of the I/Q RTP receiver
+    uint64_t late;        // Packets arriving too late to reorder
     uint64_t samples;    // Count of raw I/Q samples received
     int samprate;
     uint64_t commands;
@@ -123,6 +124,7 @@ struct control {
   // Radio output
   struct {
     int samprate;       // Audio D/A sample rate (usually 48 kHz)
+    enum encoding encoding; // S16BE or F32BE
     // RTP network streaming
     struct rtp_state rtp;
     struct sockaddr_storage metadata_source_address; // Source of SDR metadata
@@ -0,0 +1,76 @@
+// $Id$
+// Complex float vector primitives shared by the filter and oscillator kernels
+// Complex vectors of interleaved floats: 8 elements per instruction with AVX-512, 4 with AVX2+FMA
+// Copyright 2019, Phil Karn, KA9Q
+#ifndef _CVEC_H
+#define _CVEC_H 1
+
+#include <string.h>
+#include <complex.h>
+#undef I
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
+
+#if defined(__AVX512F__)
+#define CVLEN 8
+typedef __m512 cvec;
+static inline cvec cv_load(complex float const *p){ return _mm512_loadu_ps((float const *)p); }
+static inline void cv_store(complex float *p,cvec v){ _mm512_storeu_ps((float *)p,v); }
+static inline cvec cv_set1(complex float x){
+  double d;
+  memcpy(&d,&x,sizeof(d));
+  return _mm512_castpd_ps(_mm512_set1_pd(d));
+}
+static inline cvec cv_add(cvec a,cvec b){ return _mm512_add_ps(a,b); }
+static inline cvec cv_sub(cvec a,cvec b){ return _mm512_sub_ps(a,b); }
+static inline cvec cv_mul(cvec a,cvec b){
+  cvec const t = _mm512_mul_ps(_mm512_permute_ps(a,0xb1),_mm512_movehdup_ps(b));
+  return _mm512_fmaddsub_ps(a,_mm512_moveldup_ps(b),t);
+}
+static inline cvec cv_conj(cvec a){
+  __m512i const mask = _mm512_set_epi32(0x80000000,0,0x80000000,0,0x80000000,0,0x80000000,0,
+					0x80000000,0,0x80000000,0,0x80000000,0,0x80000000,0);
+  return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a),mask));
+}
+// Reverse the order of the complex elements
+static inline cvec cv_rev(cvec a){
+  return _mm512_castpd_ps(_mm512_permutexvar_pd(_mm512_set_epi64(0,1,2,3,4,5,6,7),_mm512_castps_pd(a)));
+}
+#elif defined(__AVX2__) && defined(__FMA__)
+#define CVLEN 4
+typedef __m256 cvec;
+static inline cvec cv_load(complex float const *p){ return _mm256_loadu_ps((float const *)p); }
+static inline void cv_store(complex float *p,cvec v){ _mm256_storeu_ps((float *)p,v); }
+static inline cvec cv_set1(complex float x){
+  double d;
+  memcpy(&d,&x,sizeof(d));
+  return _mm256_castpd_ps(_mm256_set1_pd(d));
+}
+static inline cvec cv_add(cvec a,cvec b){ return _mm256_add_ps(a,b); }
+static inline cvec cv_sub(cvec a,cvec b){ return _mm256_sub_ps(a,b); }
+static inline cvec cv_mul(cvec a,cvec b){
+  cvec const t = _mm256_mul_ps(_mm256_permute_ps(a,0xb1),_mm256_movehdup_ps(b));
+  return _mm256_fmaddsub_ps(a,_mm256_moveldup_ps(b),t);
+}
+static inline cvec cv_conj(cvec a){
+  return _mm256_xor_ps(a,_mm256_setr_ps(0,-0.0f,0,-0.0f,0,-0.0f,0,-0.0f));
+}
+static inline cvec cv_rev(cvec a){
+  return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(a),0x1b));
+}
+#else
+// Portable version; one element at a time
+#define CVLEN 1
+typedef complex float cvec;
+static inline cvec cv_load(complex float const *p){ return *p; }
+static inline void cv_store(complex float *p,cvec v){ *p = v; }
+static inline cvec cv_set1(complex float x){ return x; }
+static inline cvec cv_add(cvec a,cvec b){ return a + b; }
+static inline cvec cv_sub(cvec a,cvec b){ return a - b; }
+static inline cvec cv_mul(cvec a,cvec b){ return a * b; }
+static inline cvec cv_conj(cvec a){ return conjf(a); }
+static inline cvec cv_rev(cvec a){ return a; }
+#endif
+
+#endif
@@ -1,166 +1,507 @@
 // $Id: decimate.c,v 1.8 2018/12/03 11:43:00 karn Exp karn $
-// half-band filters for sample rate decimation by powers of 2
-// Note: filters have unity middle tap, which usually results in overall gain of +6 dB
+// Decimate-by-2 filter chains for sample rate reduction by powers of 2
+// Note: every stage has a DC gain of 2, so the chain has a gain of +6 dB per stage
 // Copyright July 2018, Phil Karn, KA9Q
 
 #include <string.h>
+#include <stdlib.h>
+#include <math.h>
 #include <assert.h>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+#include "misc.h"
 #include "decimate.h"
 
-// Pick up vectorized versions if available
-#if defined(__SSSE3__)
-#if 0 // messages apparently treated as warnings
-#pragma message "Vectorized versions of decimation filters will require SSSE3 or better to run"
+#define HB_TILE 64           // Outputs per filter tile; bounds the stack copies of the two phases
+#define HB_CASCADE_BLOCK 64  // Final outputs per cache block when running a whole cascade
+#define HB_RIPPLE 0.1        // dB of CIC passband droop tolerated before the final stage compensates for it
+#define HB_MAX_DROOP 1.0     // dB; more than a 3-tap compensator can flatten, so don't use a CIC there
+#define HB_GRID 64           // Frequency points checked across each stopband
+
+char const *Hb_type_names[] = {
+  [HB_CIC] = "CIC",
+  [HB_HALFBAND] = "halfband",
+  [HB_FIR] = "FIR",
+};
+
+/* Polyphase forms
+   With the input split into its even and odd phases E[j] = x[2j], O[j] = x[2j+1]
+   a halfband with K coefficient pairs (4K-1 taps) is
+
+   y[m] = E[m-K+1] + sum(k=0..K-1) c[k]*(O[m-k] + O[m-2K+1+k])
+
+   and a general L-tap FIR h[] is
+
+   y[m] = sum(i) h[2i]*O[m-i] + sum(i) h[2i+1]*E[m-i]
+
+   The coefficients are real, so on interleaved I/Q the same expressions apply
+   float by float: one AVX2 register holds four complex outputs, and
+   the filters need no horizontal adds or shuffles beyond the phase split.
+   The kernels are inlined into a wrapper for each length so the tap loops unroll
+*/
+
+// Split n complex pairs into their even and odd phases
+static void split_phases(complex float * restrict even,complex float * restrict odd,complex float const * restrict in,int n){
+  int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  for(; i + 4 <= n; i += 4){
+    __m256d const a = _mm256_loadu_pd((double const *)(in + 2*i));     // x0 x1 x2 x3
+    __m256d const b = _mm256_loadu_pd((double const *)(in + 2*i + 4)); // x4 x5 x6 x7
+    _mm256_storeu_pd((double *)(even + i),_mm256_permute4x64_pd(_mm256_unpacklo_pd(a,b),0xd8)); // x0 x2 x4 x6
+    _mm256_storeu_pd((double *)(odd + i),_mm256_permute4x64_pd(_mm256_unpackhi_pd(a,b),0xd8));  // x1 x3 x5 x7
+  }
 #endif
+  for(; i < n; i++){
+    even[i] = in[2*i];
+    odd[i] = in[2*i+1];
+  }
+}
 
-  #include <x86intrin.h>  // GCC-compatible compiler, targeting x86/x86-64
-
-/* Folded half-band 15-tap filter
-   Only four non-unity coefficents are needed
-   Note ordering of coefficients: coeff[0] is at the tails, not the center
-
-  |--   even[3]   even[2]    even[1]    even[0]  <-- in first
-  v
-drop
-
-  --     odd[3]    odd[2]     odd[1]     odd[0]  <-- in second
-  |
-  |       +         +          +          +
-  |
-  |-->oldodd[3]  oldodd[2]  oldodd[1]  oldodd[0] --------|
-          *          *           *          *            v
-       coeff[3]   coeff[2]   coeff[1]   coeff[0]        drop
-          v          v           v          v
-        temp[3]    temp[2]    temp[1]    temp[0]
-       sum(temp[3...0] + even[3]) to give output
- */
-
-// Strong typing can be a major pain in the ass...
-#pragma GCC diagnostic push
-#pragma GCC diagnostic ignored "-Wincompatible-pointer-types"
-
-
-#define shiftleft(arg,n) _mm_castsi128_ps(_mm_bslli_si128(_mm_castps_si128(arg),4*n))
-#define shiftright(arg,n) _mm_castsi128_ps(_mm_bsrli_si128(_mm_castps_si128(arg),4*n))
-
-void hb15_block(struct hb15_state *state,float *output,float *input,int cnt){
-  __m128 coeffs= _mm_loadu_ps(state->coeffs);  // coeffs in xmm5;
-  __m128 even_samples = _mm_loadu_ps(state->even_samples); // xmm3;
-  __m128 odd_samples = _mm_loadu_ps(state->odd_samples); // xmm1;
-  __m128 old_odd_samples = _mm_loadu_ps(state->old_odd_samples); // xmm2;
-  __m128 temp = _mm_setzero_ps(); // Not really necessary but silences compiler warning
-  __m128 mask3 = (__m128) _mm_set_epi32(-1,0,0,0); // For selecting high word of vector
-
-  while(cnt--){
-    temp = _mm_loadl_pi(temp,input); // X   X  IN[1] IN[0]
-    input += 2;
-    even_samples = _mm_move_ss(even_samples,temp);  // ES[3] ES[2] ES[1] in[0]
-    temp = shiftright(temp,1);
-    odd_samples = _mm_move_ss(odd_samples,temp);  // OS[3] OS[2] OS[1] in[1]
-
-    temp = _mm_mul_ps(_mm_add_ps(odd_samples,old_odd_samples),coeffs); // all taps but the middle
-    // Right shift old_odd_samples (no longer need old_odd_samples[0])
-    // sets old_odd_samples[3] = 0 in preparation for ORing later with odd_samples[3]
-    old_odd_samples = shiftright(old_odd_samples,1);  // 0 OOS[3] OOS[2] OOS[1]
-
-    // old_odd_samples[3] = odd_samples[3]
-    old_odd_samples = _mm_or_ps(old_odd_samples,_mm_and_ps(odd_samples,mask3));
-
-    // left shift odd samples
-    odd_samples = shiftleft(odd_samples,1);
-
-    // Sum up terms
-    temp = _mm_add_ps(temp,_mm_and_ps(even_samples,mask3)); // even_samples[3] (central tap, unity gain)
-    temp = _mm_hadd_ps(temp,temp);
-    temp = _mm_hadd_ps(temp,temp);    
-
-    // Left shift one word (no longer need even_samples[3])
-    even_samples = shiftleft(even_samples,1);
+// Halfband with K coefficient pairs; decimate 2*cnt complex inputs to cnt outputs
+// Output may be the same as input
+static inline __attribute__((always_inline)) void halfband(struct hb_stage *stage,complex float *output,complex float const *input,int cnt,int const K){
+  float const * const c = stage->coeffs;
+  int const ehist = K-1;
+  int const ohist = 2*K-1;
+  while(cnt > 0){
+    int const n = min(HB_TILE,cnt);
+    complex float e[HB_MAXHIST + HB_TILE];
+    complex float o[HB_MAXHIST + HB_TILE];
+    memcpy(e,stage->even,ehist * sizeof(*e));
+    memcpy(o,stage->odd,ohist * sizeof(*o));
+    split_phases(e + ehist,o + ohist,input,n);
+    input += 2*n;
+
+    float const * const ef = (float *)e;
+    float const * const of = (float *)o;
+    float * const out = (float *)output;
+    int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+    for(; i + 8 <= 2*n; i += 8){
+      __m256 y = _mm256_loadu_ps(ef + i);
+      for(int k=0; k < K; k++)
+	y = _mm256_fmadd_ps(_mm256_set1_ps(c[k]),_mm256_add_ps(_mm256_loadu_ps(of + i + 2*k),_mm256_loadu_ps(of + i + 2*(ohist-k))),y);
+      _mm256_storeu_ps(out + i,y);
+    }
+#endif
+    for(; i < 2*n; i++){
+      float y = ef[i];
+      for(int k=0; k < K; k++)
+	y += c[k] * (of[i + 2*k] + of[i + 2*(ohist-k)]);
+      out[i] = y;
+    }
+    output += n;
+    memcpy(stage->even,e + n,ehist * sizeof(*e));
+    memcpy(stage->odd,o + n,ohist * sizeof(*o));
+    cnt -= n;
+  }
+}
 
-    // Stash result:     *output++ = result;
-    _mm_store_ss(output++,temp);
+// General L-tap decimate-by-2 FIR, same conventions
+static inline __attribute__((always_inline)) void fir(struct hb_stage *stage,complex float *output,complex float const *input,int cnt,int const L){
+  float const * const h = stage->coeffs;
+  int const hist = L/2;
+  while(cnt > 0){
+    int const n = min(HB_TILE,cnt);
+    complex float e[HB_MAXHIST + HB_TILE];
+    complex float o[HB_MAXHIST + HB_TILE];
+    memcpy(e,stage->even,hist * sizeof(*e));
+    memcpy(o,stage->odd,hist * sizeof(*o));
+    split_phases(e + hist,o + hist,input,n);
+    input += 2*n;
+
+    float const * const ef = (float *)(e + hist);
+    float const * const of = (float *)(o + hist);
+    float * const out = (float *)output;
+    int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+    for(; i + 8 <= 2*n; i += 8){
+      __m256 y = _mm256_setzero_ps();
+      for(int k=0; k < L; k++)
+	y = _mm256_fmadd_ps(_mm256_set1_ps(h[k]),_mm256_loadu_ps(((k & 1) ? ef : of) + i - 2*(k/2)),y);
+      _mm256_storeu_ps(out + i,y);
+    }
+#endif
+    for(; i < 2*n; i++){
+      float y = 0;
+      for(int k=0; k < L; k++)
+	y += h[k] * ((k & 1) ? ef : of)[i - 2*(k/2)];
+      out[i] = y;
+    }
+    output += n;
+    memcpy(stage->even,e + n,hist * sizeof(*e));
+    memcpy(stage->odd,o + n,hist * sizeof(*o));
+    cnt -= n;
   }
-  _mm_storeu_ps(state->even_samples,even_samples);
-  _mm_storeu_ps(state->odd_samples,odd_samples);
-  _mm_storeu_ps(state->old_odd_samples,old_odd_samples);
 }
 
+// Specialized kernels, one per length
+static void hb7_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ halfband(s,out,in,cnt,2); }
+static void hb11_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ halfband(s,out,in,cnt,3); }
+static void hb15_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ halfband(s,out,in,cnt,4); }
+static void hb23_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ halfband(s,out,in,cnt,6); }
+static void hb31_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ halfband(s,out,in,cnt,8); }
+static void cic2_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ fir(s,out,in,cnt,3); }
+static void cic3_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ fir(s,out,in,cnt,4); }
+static void cic4_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ fir(s,out,in,cnt,5); }
+static void fir_kernel(struct hb_stage *s,complex float *out,complex float const *in,int cnt){ fir(s,out,in,cnt,s->taps); }
+
+// Candidate stages in order of increasing cost per output
+static struct {
+  enum hb_type type;
+  int taps;
+  void (*kernel)(struct hb_stage *,complex float *,complex float const *,int);
+} const Candidates[] = {
+  { HB_CIC, 3, cic2_kernel },
+  { HB_CIC, 4, cic3_kernel },
+  { HB_HALFBAND, 7, hb7_kernel },
+  { HB_CIC, 5, cic4_kernel },
+  { HB_HALFBAND, 11, hb11_kernel },
+  { HB_HALFBAND, 15, hb15_kernel },
+  { HB_HALFBAND, 23, hb23_kernel },
+  { HB_HALFBAND, 31, hb31_kernel },
+};
+
+// Filter design, done once at setup in double precision
+
+// Modified Bessel function of the 0th kind, for the Kaiser window
+static double bessel_i0(double const z){
+  double const t = z*z/4;
+  double sum = 1;
+  double term = 1;
+  for(int k=1; k < 60 && term > 1e-15 * sum; k++){
+    term *= t / ((double)k*k);
+    sum += term;
+  }
+  return sum;
+}
 
-// 3-tap halfband filter with fixed taps: 1, 2, 1
-void hb3_block(float *state,float *output,float *input,int cnt){
+static double kaiser(int const n,int const L,double const beta){
+  double const p = 2.0 * n / (L-1) - 1;
+  return bessel_i0(beta * sqrt(fmax(0,1 - p*p))) / bessel_i0(beta);
+}
 
-  __m128 oldstate = _mm_load_ss(state);   // 0   0        0        S
-  __m128 in = _mm_setzero_ps();            // 0   0        0        0
+// Kaiser's estimate of beta for a given stopband attenuation in dB
+static double kaiser_beta(double const atten){
+  if(atten > 50)
+    return 0.1102 * (atten - 8.7);
+  if(atten > 21)
+    return 0.5842 * pow(atten - 21,0.4) + 0.07886 * (atten - 21);
+  return 0;
+}
 
-  while(cnt--){
-    in = _mm_loadl_pi(in,input);   // 0   0       IN[1]  IN[0]
-    input += 2;
-    
-    __m128 temp;
-    temp = _mm_unpacklo_ps(in,oldstate); // 0   IN[1]            S           IN[0]
-    temp = _mm_add_ps(temp,in);    // 0   IN[1]             S+IN[1]      2*IN[0]
-    temp = _mm_hadd_ps(temp,temp); // IN[1]   S+IN[1]+2*IN[0]        IN[1]   S+IN[1]+2*IN[0]
-    _mm_store_ss(output++,temp);   // Store result
-    oldstate = shiftright(in,1);
+// Worst-case rejection, relative to DC, of h[0..L-1] over the stopband [0.5-p, 0.5] cycles/sample
+static double stopband_rejection(double const *h,int const L,double const p){
+  double dc = 0;
+  for(int n=0; n < L; n++)
+    dc += h[n];
+  double worst = 0;
+  for(int g=0; g <= HB_GRID; g++){
+    double const f = 0.5 - p + p * g / HB_GRID;
+    double complex r = 0;
+    for(int n=0; n < L; n++)
+      r += h[n] * cexp(-2*M_PI*_Complex_I*f*n);
+    worst = fmax(worst,cabs(r));
   }
-  _mm_store_ss(state,oldstate);
+  return worst > 0 ? 20*log10(fabs(dc) / worst) : INFINITY;
 }
-#pragma GCC diagnostic pop
 
-#else
+// Kaiser-windowed sinc halfband with unity center tap and DC gain 2
+static void design_halfband(double *h,int const L,double const beta){
+  int const mid = L/2;
+  double sum = 0;
+  for(int n=0; n < L; n++){
+    int const k = n - mid;
+    h[n] = (k & 1) ? kaiser(n,L,beta) * sin(M_PI*k/2) / (M_PI*k/2) : 0;
+    sum += h[n];
+  }
+  // Scale only the odd taps so the filter stays a halfband
+  for(int n=0; n < L; n++)
+    h[n] /= sum;
+  h[mid] = 1;
+}
 
-// Portable version - written to help the compiler vectorize at least partly
-void hb15_block(struct hb15_state *state,float *output,float *input,int cnt){
-  float even_samples[4];
-  float odd_samples[4];
-  float old_odd_samples[4];
-  float coeffs[4];
+// Kaiser-windowed sinc lowpass cut off at half the output rate, followed (by the noble identity)
+// by the output-rate compensator -a, 1+2a, -a; DC gain 2
+static void design_fir(double *h,int const L,double const beta,double const a){
+  int const M = L - 4; // Length before the compensator
+  double lp[M];
+  for(int n=0; n < M; n++){
+    double const k = n - (M-1)/2.;
+    lp[n] = kaiser(n,M,beta) * (k == 0 ? 1 : sin(M_PI*k/2) / (M_PI*k/2));
+  }
+  double const comp[5] = { -a, 0, 1 + 2*a, 0, -a };
+  double sum = 0;
+  for(int n=0; n < L; n++){
+    h[n] = 0;
+    for(int j=0; j < 5; j++)
+      if(n - j >= 0 && n - j < M)
+	h[n] += comp[j] * lp[n-j];
+    sum += h[n];
+  }
+  for(int n=0; n < L; n++)
+    h[n] *= 2 / sum;
+}
 
-  memcpy(coeffs, state->coeffs, sizeof(coeffs));
-  memcpy(even_samples, state->even_samples, sizeof(even_samples));
-  memcpy(odd_samples, state->odd_samples, sizeof(odd_samples));
-  memcpy(old_odd_samples, state->old_odd_samples, sizeof(old_odd_samples));
+// Pick the cheapest stage that gives the required rejection
+// p is the protected band edge in cycles/sample at the stage's input rate
+static int plan_stage(struct hb_stage *stage,double const p,double const atten){
+  for(int i=0; i < (int)(sizeof(Candidates)/sizeof(Candidates[0])); i++){
+    int const L = Candidates[i].taps;
+    double h[L];
+    double best = -INFINITY;
+    if(Candidates[i].type == HB_CIC){
+      // Binomial taps; each one adds droop in the passband
+      if(-20*(L-1)*log10(cos(M_PI*p)) > HB_MAX_DROOP)
+	continue;
+      double b = 1;
+      for(int n=0; n < L; n++){
+	h[n] = b / (1 << (L-2));
+	b = b * (L-1-n) / (n+1);
+      }
+      best = stopband_rejection(h,L,p);
+    } else {
+      // Search the window shape; short filters do best with less than Kaiser's estimate
+      double hb[L];
+      for(double beta = 0; beta <= 12; beta += 0.25){
+	design_halfband(hb,L,beta);
+	double const r = stopband_rejection(hb,L,p);
+	if(r > best){
+	  best = r;
+	  memcpy(h,hb,sizeof(h));
+	}
+      }
+    }
+    if(best < atten && i < (int)(sizeof(Candidates)/sizeof(Candidates[0])) - 1)
+      continue;
+
+    // Found one, or settle for the longest halfband
+    stage->type = Candidates[i].type;
+    stage->taps = L;
+    stage->rejection = best;
+    stage->kernel = Candidates[i].kernel;
+    if(stage->type == HB_HALFBAND){
+      int const K = (L+1)/4;
+      for(int k=0; k < K; k++)
+	stage->coeffs[k] = h[2*k]; // tails first
+    } else {
+      for(int n=0; n < L; n++)
+	stage->coeffs[n] = h[n];
+    }
+    return best >= atten ? 0 : -1;
+  }
+  return -1;
+}
 
-  while(cnt--){
-    even_samples[0] = *input++;
-    odd_samples[0] = *input++;
+// Final polyphase FIR, compensating for 'droop' dB at the protected band edge
+static int plan_fir(struct hb_stage *stage,double const p,double const atten,double const droop,double const passband){
+  // Compensator gain rises as 1 + 2a(1 - cos(w)) at the output rate
+  double const a = (pow(10,droop/20) - 1) / (2 * (1 - cos(2*M_PI*passband)));
+  double const beta = kaiser_beta(atten);
+  int L = (int)ceil((atten - 7.95) / (14.36 * (0.5 - 2*p))) + 5;
+  L = max(L,8);
+  double h[HB_MAXFIR];
+  double r = -INFINITY;
+  for(; L <= HB_MAXFIR; L++){
+    design_fir(h,L,beta,a);
+    r = stopband_rejection(h,L,p);
+    if(r >= atten)
+      break;
+  }
+  L = min(L,HB_MAXFIR);
+  stage->type = HB_FIR;
+  stage->taps = L;
+  stage->rejection = r;
+  stage->kernel = fir_kernel;
+  for(int n=0; n < L; n++)
+    stage->coeffs[n] = h[n];
+  return r >= atten ? 0 : -1;
+}
 
-    float result = even_samples[3];
-    for(int i=2; i >= 0; i--)
-      even_samples[i+1] = even_samples[i];
+struct hb_cascade *create_hb_cascade(int stages,float passband,float rejection){
+  assert(stages >= 0);
+  if(stages < 0 || passband <= 0 || passband >= 0.5)
+    return NULL;
+
+  struct hb_cascade * const cascade = calloc(1,sizeof(*cascade));
+  if(cascade == NULL)
+    return NULL;
+  cascade->stages = stages;
+  cascade->passband = passband;
+  cascade->rejection = rejection;
+  cascade->stage = calloc(stages + 1,sizeof(*cascade->stage));
+  if(cascade->stage == NULL){
+    delete_hb_cascade(cascade);
+    return NULL;
+  }
+  // Stage j decimates from 2^(j+1) to 2^j times the output rate. Everything between
+  // the protected band and its image at the stage's output rate is removed by later
+  // stages, so the transition band narrows toward the output and the early stages are cheap
+  double droop = 0;
+  for(int j = stages-1; j >= 0; j--){
+    double const p = passband / (2 << j);
+    struct hb_stage * const stage = &cascade->stage[j];
+    int const r = plan_stage(stage,p,rejection);
+    double const d = stage->type == HB_CIC ? -20*(stage->taps-1)*log10(cos(M_PI*p)) : 0;
+    if(j > 0)
+      droop += d;
+    else if(r != 0 || droop + d > HB_RIPPLE)
+      plan_fir(stage,p,rejection,droop,passband); // Replaces the last stage, flattening the earlier CICs
+  }
+  return cascade;
+}
 
-    for(int i=0; i < 4; i++)
-      result += (odd_samples[i] + old_odd_samples[i]) * coeffs[i];
-    
-    *output++ = result;
+void delete_hb_cascade(struct hb_cascade *cascade){
+  if(cascade == NULL)
+    return;
+  free(cascade->stage);
+  free(cascade);
+}
 
-    for(int i=0; i < 3; i++)
-      old_odd_samples[i] = old_odd_samples[i+1];
-    
-    old_odd_samples[3] = odd_samples[3];
-    
-    for(int i=2; i >= 0; i--)
-      odd_samples[i+1] = odd_samples[i];
+// Decimate cnt << stages complex inputs to cnt outputs
+// The input is used as scratch; output may be the same as input
+// All the stages run over one block of input before moving on to the next,
+// so each block stays in cache from the first stage to the last
+void hb_cascade_block(struct hb_cascade *cascade,complex float *output,complex float *input,int cnt){
+  int const stages = cascade->stages;
+  if(stages == 0){
+    memmove(output,input,cnt * sizeof(*output));
+    return;
+  }
+  for(int done = 0; done < cnt; done += HB_CASCADE_BLOCK){
+    int const n = min(HB_CASCADE_BLOCK,cnt - done);
+    complex float * const ip = input + ((long)done << stages);
+    for(int j = stages-1; j >= 0; j--){
+      struct hb_stage * const stage = &cascade->stage[j];
+      complex float * const op = j == 0 ? output + done : ip; // Earlier stages work in place
+      (*stage->kernel)(stage,op,ip,n << j);
+    }
   }
-  memcpy(state->even_samples, even_samples, sizeof(even_samples));
-  memcpy(state->odd_samples, odd_samples, sizeof(odd_samples));
-  memcpy(state->old_odd_samples, old_odd_samples, sizeof(old_odd_samples));
 }
-// 3-tap halfband filter with fixed taps: 1, 2, 1
-void hb3_block(float *state,float *output,float *input,int cnt){
-
-  float oldstate = *state;
 
-  while(cnt--){
-    float in[2];
-    in[0] = *input++;
-    in[1] = *input++;
+static int gcd(int a,int b){
+  while(b != 0){
+    int const t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
 
-    *output++ = 2 * in[0] + in[1] + oldstate;
-    oldstate = in[1];
+// Resample from in_rate to out_rate, protecting |f| <= passband * out_rate from aliasing
+// Returns NULL if the rates are unusable
+struct resampler *create_resampler(int in_rate,int out_rate,float passband,float rejection){
+  if(in_rate <= 0 || out_rate <= 0 || out_rate > in_rate || passband <= 0 || passband >= 0.5)
+    return NULL;
+  struct resampler * const rs = calloc(1,sizeof(*rs));
+  if(rs == NULL)
+    return NULL;
+  int const g = gcd(in_rate,out_rate);
+  rs->interp = out_rate / g;
+  rs->decim = in_rate / g;
+  rs->phases = min(rs->interp,RS_MAXPHASES);
+
+  // Transition band from the protected edge to its image about half the output rate
+  double const df = (double)out_rate * (1 - 2*passband) / in_rate; // cycles/input sample
+  int taps = (int)ceil((rejection - 7.95) / (14.36 * df)) + 1;
+  taps = (min(max(taps,4),RS_MAXTAPS) + 3) & ~3;
+  rs->taps = taps;
+  rs->rejection = min((double)rejection,14.36 * df * (taps-1) + 7.95);
+
+  rs->coeffs = malloc((rs->phases + 1) * 2 * taps * sizeof(*rs->coeffs));
+  rs->buf = calloc(taps + RS_BLOCK,sizeof(*rs->buf));
+  if(rs->coeffs == NULL || rs->buf == NULL){
+    delete_resampler(rs);
+    return NULL;
+  }
+  // Prototype lowpass at phases * in_rate, cut off at half the output rate
+  // Row r, tap k samples it at k + r/phases input samples from its start
+  int const P = rs->phases;
+  int const N = taps * P;
+  double const fc = 0.5 * out_rate / ((double)in_rate * P);
+  double const beta = kaiser_beta(rs->rejection);
+  double sum = 0;
+  double *proto = malloc((N + 1) * sizeof(*proto));
+  if(proto == NULL){
+    delete_resampler(rs);
+    return NULL;
   }
-  *state = oldstate;
+  for(int n=0; n <= N; n++){
+    double const t = n - N/2.;
+    proto[n] = kaiser(n,N+1,beta) * (t == 0 ? 2*fc : sin(2*M_PI*fc*t) / (M_PI*t));
+    if(n < N)
+      sum += proto[n];
+  }
+  for(int r=0; r <= P; r++){
+    float * const row = rs->coeffs + 2 * taps * r;
+    for(int k=0; k < taps; k++){
+      int const n = k * P + r;
+      float const h = n <= N ? proto[n] * P / sum : 0;
+      // Reversed, so the row lines up with the input in time order
+      row[2*(taps-1-k)] = row[2*(taps-1-k)+1] = h;
+    }
+  }
+  free(proto);
+  rs->count = taps - 1; // Start with zero history
+  rs->pos = taps - 1;
+  return rs;
 }
 
+void delete_resampler(struct resampler *rs){
+  if(rs == NULL)
+    return;
+  free(rs->coeffs);
+  free(rs->buf);
+  free(rs);
+}
 
+// Resample cnt input samples, returning the number of outputs
+// output must have room for cnt * interp / decim + 1 samples
+int resample(struct resampler *rs,complex float *output,complex float const *input,int cnt){
+  int const taps = rs->taps;
+  int produced = 0;
+  while(cnt > 0){
+    int const n = min(RS_BLOCK - (rs->count - (taps - 1)),cnt);
+    memcpy(rs->buf + rs->count,input,n * sizeof(*input));
+    rs->count += n;
+    input += n;
+    cnt -= n;
+
+    while(rs->pos < rs->count){
+      // Nearest phase; exact when interp <= RS_MAXPHASES
+      int const r = (int)(((long)rs->frac * rs->phases + rs->interp/2) / rs->interp);
+      float const * const h = rs->coeffs + 2 * taps * r;
+      float const * const x = (float *)(rs->buf + rs->pos - (taps - 1));
+      int k = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+      __m256 acc = _mm256_setzero_ps();
+      for(; k < 2*taps; k += 8)
+	acc = _mm256_fmadd_ps(_mm256_loadu_ps(h + k),_mm256_loadu_ps(x + k),acc);
+      __m128 s = _mm_add_ps(_mm256_castps256_ps128(acc),_mm256_extractf128_ps(acc,1)); // i q i q
+      s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+      _mm_storel_pi((__m64 *)(output + produced),s);
+#else
+      float i = 0, q = 0;
+      for(; k < 2*taps; k += 2){
+	i += h[k] * x[k];
+	q += h[k+1] * x[k+1];
+      }
+      output[produced] = CMPLXF(i,q);
 #endif
+      produced++;
+      rs->frac += rs->decim;
+      rs->pos += rs->frac / rs->interp;
+      rs->frac %= rs->interp;
+    }
+    // Keep just the history the next output needs
+    int const keep = rs->pos - (taps - 1);
+    if(keep > 0){
+      int const k = min(keep,rs->count);
+      memmove(rs->buf,rs->buf + k,(rs->count - k) * sizeof(*rs->buf));
+      rs->count -= k;
+      rs->pos -= k;
+    }
+  }
+  return produced;
+}
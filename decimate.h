@@ -1,14 +1,63 @@
 #ifndef _DECIMATE_H
 #define _DECIMATE_H 1
 
-struct hb15_state {
-  float coeffs[4];
-  float even_samples[4];
-  float odd_samples[4];
-  float old_odd_samples[4];
+#include <complex.h>
+
+// Complex (interleaved I/Q) decimate-by-2 filter chains
+// Each stage halves the sample rate with a DC gain of 2 (+6 dB)
+
+#define HB_MAXFIR 255                 // Longest final FIR stage
+#define HB_MAXHIST (HB_MAXFIR/2 + 1)  // Phase history for the longest stage
+
+enum hb_type {
+  HB_CIC,       // Non-recursive CIC, (1+z^-1)^order; taps = order+1
+  HB_HALFBAND,  // 7, 11, 15, 23 or 31-tap halfband
+  HB_FIR,       // General polyphase FIR, with any CIC droop compensation folded in
+};
+extern char const *Hb_type_names[];
+
+struct hb_stage {
+  enum hb_type type;
+  int taps;          // Filter length at the stage's input rate
+  float rejection;   // Alias rejection achieved in the protected band, dB
+  float coeffs[HB_MAXFIR]; // HB_HALFBAND: odd taps only, tails first; others: all taps
+  complex float even[HB_MAXHIST]; // Phase histories
+  complex float odd[HB_MAXHIST];
+  void (*kernel)(struct hb_stage *,complex float *,complex float const *,int);
 };
-void hb15_block(struct hb15_state *state,float *output,float *input,int cnt);
-void hb3_block(float *state,float *output,float *input,int cnt);
 
+// Chain of 'stages' decimate-by-2 filters, decimating by 2^stages
+// stage[j] runs at 2^j times the output rate
+// The plan protects |f| <= passband * output rate from aliasing by at least 'rejection' dB
+struct hb_cascade {
+  int stages;
+  float passband;
+  float rejection;
+  struct hb_stage *stage;
+};
+struct hb_cascade *create_hb_cascade(int stages,float passband,float rejection);
+void delete_hb_cascade(struct hb_cascade *);
+void hb_cascade_block(struct hb_cascade *cascade,complex float *output,complex float *input,int cnt);
+
+// Rational-ratio polyphase resampler, for output rates that aren't the input rate over a power of 2
+#define RS_MAXPHASES 1024  // Above this the output time is rounded to the nearest of this many phases
+#define RS_MAXTAPS 64      // Taps per output, bounding the cost
+#define RS_BLOCK 1024      // Input samples buffered at a time
+
+struct resampler {
+  int interp;         // Output rate / gcd
+  int decim;          // Input rate / gcd
+  int phases;
+  int taps;           // Per phase, multiple of 4
+  float rejection;    // Estimated alias rejection in the protected band, dB
+  float *coeffs;      // phases+1 rows of taps, time reversed, each duplicated for I and Q
+  complex float *buf; // Input history followed by new input
+  int count;          // Samples in buf
+  int pos;            // Newest buf sample needed by the next output
+  int frac;           // Next output's time after buf[pos], units of 1/interp input samples
+};
+struct resampler *create_resampler(int in_rate,int out_rate,float passband,float rejection);
+void delete_resampler(struct resampler *);
+int resample(struct resampler *rs,complex float *output,complex float const *input,int cnt);
 
 #endif
@@ -15,6 +15,7 @@
 #undef I
 
 #include <math.h> // Get M_PI
+#include <float.h>
 
 #define M_1_2PI (0.5 * M_1_PI) // fraction of a rotation in one radian
 
@@ -61,6 +62,27 @@ inline complex double const csincospi(const double x){
 }
 
 
+// Fast atan2, for phase detectors and discriminators that run on every sample
+// An odd polynomial for the arctangent of |a| <= 1, good to about 2e-6 radian
+#define ATAN_C0 (0.99997726f)
+#define ATAN_C1 (-0.33262347f)
+#define ATAN_C2 (0.19354346f)
+#define ATAN_C3 (-0.11643287f)
+#define ATAN_C4 (0.05265332f)
+#define ATAN_C5 (-0.01172120f)
+static inline float fast_atan2f(float const y,float const x){
+  float const ax = fabsf(x);
+  float const ay = fabsf(y);
+  float const a = fminf(ax,ay) / fmaxf(fmaxf(ax,ay),FLT_MIN);
+  float const s = a * a;
+  float r = a * (ATAN_C0 + s * (ATAN_C1 + s * (ATAN_C2 + s * (ATAN_C3 + s * (ATAN_C4 + s * ATAN_C5)))));
+  if(ay > ax)
+    r = (float)M_PI_2 - r;
+  if(x < 0)
+    r = (float)M_PI - r;
+  return copysignf(r,y);
+}
+
 // Complex norm (sum of squares of real and imaginary parts)
 inline float const cnrmf(const complex float x){
   return crealf(x)*crealf(x) + cimagf(x) * cimagf(x);
@@ -7,6 +7,7 @@
 #include <netdb.h>
 
 #include "misc.h"
+#include "multicast.h"
 #include "status.h"
 
 int dump_socket(char *host,char *port,unsigned char *val,int optlen){
@@ -266,6 +267,27 @@ void dump_metadata(unsigned char *buffer,int length){
     case OPUS_PACKETS:
       printf(" opus pkts %'llu;",(long long unsigned)decode_int(cp,optlen));
       break;
+    case FILTER_DROPS:
+      printf(" filter drops %'llu;",(long long unsigned)decode_int(cp,optlen));
+      break;
+    case INPUT_LATE:
+      printf(" in late %'llu;",(long long unsigned)decode_int(cp,optlen));
+      break;
+    case PASSBAND_SNR:
+      printf(" passband SNR %.1f dB;",decode_float(cp,optlen));
+      break;
+    case OUTPUT_ENCODING:
+      {
+	int const e = decode_int(cp,optlen);
+	printf(" encoding %s;",e == S16BE ? "s16be" : e == F32BE ? "f32be" : "unknown");
+      }
+      break;
+    case INPUT_OVERRUNS:
+      printf(" in overruns %'llu;",(long long unsigned)decode_int(cp,optlen));
+      break;
+    case INPUT_UNDERRUNS:
+      printf(" in underruns %'llu;",(long long unsigned)decode_int(cp,optlen));
+      break;
     default:
       printf(" unknown type %d length %d;",type,optlen);
       break;
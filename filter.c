@@ -9,18 +9,29 @@
 #define _GNU_SOURCE 1
 #include <assert.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <pthread.h>
 #include <memory.h>
 #include <complex.h>
 #include <math.h>
 #include <fftw3.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <limits.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "misc.h"
 #include "dsp.h"
 #include "filter.h"
+#include "cvec.h"
 
 // Create fast convolution filters
 // The filters are now in two parts, filter_in (the master) and filter_out (the slave)
@@ -53,108 +64,427 @@
 // to prevent aliasing. Remember that decimation reduces the Nyquist rate by the decimation ratio.
 // The set_filter() function uses Kaiser windowing for this purpose
 
-// Set up input (master) half of filter
-struct filter_in *create_filter_input(unsigned int const L,unsigned int const M, enum filtertype const in_type){
+// Master/slave handoff
+// The master never blocks: it bumps its seqlock counter before and after each forward FFT
+// and makes a system call only if a slave is asleep waiting for it
+// On a shared bus the futex is shared too, so slaves in other processes are woken as well
+#if defined(__linux__)
+static void seq_wait(struct filter_in * const master,unsigned int const seq){
+  syscall(SYS_futex,&master->bus->seq,master->shared ? FUTEX_WAIT : FUTEX_WAIT_PRIVATE,seq,NULL,NULL,0);
+}
+static void seq_wake(struct filter_in * const master){
+  syscall(SYS_futex,&master->bus->seq,master->shared ? FUTEX_WAKE : FUTEX_WAKE_PRIVATE,INT_MAX,NULL,NULL,0);
+}
+#else
+static void seq_wait(struct filter_in * const master,unsigned int const seq){
+  if(master->shared){
+    usleep(1000); // No portable cross-process wakeup; poll
+    return;
+  }
+  pthread_mutex_lock(&master->filter_mutex);
+  while(__atomic_load_n(&master->bus->seq,__ATOMIC_SEQ_CST) == seq)
+    pthread_cond_wait(&master->filter_cond,&master->filter_mutex);
+  pthread_mutex_unlock(&master->filter_mutex);
+}
+static void seq_wake(struct filter_in * const master){
+  if(master->shared)
+    return;
+  pthread_mutex_lock(&master->filter_mutex);
+  pthread_cond_broadcast(&master->filter_cond);
+  pthread_mutex_unlock(&master->filter_mutex);
+}
+#endif
 
-  int const N = L + M - 1;
+// FFTW plan cache
+// Each (size, kind, placement, alignment) is planned once, on scratch arrays so planning can't clobber
+// live data, and shared by every filter through the new-array execute functions.
+// Saved wisdom is loaded before the first plan is made, and rewritten whenever a new plan has
+// to be measured, so later runs (and other programs) start quickly
+char const *Wisdom_file = "/var/lib/ka9q-radio/wisdom";
+unsigned int FFTW_planning_level = FFTW_MEASURE;
+
+struct plan_entry {
+  struct plan_entry *next;
+  enum plan_kind kind;
+  int N;
+  bool inplace;
+  bool unaligned;                    // Input needn't be SIMD aligned
+  fftwf_plan plan;
+};
+static struct plan_entry *Plan_cache;
+static pthread_mutex_t Plan_mutex = PTHREAD_MUTEX_INITIALIZER; // Also serializes the FFTW planner
+static bool Wisdom_loaded;
+
+// Load saved wisdom; called automatically before the first plan is made
+int load_wisdom(char const * const file){
+  if(file == NULL)
+    return -1;
+  return fftwf_import_wisdom_from_filename(file) ? 0 : -1;
+}
 
-  struct filter_in * const master = calloc(1,sizeof(*master));
+// Atomically replace the wisdom file
+int save_wisdom(char const * const file){
+  if(file == NULL)
+    return -1;
+  char tmp[PATH_MAX];
+  snprintf(tmp,sizeof(tmp),"%s.tmp",file);
+  if(!fftwf_export_wisdom_to_filename(tmp))
+    return -1;
+  if(rename(tmp,file) != 0){
+    unlink(tmp);
+    return -1;
+  }
+  return 0;
+}
+
+static fftwf_plan cached_plan(enum plan_kind const kind,int const N,bool const inplace,bool const unaligned){
+  assert(N > 0);
+  assert(!inplace || kind == C2C_FORWARD || kind == C2C_BACKWARD);
+
+  pthread_mutex_lock(&Plan_mutex);
+  if(!Wisdom_loaded){
+    Wisdom_loaded = true;
+    load_wisdom(Wisdom_file);
+  }
+  for(struct plan_entry *pe = Plan_cache; pe != NULL; pe = pe->next){
+    if(pe->kind == kind && pe->N == N && pe->inplace == inplace && pe->unaligned == unaligned){
+      pthread_mutex_unlock(&Plan_mutex);
+      return pe->plan;
+    }
+  }
+  // c2r can't preserve its input cheaply, and execute_filter_output() doesn't need it to
+  unsigned int const flags = FFTW_planning_level | (kind == C2R ? 0 : FFTW_PRESERVE_INPUT) | (unaligned ? FFTW_UNALIGNED : 0);
+  complex float * const cbuf = fftwf_alloc_complex(N);
+  complex float * const cbuf2 = inplace ? cbuf : fftwf_alloc_complex(N);
+  float * const rbuf = fftwf_alloc_real(N);
+  assert(cbuf != NULL && cbuf2 != NULL && rbuf != NULL);
+
+  fftwf_plan plan = NULL;
+  bool measured = false;
+  for(int pass = 0; pass < 2 && plan == NULL; pass++){
+    // Try existing wisdom first; only if that fails will the planner measure
+    unsigned int const f = pass == 0 ? (flags | FFTW_WISDOM_ONLY) : flags;
+    switch(kind){
+    case C2C_FORWARD:
+      plan = fftwf_plan_dft_1d(N,cbuf,cbuf2,FFTW_FORWARD,f);
+      break;
+    case C2C_BACKWARD:
+      plan = fftwf_plan_dft_1d(N,cbuf,cbuf2,FFTW_BACKWARD,f);
+      break;
+    case R2C:
+      plan = fftwf_plan_dft_r2c_1d(N,rbuf,cbuf,f);
+      break;
+    case C2R:
+      plan = fftwf_plan_dft_c2r_1d(N,cbuf,rbuf,f);
+      break;
+    }
+    measured = (pass == 1);
+  }
+  if(cbuf2 != cbuf)
+    fftwf_free(cbuf2);
+  fftwf_free(cbuf);
+  fftwf_free(rbuf);
+  assert(plan != NULL);
+
+  struct plan_entry * const pe = calloc(1,sizeof(*pe));
+  pe->kind = kind;
+  pe->N = N;
+  pe->inplace = inplace;
+  pe->unaligned = unaligned;
+  pe->plan = plan;
+  pe->next = Plan_cache;
+  Plan_cache = pe;
+  if(measured && FFTW_planning_level != FFTW_ESTIMATE && save_wisdom(Wisdom_file) != 0){
+    static bool complained;
+    if(!complained){
+      fprintf(stderr,"Can't save FFTW wisdom to %s\n",Wisdom_file);
+      complained = true;
+    }
+  }
+  pthread_mutex_unlock(&Plan_mutex);
+  return plan;
+}
+fftwf_plan get_plan(enum plan_kind const kind,int const N,bool const inplace){
+  return cached_plan(kind,N,inplace,false);
+}
+
+// Frequency domain ring layout
+// Each spectrum starts on a 64-byte boundary so FFTW's new-array execute functions can use it
+static size_t bus_header_size(unsigned int const slots){
+  size_t const size = sizeof(struct fbus) + slots * sizeof(struct fbus_slot);
+  return (size + 63) & ~(size_t)63;
+}
+static unsigned int bus_stride(enum filtertype const in_type,unsigned int const N){
+  unsigned int const bins = in_type == REAL ? N/2 + 1 : N;
+  return (bins + 7) & ~7U;
+}
+// Slot holding block 'blocknum' (1, 2, ...)
+static inline unsigned int slot_index(struct fbus const * const bus,unsigned int const blocknum){
+  return (blocknum - 1) % bus->slots;
+}
+static inline complex float *slot_data(struct filter_in const * const master,unsigned int const blocknum){
+  return master->ring + (size_t)slot_index(master->bus,blocknum) * master->bus->stride;
+}
+static void init_bus(struct fbus * const bus,struct filter_in const * const master,unsigned int const slots){
+  bus->version = FBUS_VERSION;
+  bus->in_type = master->in_type;
+  bus->ilen = master->ilen;
+  bus->impulse_length = master->impulse_length;
+  bus->slots = slots;
+  bus->stride = bus_stride(master->in_type,master->ilen + master->impulse_length - 1);
+  bus->data_offset = bus_header_size(slots);
+  bus->seq = 0;
+  bus->waiters = 0;
+}
+// A bare name is taken to be in /dev/shm; anything with a '/' is a path
+static void bus_path(char * const path,size_t const size,char const * const name){
+  if(strchr(name,'/') != NULL)
+    snprintf(path,size,"%s",name);
+  else
+#if defined(__linux__)
+    snprintf(path,size,"/dev/shm/%s",name);
+#else
+    snprintf(path,size,"/tmp/%s",name);
+#endif
+}
+
+// Overlap-save without copying
+// The FFT input is a window of N samples sliding through a ring that's mapped twice in a row,
+// so a window that runs off the end of the first copy continues seamlessly into the second.
+// After each block the window just advances by L; the M-1 samples of overlap are already in
+// place at its start, and the caller writes the next L directly behind them.
+// Returns false if the mapping can't be made; the caller then copies the overlap down instead
+static bool map_input_window(struct filter_in * const master,size_t const bytes){
+#if defined(__linux__)
+  long const page = sysconf(_SC_PAGESIZE);
+  size_t const size = ((bytes + page - 1) / page) * page;
+  int const fd = memfd_create("filter_in",MFD_CLOEXEC);
+  if(fd == -1)
+    return false;
+  if(ftruncate(fd,size) != 0){ // Zero filled, which clears the initial overlap
+    close(fd);
+    return false;
+  }
+  // Reserve the address space for both copies, then map the ring over each half
+  char * const map = mmap(NULL,2*size,PROT_NONE,MAP_PRIVATE|MAP_ANONYMOUS,-1,0);
+  if(map == MAP_FAILED){
+    close(fd);
+    return false;
+  }
+  if(mmap(map,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0) == MAP_FAILED
+     || mmap(map + size,size,PROT_READ|PROT_WRITE,MAP_SHARED|MAP_FIXED,fd,0) == MAP_FAILED){
+    munmap(map,2*size);
+    close(fd);
+    return false;
+  }
+  close(fd); // The mappings hold it open
+  master->window_map = map;
+  master->window_size = size;
+  master->window_offset = 0;
+  return true;
+#else
+  (void)master;
+  (void)bytes;
+  return false;
+#endif
+}
+
+// Time domain half of the master, common to private and shared buses
+static void init_input(struct filter_in * const master,unsigned int const L,unsigned int const M, enum filtertype const in_type){
+  int const N = L + M - 1;
 
   pthread_mutex_init(&master->filter_mutex,NULL);
-  master->blocknum = 0;
   pthread_cond_init(&master->filter_cond,NULL);
-
-  master->in_type = in_type;
+  master->fd = -1;
   master->ilen = L;
   master->impulse_length = M;
-
-  switch(in_type){
-  default:
-    fprintf(stderr,"Filter input type %d, assuming complex\n",in_type); // Note fall-thru
-  case COMPLEX:
-    master->fdomain = fftwf_alloc_complex(N);
-    assert(master->fdomain != NULL);
-    master->input_buffer.c = fftwf_alloc_complex(N);
-    assert(malloc_usable_size(master->input_buffer.c) >= N * sizeof(*master->input_buffer.c));
-    memset(master->input_buffer.c,0,(M-1)*sizeof(*master->input_buffer.c)); // Clear earlier state
-    master->input.c = master->input_buffer.c + M - 1;
-    master->fwd_plan = fftwf_plan_dft_1d(N,master->input_buffer.c,master->fdomain,FFTW_FORWARD,FFTW_ESTIMATE);
-    break;
-  case REAL:
-    master->fdomain = fftwf_alloc_complex(N/2+1); // Only N/2+1 will be filled in by the r2c FFT
-    assert(master->fdomain != NULL);
-    master->input_buffer.r = fftwf_alloc_real(N);
-    assert(malloc_usable_size(master->input_buffer.r) >= N * sizeof(*master->input_buffer.r));
-    memset(master->input_buffer.r,0,(M-1)*sizeof(*master->input_buffer.r)); // Clear earlier state
+  master->in_type = in_type == REAL ? REAL : COMPLEX;
+  if(in_type != REAL && in_type != COMPLEX)
+    fprintf(stderr,"Filter input type %d, assuming complex\n",in_type);
+
+  size_t const sample = master->in_type == REAL ? sizeof(float) : sizeof(complex float);
+  // The window moves L samples per block; unless that keeps it SIMD aligned,
+  // the forward FFT needs a plan that accepts unaligned input
+  bool unaligned = false;
+  void *buffer;
+  if(map_input_window(master,N * sample)){
+    buffer = master->window_map;
+    unaligned = (L * sample) % 64 != 0;
+  } else {
+    buffer = fftwf_malloc(N * sample);
+    assert(buffer != NULL);
+    memset(buffer,0,(M-1) * sample); // Clear earlier state
+  }
+  if(master->in_type == REAL){
+    master->input_buffer.r = buffer;
     master->input.r = master->input_buffer.r + M - 1;
-    master->fwd_plan = fftwf_plan_dft_r2c_1d(N,master->input_buffer.r,master->fdomain,FFTW_ESTIMATE);
-    break;
+    master->fwd_plan = cached_plan(R2C,N,false,unaligned);
+  } else {
+    master->input_buffer.c = buffer;
+    master->input.c = master->input_buffer.c + M - 1;
+    master->fwd_plan = cached_plan(C2C_FORWARD,N,false,unaligned);
   }
-  return master;
 }
-// Experimental version of create_filter_input that puts frequency domain data in file
-struct filter_in *create_filter_input_file(unsigned int const L,unsigned int const M, enum filtertype const in_type, char *file){
 
-  int const N = L + M - 1;
+// Let a producer on another thread run up to 'blocks' blocks ahead of execute_filter_input(),
+// writing each one through next_filter_input() straight into the sliding window, which is
+// enlarged so the blocks in flight never overwrite the one being transformed
+// Call before any input is written. Returns false, changing nothing, without a double-mapped window
+bool set_filter_input_depth(struct filter_in * const master,unsigned int const blocks){
+  assert(master != NULL);
+  if(master == NULL || master->window_map == NULL || master->attached || blocks == 0)
+    return false;
+
+  size_t const sample = master->in_type == REAL ? sizeof(float) : sizeof(complex float);
+  void * const old_map = master->window_map;
+  size_t const old_size = master->window_size;
+  if(!map_input_window(master,((size_t)blocks * master->ilen + master->impulse_length - 1) * sample))
+    return false;
+  munmap(old_map,2 * old_size);
+  master->write_offset = 0;
+  if(master->in_type == REAL){
+    master->input_buffer.r = master->window_map;
+    master->input.r = master->input_buffer.r + master->impulse_length - 1;
+  } else {
+    master->input_buffer.c = master->window_map;
+    master->input.c = master->input_buffer.c + master->impulse_length - 1;
+  }
+  return true;
+}
 
+// Where the producer writes its next block of L samples, in order from the first after
+// set_filter_input_depth(); without one, just the current input area
+// Only the producer may call this, and it must not get more than 'blocks' ahead
+union rc next_filter_input(struct filter_in * const master){
+  assert(master != NULL);
+  if(master->window_map == NULL)
+    return master->input;
+
+  size_t const sample = master->in_type == REAL ? sizeof(float) : sizeof(complex float);
+  union rc r;
+  r.c = (complex float *)((char *)master->window_map + master->write_offset + (master->impulse_length - 1) * sample);
+  master->write_offset = (master->write_offset + master->ilen * sample) % master->window_size;
+  return r;
+}
+
+// Set up input (master) half of filter
+// Its spectra go to a one-slot bus private to this process
+struct filter_in *create_filter_input(unsigned int const L,unsigned int const M, enum filtertype const in_type){
   struct filter_in * const master = calloc(1,sizeof(*master));
+  assert(master != NULL);
+  if(master == NULL)
+    return NULL;
 
-  pthread_mutex_init(&master->filter_mutex,NULL);
-  master->blocknum = 0;
-  pthread_cond_init(&master->filter_cond,NULL);
+  init_input(master,L,M,in_type);
+  master->bus = calloc(1,bus_header_size(1));
+  assert(master->bus != NULL);
+  init_bus(master->bus,master,1);
+  master->ring = fftwf_alloc_complex(master->bus->stride);
+  assert(master->ring != NULL);
+  master->fdomain = master->ring;
+  master->bus->magic = FBUS_MAGIC;
+  return master;
+}
 
-  master->in_type = in_type;
-  master->ilen = L;
-  master->impulse_length = M;
+// Same, but publish the spectra in a ring of 'slots' blocks in shared memory
+// so other processes can attach_filter_input() and run their own slaves
+// Any existing bus of the same name is unlinked first, not overwritten; slaves still
+// attached to it keep their (now idle) mapping instead of faulting
+struct filter_in *create_filter_input_bus(unsigned int const L,unsigned int const M, enum filtertype const in_type,char const *name,unsigned int slots){
+  assert(name != NULL);
+  if(name == NULL)
+    return NULL;
+  if(slots == 0)
+    slots = FBUS_SLOTS;
 
-  switch(in_type){
-  default:
-    fprintf(stderr,"Filter input type %d, assuming complex\n",in_type); // Note fall-thru
-  case COMPLEX:
-    master->fd = open(file,O_CREAT|O_TRUNC|O_RDWR,0644);
-#if __linux__
-    fallocate(master->fd,0,0LL,sizeof(complex float)*N);
-#else    
-    lseek(master->fd,sizeof(complex float)*N,SEEK_SET);
-    write(master->fd,&master->impulse_length,sizeof(master->impulse_length)); // arbitrary write to extend file
-    //    posix_fallocate(master->fd,0,0LL,sizeof(complex float)*N); // Not on osx
-#endif
-    master->fdomain = mmap(NULL,sizeof(complex float)*N,
-			   PROT_READ|PROT_WRITE,
-			   MAP_FILE|MAP_SHARED,
-			   master->fd,0LL);
-
-    assert(master->fdomain != MAP_FAILED);
-    master->input_buffer.c = fftwf_alloc_complex(N);
-    assert(malloc_usable_size(master->input_buffer.c) >= N * sizeof(*master->input_buffer.c));
-    memset(master->input_buffer.c,0,(M-1)*sizeof(*master->input_buffer.c)); // Clear earlier state
-    master->input.c = master->input_buffer.c + M - 1;
-    master->fwd_plan = fftwf_plan_dft_1d(N,master->input_buffer.c,master->fdomain,FFTW_FORWARD,FFTW_ESTIMATE);
-    break;
-  case REAL:
-    master->fd = open(file,O_CREAT|O_TRUNC|O_RDWR,0644);
-#if __linux__
-    fallocate(master->fd,0,0LL,sizeof(complex float)*(N/2+1));
-
-#else    
-    lseek(master->fd,sizeof(complex float)*(N/2+1),SEEK_SET);
-    write(master->fd,&master->impulse_length,sizeof(master->impulse_length)); // arbitrary write to extend file
-    // posix_fallocate(master->fd,0,0LL,sizeof(complex float)*(N/2+1)); // Not on osx
-#endif
-    master->fdomain = mmap(NULL,sizeof(complex float)*(N/2+1),
-			   PROT_READ|PROT_WRITE,
-			   MAP_FILE|MAP_SHARED,
-			   master->fd,0LL);
-    assert(master->fdomain != MAP_FAILED);
-    master->input_buffer.r = fftwf_alloc_real(N);
-    assert(malloc_usable_size(master->input_buffer.r) >= N * sizeof(*master->input_buffer.r));
-    memset(master->input_buffer.r,0,(M-1)*sizeof(*master->input_buffer.r)); // Clear earlier state
-    master->input.r = master->input_buffer.r + M - 1;
-    master->fwd_plan = fftwf_plan_dft_r2c_1d(N,master->input_buffer.r,master->fdomain,FFTW_ESTIMATE);
-    break;
+  struct filter_in * const master = calloc(1,sizeof(*master));
+  assert(master != NULL);
+  if(master == NULL)
+    return NULL;
+  init_input(master,L,M,in_type);
+
+  char path[PATH_MAX];
+  bus_path(path,sizeof(path),name);
+  size_t const header = bus_header_size(slots);
+  size_t const size = header + (size_t)slots * bus_stride(master->in_type,L + M - 1) * sizeof(complex float);
+
+  unlink(path);
+  master->fd = open(path,O_CREAT|O_EXCL|O_RDWR,0664);
+  if(master->fd == -1 || ftruncate(master->fd,size) != 0){
+    perror(path);
+    if(master->fd != -1)
+      unlink(path);
+    delete_filter_input(master);
+    return NULL;
+  }
+  master->path = strdup(path);
+  master->shared = true;
+  void * const map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,master->fd,0);
+  if(map == MAP_FAILED){
+    perror(path);
+    delete_filter_input(master);
+    return NULL;
+  }
+  master->bus = map;
+  master->map_size = size;
+  init_bus(master->bus,master,slots);
+  master->ring = (complex float *)((char *)map + header);
+  master->fdomain = master->ring;
+  __atomic_store_n(&master->bus->magic,FBUS_MAGIC,__ATOMIC_RELEASE); // Header complete
+  return master;
+}
+
+// Attach to a bus created by another process with create_filter_input_bus()
+// The result can only be used as the master of filter_outs and be deleted
+// Returns NULL with errno set on failure
+struct filter_in *attach_filter_input(char const *name){
+  assert(name != NULL);
+  if(name == NULL)
+    return NULL;
+
+  char path[PATH_MAX];
+  bus_path(path,sizeof(path),name);
+  int const fd = open(path,O_RDWR);
+  if(fd == -1)
+    return NULL;
+  struct stat st;
+  if(fstat(fd,&st) != 0 || st.st_size < (off_t)sizeof(struct fbus)){
+    close(fd);
+    errno = EINVAL;
+    return NULL;
+  }
+  struct fbus * const bus = mmap(NULL,st.st_size,PROT_READ|PROT_WRITE,MAP_SHARED,fd,0);
+  if(bus == MAP_FAILED){
+    close(fd);
+    return NULL;
+  }
+  if(__atomic_load_n(&bus->magic,__ATOMIC_ACQUIRE) != FBUS_MAGIC || bus->version != FBUS_VERSION
+     || bus->slots == 0 || bus->data_offset < bus_header_size(bus->slots)
+     || bus->stride < bus_stride(bus->in_type,bus->ilen + bus->impulse_length - 1)
+     || bus->data_offset + (size_t)bus->slots * bus->stride * sizeof(complex float) > (size_t)st.st_size){
+    munmap(bus,st.st_size);
+    close(fd);
+    errno = EINVAL;
+    return NULL;
   }
+  struct filter_in * const master = calloc(1,sizeof(*master));
+  assert(master != NULL);
+  pthread_mutex_init(&master->filter_mutex,NULL);
+  pthread_cond_init(&master->filter_cond,NULL);
+  master->in_type = bus->in_type;
+  master->ilen = bus->ilen;
+  master->impulse_length = bus->impulse_length;
+  master->bus = bus;
+  master->ring = (complex float *)((char *)bus + bus->data_offset);
+  master->shared = true;
+  master->attached = true;
+  master->map_size = st.st_size;
+  master->fd = fd;
   return master;
 }
+static void init_output(struct filter_out *);
+static void release_response(struct response_entry *);
+
 // Set up output (slave) side of filter (possibly one of several sharing the same input master)
 
 // Example: processing FM after demodulation to separate the PL tone and to de-emphasize the audio
@@ -166,7 +496,6 @@ struct filter_out *create_filter_output(struct filter_in * master,complex float
     return NULL;
 
   int const N = master->ilen + master->impulse_length - 1;
-  int const N_dec = N / decimate;
 
   // Parameter sanity check
   if((N % decimate) != 0)
@@ -185,7 +514,16 @@ struct filter_out *create_filter_output(struct filter_in * master,complex float
     slave->noise_gain = noise_gain(slave);
   else
     slave->noise_gain = NAN;
-  
+  init_output(slave);
+  return slave;
+}
+
+// Buffers and inverse FFT plan for the slave's output type
+static void init_output(struct filter_out * const slave){
+  struct filter_in const * const master = slave->master;
+  int const N = master->ilen + master->impulse_length - 1;
+  int const N_dec = N / slave->decimate;
+
   switch(slave->out_type){
   default:
   case COMPLEX:
@@ -195,7 +533,7 @@ struct filter_out *create_filter_output(struct filter_in * master,complex float
     slave->output_buffer.c = fftwf_alloc_complex(N_dec);
     assert(slave->output_buffer.c != NULL);
     slave->output.c = slave->output_buffer.c + N_dec - slave->olen;
-    slave->rev_plan = fftwf_plan_dft_1d(N_dec,slave->f_fdomain,slave->output_buffer.c,FFTW_BACKWARD,FFTW_ESTIMATE);
+    slave->rev_plan = get_plan(C2C_BACKWARD,N_dec,false);
     break;
   case REAL:
     slave->f_fdomain = fftwf_alloc_complex(N_dec/2+1);
@@ -204,39 +542,196 @@ struct filter_out *create_filter_output(struct filter_in * master,complex float
     assert(slave->output_buffer.r != NULL);
     //    slave->output.r = slave->output_buffer.r + (master->impulse_length - 1)/decimate;
     slave->output.r = slave->output_buffer.r + N_dec - slave->olen;
-    slave->rev_plan = fftwf_plan_dft_c2r_1d(N_dec,slave->f_fdomain,slave->output_buffer.r,FFTW_ESTIMATE);
+    slave->rev_plan = get_plan(C2R,N_dec,false);
     break;
   }
-  return slave;
 }
 int execute_filter_input(struct filter_in * const master){
   assert(master != NULL);
-  if(master == NULL)
+  if(master == NULL || master->attached)
     return -1;
 
-  fftwf_execute(master->fwd_plan);  // Forward transform
+  struct fbus * const bus = master->bus;
+  unsigned int const seq = __atomic_load_n(&bus->seq,__ATOMIC_RELAXED); // We're the only writer
+  unsigned int const blocknum = (seq >> 1) + 1;
+  complex float * const fdomain = slot_data(master,blocknum);
+  struct fbus_slot * const slot = &bus->slot[slot_index(bus,blocknum)];
 
-  // Notify slaves of new data
-  pthread_mutex_lock(&master->filter_mutex);
-  master->blocknum++;
-  pthread_cond_broadcast(&master->filter_cond);
-  pthread_mutex_unlock(&master->filter_mutex);
-
-  // Perform overlap-and-save operation for fast convolution; note memmove is non-destructive
-  switch(master->in_type){
-  default:
-  case COMPLEX:
-    assert(malloc_usable_size(master->input_buffer.c) >= (master->ilen + master->impulse_length - 1)*sizeof(*master->input_buffer.c));
-    memmove(master->input_buffer.c,master->input_buffer.c + master->ilen,(master->impulse_length - 1)*sizeof(*master->input_buffer.c));
-    break;
-  case REAL:
-    assert(malloc_usable_size(master->input_buffer.r) >= (master->ilen + master->impulse_length - 1)*sizeof(*master->input_buffer.r));
-    memmove(master->input_buffer.r,master->input_buffer.r + master->ilen,(master->impulse_length - 1)*sizeof(*master->input_buffer.r));
-    break;
+  __atomic_store_n(&bus->seq,seq + 1,__ATOMIC_SEQ_CST); // Odd: a slot is changing
+  // Forward transform
+  if(master->in_type == REAL)
+    fftwf_execute_dft_r2c(master->fwd_plan,master->input_buffer.r,fdomain);
+  else
+    fftwf_execute_dft(master->fwd_plan,master->input_buffer.c,fdomain);
+  slot->blocknum = blocknum;
+  slot->samprate = master->samprate;
+  slot->frequency = master->frequency;
+  slot->timestamp = master->timestamp;
+  __atomic_store_n(&bus->seq,seq + 2,__ATOMIC_SEQ_CST); // Even: new block published
+  master->fdomain = fdomain;
+
+  // Notify slaves of new data, if any are waiting
+  if(__atomic_load_n(&bus->waiters,__ATOMIC_SEQ_CST) != 0)
+    seq_wake(master);
+
+  // Perform overlap-and-save operation for fast convolution
+  size_t const sample = master->in_type == REAL ? sizeof(float) : sizeof(complex float);
+  if(master->window_map != NULL){
+    // Slide the window; the last M-1 samples of this block are the first of the next
+    master->window_offset = (master->window_offset + master->ilen * sample) % master->window_size;
+    void * const buffer = (char *)master->window_map + master->window_offset;
+    if(master->in_type == REAL){
+      master->input_buffer.r = buffer;
+      master->input.r = master->input_buffer.r + master->impulse_length - 1;
+    } else {
+      master->input_buffer.c = buffer;
+      master->input.c = master->input_buffer.c + master->impulse_length - 1;
+    }
+  } else {
+    // No double mapping; note memmove is non-destructive
+    memmove(master->input_buffer.c,(char *)master->input_buffer.c + master->ilen * sample,(master->impulse_length - 1) * sample);
   }
   return 0;
 }
 
+// Peek at the latest published block without being a slave, e.g., for spectral analysis
+// Returns its block number and sets *spectrum, or returns 0 if there's none or it's being overwritten
+// Never waits; check filter_block_overwritten() after reading
+unsigned int latest_filter_block(struct filter_in const * const master,complex float const ** const spectrum){
+  assert(master != NULL && spectrum != NULL);
+  if(master == NULL || spectrum == NULL)
+    return 0;
+
+  unsigned int const seq = __atomic_load_n(&master->bus->seq,__ATOMIC_ACQUIRE);
+  unsigned int const published = seq >> 1;
+  unsigned int const started = (seq + 1) >> 1;
+  if(published == 0 || started - published >= master->bus->slots)
+    return 0;
+  *spectrum = slot_data(master,published);
+  return published;
+}
+// True if the master may have overwritten the block since we started reading it
+bool filter_block_overwritten(struct filter_in const * const master,unsigned int const blocknum){
+  assert(master != NULL);
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  unsigned int const seq = __atomic_load_n(&master->bus->seq,__ATOMIC_RELAXED);
+  return (int)(((seq + 1) >> 1) - blocknum) >= (int)master->bus->slots;
+}
+
+// Copy the producer's metadata for the latest published block, without being a slave
+// Returns false if there's no block yet, or it was overwritten while we copied it
+bool latest_filter_metadata(struct filter_in const * const master,struct fbus_slot * const meta){
+  assert(master != NULL && meta != NULL);
+  if(master == NULL || meta == NULL)
+    return false;
+
+  unsigned int const seq = __atomic_load_n(&master->bus->seq,__ATOMIC_ACQUIRE);
+  unsigned int const published = seq >> 1;
+  if(published == 0 || ((seq + 1) >> 1) - published >= master->bus->slots)
+    return false;
+  *meta = master->bus->slot[slot_index(master->bus,published)];
+  return meta->blocknum == published && !filter_block_overwritten(master,published);
+}
+
+// Spectral multiply kernels
+
+// out[i] = scale * h[i] * x[i], i = 0 ... n-1
+static void cmul_span(complex float * restrict out,complex float const * restrict h,complex float const * restrict x,
+		      complex float const scale,int const n){
+  int i = 0;
+  if(scale == 1){
+    for(; i + CVLEN <= n; i += CVLEN)
+      cv_store(out+i,cv_mul(cv_load(h+i),cv_load(x+i)));
+    for(; i < n; i++)
+      out[i] = h[i] * x[i];
+  } else {
+    cvec const s = cv_set1(scale);
+    for(; i + CVLEN <= n; i += CVLEN)
+      cv_store(out+i,cv_mul(s,cv_mul(cv_load(h+i),cv_load(x+i))));
+    for(; i < n; i++)
+      out[i] = scale * h[i] * x[i];
+  }
+}
+// Same, with x[] taken circularly from an N-point spectrum starting at bin m
+static void cmul_wrap(complex float *out,complex float const *h,complex float const *x,int m,int const N,
+		      complex float const scale,int n){
+  while(n > 0){
+    int const cnt = min(n,N - m);
+    cmul_span(out,h,x+m,scale,cnt);
+    out += cnt;
+    h += cnt;
+    n -= cnt;
+    m = 0;
+  }
+}
+
+// Paired positive/negative frequencies, i = 0 ... n-1
+// The positive side walks up from fp, hp, xp; the negative side walks down from fn, hn, xn
+// pos = scale * hp[i] * xp[i]; neg = scale * hn[-i] * xn[-i]
+// fp[i] = pos + conj(neg); if both, also fn[-i] = neg - conj(pos)
+static void cross_span(complex float *fp,complex float *fn,
+		       complex float const *hp,complex float const *hn,
+		       complex float const *xp,complex float const *xn,
+		       complex float const scale,int const n,bool const both){
+  cvec const s = cv_set1(scale);
+  int i = 0;
+  for(; i + CVLEN <= n; i += CVLEN){
+    int const j = -i - (CVLEN-1); // lowest address of the negative-side vector
+    cvec const pos = cv_mul(s,cv_mul(cv_load(hp+i),cv_load(xp+i)));
+    cvec const neg = cv_rev(cv_mul(s,cv_mul(cv_load(hn+j),cv_load(xn+j))));
+    cv_store(fp+i,cv_add(pos,cv_conj(neg)));
+    if(both)
+      cv_store(fn+j,cv_rev(cv_sub(neg,cv_conj(pos))));
+  }
+  for(; i < n; i++){
+    complex float const pos = scale * hp[i] * xp[i];
+    complex float const neg = scale * hn[-i] * xn[-i];
+    fp[i] = pos + conjf(neg);
+    if(both)
+      fn[-i] = neg - conjf(pos);
+  }
+}
+// Bins 1 ... n of f[], h[] paired with N_dec-1 ... N_dec-n; master bins m0+1... and m0-1... taken circularly
+static void cross_wrap(complex float *f,complex float const *h,int const N_dec,complex float const *x,int const m0,int const N,
+		       complex float const scale,int n,bool const both){
+  int p = 1;
+  int mp = m0 + 1 < N ? m0 + 1 : 0;
+  int mn = m0 > 0 ? m0 - 1 : N - 1;
+  while(n > 0){
+    int const cnt = min(n,min(N - mp,mn + 1)); // Stop at either wrap point
+    cross_span(f+p,both ? f+N_dec-p : NULL,h+p,h+N_dec-p,x+mp,x+mn,scale,cnt,both);
+    p += cnt;
+    n -= cnt;
+    mp += cnt;
+    if(mp == N)
+      mp = 0;
+    mn -= cnt;
+    if(mn < 0)
+      mn = N - 1;
+  }
+}
+
+// fn[-i] = hn[-i] * conj(x[i]); negative frequencies of a real input
+static void cmulconj_rev_span(complex float *fn,complex float const *hn,complex float const *x,int const n){
+  int i = 0;
+  for(; i + CVLEN <= n; i += CVLEN){
+    int const j = -i - (CVLEN-1);
+    cv_store(fn+j,cv_mul(cv_load(hn+j),cv_rev(cv_conj(cv_load(x+i)))));
+  }
+  for(; i < n; i++)
+    fn[-i] = hn[-i] * conjf(x[i]);
+}
+static void cmulconj_rev_wrap(complex float *fn,complex float const *hn,complex float const *x,int m,int const N,int n){
+  while(n > 0){
+    int const cnt = min(n,N - m);
+    cmulconj_rev_span(fn,hn,x+m,cnt);
+    fn -= cnt;
+    hn -= cnt;
+    n -= cnt;
+    m = 0;
+  }
+}
+
 int execute_filter_output(struct filter_out * const slave,int rotate){
   assert(slave != NULL);
   if(slave == NULL)
@@ -246,7 +741,7 @@ int execute_filter_output(struct filter_out * const slave,int rotate){
   assert(master != NULL);
   assert(slave->out_type != NONE);
   assert(master->in_type != NONE);
-  assert(master->fdomain != NULL);
+  assert(master->bus != NULL);
   assert(slave->f_fdomain != NULL);  
 
   int const N = master->ilen + master->impulse_length - 1; // points in input buffer
@@ -254,132 +749,107 @@ int execute_filter_output(struct filter_out * const slave,int rotate){
 
   // DC and positive frequencies up to nyquist frequency are same for all types
   assert(malloc_usable_size(slave->f_fdomain) >= (N_dec/2+1) * sizeof(*slave->f_fdomain));
-  assert(malloc_usable_size(master->fdomain) >= (N_dec/2+1) * sizeof(*master->fdomain));
 
-  // Wait for new block of data
-  pthread_mutex_lock(&master->filter_mutex);
-  while(slave->blocknum == master->blocknum)
-    pthread_cond_wait(&master->filter_cond,&master->filter_mutex);
-  slave->blocknum = master->blocknum;
-  pthread_mutex_unlock(&master->filter_mutex);
+  // Wait for a block we haven't seen: the next one in sequence if it's still in the ring,
+  // otherwise the oldest one the master won't overwrite before we can read it.
+  // A new slave starts with the latest
+  struct fbus * const bus = master->bus;
+  unsigned int seq,blocknum;
+  while(1){
+    seq = __atomic_load_n(&bus->seq,__ATOMIC_ACQUIRE);
+    unsigned int const published = seq >> 1;
+    unsigned int const started = (seq + 1) >> 1;
+    blocknum = slave->blocknum != 0 ? slave->blocknum + 1 : published;
+    if((int)(started - blocknum) >= (int)bus->slots)
+      blocknum = started - bus->slots + 1;
+    if(blocknum != 0 && (int)(published - blocknum) >= 0)
+      break;
+    __atomic_add_fetch(&bus->waiters,1,__ATOMIC_SEQ_CST);
+    // Recheck after announcing ourselves so we can't miss the wakeup
+    if(__atomic_load_n(&bus->seq,__ATOMIC_SEQ_CST) == seq)
+      seq_wait(master,seq);
+    __atomic_sub_fetch(&bus->waiters,1,__ATOMIC_SEQ_CST);
+  }
+  if(slave->blocknum != 0 && blocknum - slave->blocknum > 1)
+    slave->skipped += blocknum - slave->blocknum - 1; // We fell behind
+  slave->blocknum = blocknum;
+  complex float const * const fdomain = slot_data(master,blocknum);
+  struct fbus_slot const * const slot = &bus->slot[slot_index(bus,blocknum)];
 
   pthread_mutex_lock(&slave->response_mutex); // Protect access to response[] array
   assert(malloc_usable_size(slave->response) >= (N_dec/2+1) * sizeof(*slave->response));
   assert(slave->response != NULL);
 
-#define TEST 1
-#if TEST
-  // Experimental frequency rotating filter for eventual use in a demodulator channel bank
+  // Rotating the spectrum by 'rotate' bins mixes the signal with exp(-j*2*pi*rotate*n/N),
+  // but n restarts at 0 in every block. Unless rotate*L is a multiple of N, correct the
+  // phase of each block to keep the mixer coherent across block boundaries
+  complex float phase = 1;
+  if(rotate != 0 && master->in_type != REAL){
+    long long const r = ((long long)rotate * master->ilen % N + N) % N;
+    phase = cispif(-2.0f * (float)((r * (slave->blocknum % N)) % N) / N);
+  }
+
+  // The master's spectrum is circular, so 'rotate' only moves the wrap point of each span
+  int m0 = rotate % N;
+  if(m0 < 0)
+    m0 += N;
 
-  if(master->in_type != REAL && slave->out_type != REAL){
+  if(master->in_type != REAL && slave->out_type == COMPLEX){
     // Complex -> complex
-    int p = N_dec/2 + 1;
-    int m = N - N_dec/2 + 1 + rotate;
-    if(m >= N)
-      m -= N;
-    if(m < 0)
-      m += N;
-	      
-    for(int i=0; i < N_dec; i++){
-      slave->f_fdomain[p] = slave->response[p] * master->fdomain[m];
-      if(++p == N_dec)
-	p = 0;
-      if(++m == N)
-	m = 0;
-    }
-  } else if(master->in_type == REAL && slave->out_type == REAL){
-    // Real -> real
-    int m = rotate;
-    if(m < 0)
-      m += N;
-    for(int p=0; p <= N_dec/2; p++){
-      slave->f_fdomain[p] = slave->response[p] * master->fdomain[m];
-      if(++m == N)
-	m = 0;
-    }
-  } else if(master->in_type != REAL && slave->out_type == REAL){
-    // Complex -> real
-    int m = rotate;
-    if(m < 0)
-      m += N;
-    
-    slave->f_fdomain[0] = slave->response[0] * master->fdomain[m]; // DC
-    if(++m == N)
-      m = 0;
-
-    for(int p=1; p < N_dec/2; p++){
-      slave->f_fdomain[p] = slave->response[p] * master->fdomain[m]
-	+ conjf(slave->response[N_dec-p] * master->fdomain[m]);
-      if(++m == N)
-	m = 0;
-    }
+    int const npos = N_dec/2 + 1; // DC through Nyquist
+    cmul_wrap(slave->f_fdomain,slave->response,fdomain,m0,N,phase,npos);
+    int const mneg = (m0 + N - (N_dec - npos)) % N;
+    cmul_wrap(slave->f_fdomain + npos,slave->response + npos,fdomain,mneg,N,phase,N_dec - npos);
+  } else if(master->in_type != REAL){
+    // Complex -> CROSS_CONJ or real
+    // Each positive frequency is paired with its negative image in one sweep
+    // For ISB (CROSS_CONJ) this forces negative frequencies onto I, positive onto Q
+    // For real output the conjugates of negative frequencies are folded into the positive ones
+    bool const both = (slave->out_type == CROSS_CONJ);
+    // DC (and Nyquist, when N_dec is even) are their own images; for real output they fold
+    // onto themselves, and c2r keeps just the real part of the sum
+    complex float const dc = phase * slave->response[0] * fdomain[m0];
+    slave->f_fdomain[0] = both ? dc : dc + conjf(dc);
+    cross_wrap(slave->f_fdomain,slave->response,N_dec,fdomain,m0,N,phase,N_dec/2 - 1,both);
     // The sign of the Nyquist frequency is ambiguous, but we consider it positive
-    slave->f_fdomain[N_dec/2] = slave->response[N_dec/2] * master->fdomain[m];
-  } else if(master->in_type == REAL && slave->out_type != REAL){
-    // Real->complex 
-    int m = rotate;
-    if(m < 0)
-      m += N;
-    slave->f_fdomain[0] = slave->response[0] * master->fdomain[m]; // DC
-    if(++m == N)
-      m = 0;
-    
-    for(int p=1; ; p++){
-      slave->f_fdomain[p] = slave->response[p] * master->fdomain[m];
-      if(p == N_dec/2) // Do nyquist frequency only once
-	break;
-      slave->f_fdomain[N_dec-p] = slave->response[N_dec-p] * conj(master->fdomain[m]);
-      if(++m == N)
-	m = 0;
+    int const mnyq = (m0 + N_dec/2) % N;
+    complex float const nyq = phase * slave->response[N_dec/2] * fdomain[mnyq];
+    complex float image = nyq;
+    if(N_dec & 1){
+      // Unpaired bin just above Nyquist when N_dec is odd
+      int const p = N_dec/2 + 1;
+      image = phase * slave->response[p] * fdomain[(m0 + N - (N_dec - p)) % N];
+      if(both)
+	slave->f_fdomain[p] = image;
     }
+    slave->f_fdomain[N_dec/2] = both ? nyq : nyq + conjf(image);
+  } else if(slave->out_type == REAL){
+    // Real -> real
+    cmul_wrap(slave->f_fdomain,slave->response,fdomain,m0,N,1,N_dec/2 + 1);
+  } else {
+    // Real->complex
+    // For a purely real input, F[-f] = conj(F[+f])
+    cmul_wrap(slave->f_fdomain,slave->response,fdomain,m0,N,1,N_dec/2 + 1);
+    int const m1 = m0 + 1 < N ? m0 + 1 : 0;
+    cmulconj_rev_wrap(slave->f_fdomain + N_dec - 1,slave->response + N_dec - 1,fdomain,m1,N,N_dec - N_dec/2 - 1);
   }
+  pthread_mutex_unlock(&slave->response_mutex); // release response[]
 
-#else
-
-  // Positive frequencies up to half the nyquist rate are the same for all types
-  for(int p=0; p <= N_dec/2; p++)
-    slave->f_fdomain[p] = slave->response[p] * master->fdomain[p];
+  slave->samprate = slot->samprate;
+  slave->frequency = slot->frequency;
+  slave->timestamp = slot->timestamp;
 
-  if(master->in_type == REAL){
-    if(slave->out_type != REAL){
-      // For a purely real input, F[-f] = conj(F[+f])
-      assert(malloc_usable_size(slave->f_fdomain) >= N_dec * sizeof(*slave->f_fdomain));
-      int p,dn;
-      for(p=1,dn=N_dec-1; dn > N_dec/2; p++,dn--)
-	slave->f_fdomain[dn] = slave->response[dn] * conjf(master->fdomain[p]);
-    } // out_type == REAL already handled
-  } else { // in_type == COMPLEX
-    if(slave->out_type != REAL){
-      // Complex output; do negative frequencies
-      assert(malloc_usable_size(master->fdomain) >= N * sizeof(*master->fdomain));
-      assert(malloc_usable_size(slave->response) >= N_dec * sizeof(*slave->response));
-      assert(malloc_usable_size(slave->f_fdomain) >= N_dec * sizeof(*slave->f_fdomain));
-
-      for(int n=N-1,dn=N_dec-1; dn > N_dec/2;n--,dn--)
-	slave->f_fdomain[dn] = slave->response[dn] * master->fdomain[n];
-    } else {
-      // Real output; fold conjugates of negative frequencies into positive to force pure real result
-      assert(malloc_usable_size(master->fdomain) >= N * sizeof(*master->fdomain));
-      assert(malloc_usable_size(slave->response) >= N_dec * sizeof(*slave->response));
-      for(int n=N-1,p=1,dn=N_dec-1; p < N_dec/2; p++,n--,dn--)
-	slave->f_fdomain[p] += conjf(slave->response[dn] * master->fdomain[n]);
-    }
-  }
-#endif
-  pthread_mutex_unlock(&slave->response_mutex); // release response[]
+  // If the master started overwriting the slot while we were reading it, the block may be corrupt
+  // Use it anyway; the alternative is a gap
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  unsigned int const after = __atomic_load_n(&bus->seq,__ATOMIC_RELAXED);
+  if((int)(((after + 1) >> 1) - blocknum) >= (int)bus->slots)
+    slave->overruns++;
 
-  if(slave->out_type == CROSS_CONJ){
-    // hack for ISB; forces negative frequencies onto I, positive onto Q
-    assert(malloc_usable_size(slave->f_fdomain) >= N_dec * sizeof(*slave->f_fdomain));
-    for(int p=1,dn=N_dec-1; p < N_dec/2; p++,dn--){
-      complex float const pos = slave->f_fdomain[p];
-      complex float const neg = slave->f_fdomain[dn];
-      
-      slave->f_fdomain[p]  = pos + conjf(neg);
-      slave->f_fdomain[dn] = neg - conjf(pos);
-    }
-  }
-  fftwf_execute(slave->rev_plan); // Note: c2r version destroys f_fdomain[]
+  if(slave->out_type == REAL)
+    fftwf_execute_dft_c2r(slave->rev_plan,slave->f_fdomain,slave->output_buffer.r); // Note: destroys f_fdomain[]
+  else
+    fftwf_execute_dft(slave->rev_plan,slave->f_fdomain,slave->output_buffer.c);
   return 0;
 }
 
@@ -387,20 +857,41 @@ int delete_filter_input(struct filter_in * const master){
   if(master == NULL)
     return 0;
   
-  fftwf_destroy_plan(master->fwd_plan);
-  fftwf_free(master->input_buffer.c);
-  fftwf_free(master->fdomain);
+  if(master->shared){
+    if(master->bus != NULL)
+      munmap(master->bus,master->map_size);
+    // Remove our bus file, unless another producer has already replaced it
+    struct stat ours,theirs;
+    if(!master->attached && master->path != NULL && fstat(master->fd,&ours) == 0
+       && stat(master->path,&theirs) == 0 && ours.st_ino == theirs.st_ino && ours.st_dev == theirs.st_dev)
+      unlink(master->path);
+  } else {
+    fftwf_free(master->ring);
+    free(master->bus);
+  }
+  if(master->fd != -1)
+    close(master->fd);
+  free(master->path);
+  if(master->window_map != NULL)
+    munmap(master->window_map,2 * master->window_size);
+  else
+    fftwf_free(master->input_buffer.c);
+  pthread_mutex_destroy(&master->filter_mutex);
+  pthread_cond_destroy(&master->filter_cond);
   free(master);
   return 0;
 }
+
 int delete_filter_output(struct filter_out * const slave){
   if(slave == NULL)
     return 0;
   
   pthread_mutex_destroy(&slave->response_mutex);
-  fftwf_destroy_plan(slave->rev_plan);  
   fftwf_free(slave->output_buffer.c);
-  fftwf_free(slave->response);
+  if(slave->cached != NULL)
+    release_response(slave->cached);
+  else
+    fftwf_free(slave->response);
   fftwf_free(slave->f_fdomain);
   free(slave);
   return 0;
@@ -512,15 +1003,13 @@ int window_filter(int const L,int const M,complex float * const response,float c
     return -1;
   int const N = L + M - 1;
   assert(malloc_usable_size(response) >= N*sizeof(*response));
-  // fftw_plan can overwrite its buffers, so we're forced to make a temp. Ugh.
   complex float * const buffer = fftwf_alloc_complex(N);
-  fftwf_plan fwd_filter_plan = fftwf_plan_dft_1d(N,buffer,buffer,FFTW_FORWARD,FFTW_ESTIMATE);
-  fftwf_plan rev_filter_plan = fftwf_plan_dft_1d(N,buffer,buffer,FFTW_BACKWARD,FFTW_ESTIMATE);
+  fftwf_plan const fwd_filter_plan = get_plan(C2C_FORWARD,N,true);
+  fftwf_plan const rev_filter_plan = get_plan(C2C_BACKWARD,N,true);
 
   // Convert to time domain
   memcpy(buffer,response,N*sizeof(*buffer));
-  fftwf_execute(rev_filter_plan);
-  fftwf_destroy_plan(rev_filter_plan);
+  fftwf_execute_dft(rev_filter_plan,buffer,buffer);
 #if 0
   fprintf(stderr,"raw time domain\n");
   for(int n=0; n < N; n++){
@@ -552,8 +1041,7 @@ int window_filter(int const L,int const M,complex float * const response,float c
 #endif
   
   // Now back to frequency domain
-  fftwf_execute(fwd_filter_plan);
-  fftwf_destroy_plan(fwd_filter_plan);
+  fftwf_execute_dft(fwd_filter_plan,buffer,buffer);
 
 #if 0
   fprintf(stderr,"Filter response amplitude\n");
@@ -580,15 +1068,14 @@ int window_rfilter(int const L,int const M,complex float * const response,float
   assert(buffer != NULL);
   float * const timebuf = fftwf_alloc_real(N);
   assert(timebuf != NULL);
-  fftwf_plan fwd_filter_plan = fftwf_plan_dft_r2c_1d(N,timebuf,buffer,FFTW_ESTIMATE);
+  fftwf_plan const fwd_filter_plan = get_plan(R2C,N,false);
   assert(fwd_filter_plan != NULL);
-  fftwf_plan rev_filter_plan = fftwf_plan_dft_c2r_1d(N,buffer,timebuf,FFTW_ESTIMATE);
+  fftwf_plan const rev_filter_plan = get_plan(C2R,N,false);
   assert(rev_filter_plan != NULL);
   
   // Convert to time domain
   memcpy(buffer,response,(N/2+1)*sizeof(*buffer));
-  fftwf_execute(rev_filter_plan);
-  fftwf_destroy_plan(rev_filter_plan);
+  fftwf_execute_dft_c2r(rev_filter_plan,buffer,timebuf);
 #if 0
   printf("Filter impulse response after IFFT before windowing\n");
   for(int n=0;n< M;n++)
@@ -613,8 +1100,7 @@ int window_rfilter(int const L,int const M,complex float * const response,float
 #endif
   
   // Now back to frequency domain
-  fftwf_execute(fwd_filter_plan);
-  fftwf_destroy_plan(fwd_filter_plan);
+  fftwf_execute_dft_r2c(fwd_filter_plan,timebuf,buffer);
   fftwf_free(timebuf);
 #if 0
   printf("Filter frequency response\n");
@@ -656,15 +1142,30 @@ float const noise_gain(struct filter_out const * const filter){
 }
 
 
-// This can occasionally be called with slave == NULL at startup, so don't abort
-int set_filter(struct filter_out * const slave,float const low,float const high,float const kaiser_beta){
-  if(slave == NULL || isnan(low) || isnan(high) || isnan(kaiser_beta))
-    return -1;
-
-  assert(fabs(low) <= 0.5);
-  assert(fabs(high) <= 0.5);
-
-  struct filter_in *master = slave->master;
+// Filter design cache
+// A windowed response depends only on the sizes, band edges, window and output type, so
+// designs are shared by every slave with the same parameters and kept after the last one
+// lets go, up to a limit. Mode changes, retuning and scanning back and forth then just swap pointers.
+// Entries preloaded with preload_filter() are never evicted
+#define RESPONSE_CACHE_SIZE 32 // Unused designs kept
+
+struct response_entry {
+  struct response_entry *next;
+  int N;                    // Master FFT size; sets the gain
+  int N_dec;
+  float low;
+  float high;
+  float beta;
+  enum filtertype out_type;
+  int refs;                 // Slaves using it, plus one if preloaded
+  complex float *response;  // N_dec points
+};
+static struct response_entry *Response_cache; // Most recently used first
+static pthread_mutex_t Response_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+// Design the response set_filter() uses, without touching any slave
+static complex float *design_response(struct filter_out const * const slave,float const low,float const high,float const kaiser_beta,enum filtertype const out_type){
+  struct filter_in const *master = slave->master;
 
   int const L_dec = slave->olen;
   int const M_dec = (master->impulse_length - 1) / slave->decimate + 1;
@@ -673,11 +1174,12 @@ int set_filter(struct filter_out * const slave,float const low,float const high,
 
   float gain = 1./((float)N);
 #if 1
-  if(slave->out_type == REAL || slave->out_type == CROSS_CONJ)
+  if(out_type == REAL || out_type == CROSS_CONJ)
     gain *= M_SQRT1_2;
 #endif
 
   complex float * const response = fftwf_alloc_complex(N_dec);
+  assert(response != NULL);
   for(int n=0;n<N_dec;n++){
     float f;
     if(n <= N_dec/2)
@@ -690,17 +1192,175 @@ int set_filter(struct filter_out * const slave,float const low,float const high,
       response[n] = 0;
   }
   window_filter(L_dec,M_dec,response,kaiser_beta);
+  return response;
+}
+
+// Caller holds Response_mutex; a hit is moved to the front
+static struct response_entry *lookup_response(int const N,int const N_dec,float const low,float const high,float const beta,enum filtertype const out_type){
+  for(struct response_entry **pp = &Response_cache; *pp != NULL; pp = &(*pp)->next){
+    struct response_entry * const e = *pp;
+    if(e->N == N && e->N_dec == N_dec && e->low == low && e->high == high && e->beta == beta && e->out_type == out_type){
+      *pp = e->next;
+      e->next = Response_cache;
+      Response_cache = e;
+      return e;
+    }
+  }
+  return NULL;
+}
+
+// Return a referenced cache entry for these parameters, designing it if necessary
+static struct response_entry *get_response(struct filter_out const * const slave,float const low,float const high,float const beta,enum filtertype const out_type){
+  struct filter_in const *master = slave->master;
+  int const N = master->ilen + master->impulse_length - 1;
+  int const N_dec = slave->olen + (master->impulse_length - 1) / slave->decimate;
+
+  pthread_mutex_lock(&Response_mutex);
+  struct response_entry *e = lookup_response(N,N_dec,low,high,beta,out_type);
+  if(e != NULL){
+    e->refs++;
+    pthread_mutex_unlock(&Response_mutex);
+    return e;
+  }
+  pthread_mutex_unlock(&Response_mutex);
+
+  // Design without holding the lock; if another thread beat us to it, use theirs
+  complex float * const response = design_response(slave,low,high,beta,out_type);
+
+  pthread_mutex_lock(&Response_mutex);
+  e = lookup_response(N,N_dec,low,high,beta,out_type);
+  if(e != NULL){
+    e->refs++;
+    pthread_mutex_unlock(&Response_mutex);
+    fftwf_free(response);
+    return e;
+  }
+  e = calloc(1,sizeof(*e));
+  assert(e != NULL);
+  e->N = N;
+  e->N_dec = N_dec;
+  e->low = low;
+  e->high = high;
+  e->beta = beta;
+  e->out_type = out_type;
+  e->refs = 1;
+  e->response = response;
+  e->next = Response_cache;
+  Response_cache = e;
+
+  // Evict the least recently used designs nobody holds
+  int unused = 0;
+  for(struct response_entry **pp = &Response_cache; *pp != NULL;){
+    struct response_entry * const victim = *pp;
+    if(victim->refs == 0 && ++unused > RESPONSE_CACHE_SIZE){
+      *pp = victim->next;
+      fftwf_free(victim->response);
+      free(victim);
+    } else
+      pp = &victim->next;
+  }
+  pthread_mutex_unlock(&Response_mutex);
+  return e;
+}
+static void release_response(struct response_entry * const e){
+  pthread_mutex_lock(&Response_mutex);
+  assert(e->refs > 0);
+  e->refs--;
+  pthread_mutex_unlock(&Response_mutex);
+}
+
+// Design the response set_filter() would use with these parameters on this slave's sizes
+// (and on any other slave of the same sizes) and keep it in the cache for good.
+// The output type is given because it can differ from the slave's current one
+int preload_filter(struct filter_out const * const slave,float low,float high,float const kaiser_beta,enum filtertype const out_type){
+  if(slave == NULL || isnan(low) || isnan(high) || isnan(kaiser_beta))
+    return -1;
+  // Edges beyond Nyquist would pass every bin and alias; hold them to it
+  low = max(-0.5f,min(0.5f,low));
+  high = max(-0.5f,min(0.5f,high));
+
+  get_response(slave,low,high,kaiser_beta,out_type); // Reference held by the cache itself
+  return 0;
+}
+
+// This can occasionally be called with slave == NULL at startup, so don't abort
+int set_filter(struct filter_out * const slave,float low,float high,float const kaiser_beta){
+  if(slave == NULL || isnan(low) || isnan(high) || isnan(kaiser_beta))
+    return -1;
+
+  // Edges beyond Nyquist would pass every bin and alias; hold them to it
+  low = max(-0.5f,min(0.5f,low));
+  high = max(-0.5f,min(0.5f,high));
+
+  struct response_entry *e = get_response(slave,low,high,kaiser_beta,slave->out_type);
+
   // Hot swap with existing response, if any, using mutual exclusion
   pthread_mutex_lock(&slave->response_mutex);
-  complex float *tmp = slave->response;
-  slave->response = response;
+  while(e->out_type != slave->out_type){
+    // set_filter_type() got in first; design for the new type instead
+    enum filtertype const out_type = slave->out_type;
+    pthread_mutex_unlock(&slave->response_mutex);
+    release_response(e);
+    e = get_response(slave,low,high,kaiser_beta,out_type);
+    pthread_mutex_lock(&slave->response_mutex);
+  }
+  struct response_entry * const old_entry = slave->cached;
+  complex float * const old_response = slave->response;
+  slave->response = e->response;
+  slave->cached = e;
   slave->noise_gain = noise_gain(slave);
   pthread_mutex_unlock(&slave->response_mutex);
-  fftwf_free(tmp);
+  if(old_entry != NULL)
+    release_response(old_entry);
+  else
+    fftwf_free(old_response);
 
   return 0;
 }
 
+// Change the output type of an existing slave, e.g., when its demodulator changes mode
+// Its buffers and inverse FFT plan are rebuilt for the new type, and a response from set_filter()
+// is replaced with the same design for the new type. Only the thread that runs
+// execute_filter_output() on this slave may call this
+int set_filter_type(struct filter_out * const slave,enum filtertype const out_type){
+  assert(slave != NULL);
+  if(slave == NULL)
+    return -1;
+  if(slave->out_type == out_type)
+    return 0;
+
+  // Find (or, on a cache miss, design) the new response before taking the lock that
+  // execute_filter_output() takes every block. If set_filter() changes the edges meanwhile, do it again
+  struct response_entry *e = NULL;
+  pthread_mutex_lock(&slave->response_mutex);
+  struct response_entry *old_entry = slave->cached;
+  while(old_entry != NULL && (e == NULL || e->low != old_entry->low || e->high != old_entry->high || e->beta != old_entry->beta)){
+    float const low = old_entry->low;
+    float const high = old_entry->high;
+    float const beta = old_entry->beta;
+    pthread_mutex_unlock(&slave->response_mutex);
+    if(e != NULL)
+      release_response(e);
+    e = get_response(slave,low,high,beta,out_type); // Usually preloaded
+    pthread_mutex_lock(&slave->response_mutex);
+    old_entry = slave->cached;
+  }
+  fftwf_free(slave->f_fdomain);
+  fftwf_free(slave->output_buffer.c);
+  slave->out_type = out_type;
+  init_output(slave);
+  if(e != NULL){
+    slave->response = e->response;
+    slave->cached = e;
+  }
+  if(slave->response != NULL)
+    slave->noise_gain = noise_gain(slave);
+  pthread_mutex_unlock(&slave->response_mutex);
+  if(old_entry != NULL)
+    release_response(old_entry);
+  return 0;
+}
+
 
 // Experimental IIR complex notch filter
 
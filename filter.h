@@ -9,6 +9,7 @@
 #define _FILTER_H 1
 
 #include <pthread.h>
+#include <stdbool.h>
 #include <complex.h>
 #include <fftw3.h>
 #undef I
@@ -52,46 +53,117 @@ struct filter {
   pthread_cond_t filter_cond;
 
 };
+// Frequency domain bus
+// The master publishes each forward FFT into a ring of slots under a seqlock, and slaves read them
+// A private master keeps a one-slot ring in ordinary memory. A shared one maps the same layout from
+// a file (normally in /dev/shm) so slaves in other processes can attach and run only their own filter_out
+#define FBUS_MAGIC 0x6b397162
+#define FBUS_VERSION 1
+#define FBUS_SLOTS 8
+
+struct fbus_slot {
+  unsigned int blocknum;             // Block held in this slot; the first one published is 1
+  double samprate;                   // Metadata supplied by the producer along with the block
+  double frequency;                  // Front end LO frequency
+  long long timestamp;               // Input sample number of the first new sample in the block
+};
+struct fbus {
+  unsigned int magic;                // Written last when a shared bus is created
+  unsigned int version;
+  enum filtertype in_type;
+  unsigned int ilen;                 // L
+  unsigned int impulse_length;       // M
+  unsigned int slots;
+  unsigned int stride;               // complex floats from one slot's spectrum to the next
+  unsigned int data_offset;          // Bytes from the start of a shared bus to the first spectrum
+  // Seqlock: odd while a slot is being written, even when a block is published; blocks published = seq/2
+  unsigned int seq;
+  unsigned int waiters;              // Slaves sleeping on seq (in all processes); master skips the wakeup when 0
+  struct fbus_slot slot[];
+};
+
 struct filter_in {
   enum filtertype in_type;           // REAL or COMPLEX
   unsigned int ilen;                          // Length of user portion of input buffer, aka 'L'
   unsigned int impulse_length;                // Length of filter impulse response, aka 'M'
-  complex float *fdomain;            // Signal in frequency domain
-  union rc input_buffer;             // Actual time-domain input buffer, length N = L + M - 1
-  union rc input;                    // Beginning of user input area, length L
-  fftwf_plan fwd_plan;               // FFT (time -> frequency)
-  unsigned int blocknum;                      // Data sequence number, used to notify slaves of new data
-  pthread_mutex_t filter_mutex;      // Synchronization for sequence number
+  complex float *fdomain;            // Most recently published spectrum; NULL when attached to another process's bus
+  union rc input_buffer;             // Current time-domain FFT input window, length N = L + M - 1
+  union rc input;                    // Beginning of user input area, length L; moves after every block
+  fftwf_plan fwd_plan;               // FFT (time -> frequency), shared from plan cache; don't destroy
+  void *window_map;                  // Ring mapped twice back to back that input_buffer slides through; NULL if we copy
+  size_t window_size;                // Bytes in one copy of the ring
+  size_t window_offset;              // Bytes from window_map to input_buffer
+  size_t write_offset;               // Bytes from window_map to the next block next_filter_input() hands out
+  struct fbus *bus;                  // Seqlock and slot headers
+  complex float *ring;               // bus->slots spectra, bus->stride apart
+  // Metadata for the next block, set by the producer before execute_filter_input()
+  double samprate;
+  double frequency;
+  long long timestamp;
+  bool shared;                       // Bus is mapped from a file and may have slaves in other processes
+  bool attached;                     // We only read someone else's bus; execute_filter_input() isn't allowed
+  size_t map_size;
+  char *path;                        // Shared bus file, removed when the producer deletes the filter
+  pthread_mutex_t filter_mutex;      // Used only where futexes aren't available
   pthread_cond_t filter_cond;
-  int fd;                            // Experimental: fd for shared frequency representation file
-
+  int fd;
 };
+struct response_entry;
+
 struct filter_out {
   struct filter_in *master;
   enum filtertype out_type;          // REAL, COMPLEX or CROSS_CONJ
   complex float *response;           // Filter response in frequency domain
+  struct response_entry *cached;     // Design cache entry that owns response[], or NULL if we own it
   pthread_mutex_t response_mutex;
   complex float *f_fdomain;          // Filtered signal in frequency domain
   float noise_gain;                  // Filter gain on uniform noise (ratio < 1)
   union rc output_buffer;            // Actual time-domain output buffer, length N/decimate
   union rc output;                   // Beginning of user output area, length L/decimate
-  fftwf_plan rev_plan;               // IFFT (frequency -> time)
+  fftwf_plan rev_plan;               // IFFT (frequency -> time), shared from plan cache; don't destroy
   unsigned int decimate;                      // Ratio of input to output sample rate
   unsigned int olen;                          // Length of user portion of output buffer
   unsigned int blocknum;                      // Last sequence number received from master, used for synchronization
+  unsigned long long skipped;        // Blocks never seen because we fell behind
+  unsigned long long overruns;       // Blocks overwritten by the master while we were reading them
+  // Producer's metadata for the block most recently filtered
+  double samprate;
+  double frequency;
+  long long timestamp;
+};
+// FFTW plans are cached and shared by all filters; see get_plan()
+enum plan_kind {
+  C2C_FORWARD,
+  C2C_BACKWARD,
+  R2C,
+  C2R,
 };
+extern char const *Wisdom_file;
+extern unsigned int FFTW_planning_level;
+fftwf_plan get_plan(enum plan_kind,int N,bool inplace);
+int load_wisdom(char const *);
+int save_wisdom(char const *);
+
 int window_filter(int L,int M,complex float *response,float beta);
 int window_rfilter(int L,int M,complex float *response,float beta);
 
 struct filter_in *create_filter_input(unsigned int const L,unsigned int const M, enum filtertype const in_type);
-struct filter_in *create_filter_input_file(unsigned int const L,unsigned int const M, enum filtertype const in_type,char *file);
+struct filter_in *create_filter_input_bus(unsigned int const L,unsigned int const M, enum filtertype const in_type,char const *name,unsigned int slots);
+struct filter_in *attach_filter_input(char const *name);
 struct filter_out *create_filter_output(struct filter_in * master,complex float * response,unsigned int decimate, enum filtertype out_type);
 int execute_filter_input(struct filter_in *);
+bool set_filter_input_depth(struct filter_in *,unsigned int);
+union rc next_filter_input(struct filter_in *);
+unsigned int latest_filter_block(struct filter_in const *,complex float const **);
+bool filter_block_overwritten(struct filter_in const *,unsigned int);
+bool latest_filter_metadata(struct filter_in const *,struct fbus_slot *);
 int execute_filter_output(struct filter_out *,int);
 int delete_filter_input(struct filter_in *);
 int delete_filter_output(struct filter_out *);
 int make_kaiser(float *window,unsigned int M,float beta);
 int set_filter(struct filter_out *,float,float,float);
+int set_filter_type(struct filter_out *,enum filtertype);
+int preload_filter(struct filter_out const *,float,float,float,enum filtertype);
 float const noise_gain(struct filter_out const *);
 
 
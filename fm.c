@@ -7,8 +7,12 @@
 #include <string.h>
 #include <math.h>
 #include <complex.h>
+#include <float.h>
 #include <fftw3.h>
 #undef I
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 #include "misc.h"
 #include "dsp.h"
@@ -17,6 +21,191 @@
 
 double fm_snr(double r);
 
+// De-emphasis, -6dB/octave: 1/e at 300 Hz - who knows what the actual "standard" is??
+// Per-sample decay is exp(-Deemph_rate/samprate), 0.99376949 at 48 kHz
+static float const Deemph_rate = 300;
+
+// Block demodulator kernels
+// Each works on a whole block of filter output; the AVX2 versions do 8 samples at a time
+#if defined(__AVX2__) && defined(__FMA__)
+// Vector fast_atan2f()
+static inline __m256 atan2_ps(__m256 const y,__m256 const x){
+  __m256 const sign = _mm256_set1_ps(-0.0f);
+  __m256 const ax = _mm256_andnot_ps(sign,x);
+  __m256 const ay = _mm256_andnot_ps(sign,y);
+  __m256 const a = _mm256_div_ps(_mm256_min_ps(ax,ay),_mm256_max_ps(_mm256_max_ps(ax,ay),_mm256_set1_ps(FLT_MIN)));
+  __m256 const s = _mm256_mul_ps(a,a);
+  __m256 p = _mm256_fmadd_ps(_mm256_set1_ps(ATAN_C5),s,_mm256_set1_ps(ATAN_C4));
+  p = _mm256_fmadd_ps(p,s,_mm256_set1_ps(ATAN_C3));
+  p = _mm256_fmadd_ps(p,s,_mm256_set1_ps(ATAN_C2));
+  p = _mm256_fmadd_ps(p,s,_mm256_set1_ps(ATAN_C1));
+  p = _mm256_fmadd_ps(p,s,_mm256_set1_ps(ATAN_C0));
+  __m256 r = _mm256_mul_ps(p,a);
+  r = _mm256_blendv_ps(r,_mm256_sub_ps(_mm256_set1_ps(M_PI_2),r),_mm256_cmp_ps(ay,ax,_CMP_GT_OQ));
+  r = _mm256_blendv_ps(r,_mm256_sub_ps(_mm256_set1_ps(M_PI),r),x); // Sign bit of x selects
+  return _mm256_or_ps(r,_mm256_and_ps(y,sign));
+}
+// sqrt(t) as t * rsqrt(t), with one Newton step on the estimate
+static inline __m256 sqrt_ps(__m256 const t){
+  __m256 const tt = _mm256_max_ps(t,_mm256_set1_ps(FLT_MIN));
+  __m256 const e = _mm256_rsqrt_ps(tt);
+  __m256 const h = _mm256_mul_ps(_mm256_set1_ps(0.5f),_mm256_mul_ps(tt,e));
+  __m256 const r = _mm256_mul_ps(e,_mm256_fnmadd_ps(h,e,_mm256_set1_ps(1.5f)));
+  return _mm256_mul_ps(t,r);
+}
+// Split 8 complex samples into real and imaginary parts, in the order 0 1 4 5 2 3 6 7
+static inline void split_ps(complex float const * const p,__m256 * const re,__m256 * const im){
+  __m256 const a = _mm256_loadu_ps((float const *)p);
+  __m256 const b = _mm256_loadu_ps((float const *)(p + 4));
+  *re = _mm256_shuffle_ps(a,b,0x88);
+  *im = _mm256_shuffle_ps(a,b,0xdd);
+}
+// Between natural order and split_ps() order (the permutation is its own inverse)
+static inline __m256 unsplit_ps(__m256 const v){
+  return _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(v),0xd8));
+}
+static inline float hsum_ps(__m256 const v){
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+  s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+  s = _mm_add_ss(s,_mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+static inline float hmax_ps(__m256 const v){
+  __m128 s = _mm_max_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+  s = _mm_max_ps(s,_mm_movehl_ps(s,s));
+  s = _mm_max_ss(s,_mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+static inline float hmin_ps(__m256 const v){
+  __m128 s = _mm_min_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+  s = _mm_min_ps(s,_mm_movehl_ps(s,s));
+  s = _mm_min_ss(s,_mm_movehdup_ps(s));
+  return _mm_cvtss_f32(s);
+}
+#endif
+
+// Amplitude of every sample, plus the block's average power and the mean and variance of its amplitude
+// (inputs to the Rice SNR estimate). The statistics are taken about the first amplitude, which
+// keeps a one-pass variance from cancelling catastrophically on a strong, steady carrier
+static void fm_amplitudes(float * const amp,complex float const * const x,int const n,
+			  float * const power,float * const mean,float * const variance){
+  float const k = cabsf(x[0]);
+  float sum_t = 0, sum_d = 0, sum_dd = 0;
+  int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 const kv = _mm256_set1_ps(k);
+  __m256 vt = _mm256_setzero_ps(), vd = _mm256_setzero_ps(), vdd = _mm256_setzero_ps();
+  for(; i + 8 <= n; i += 8){
+    __m256 re,im;
+    split_ps(x + i,&re,&im);
+    __m256 const t = _mm256_fmadd_ps(re,re,_mm256_mul_ps(im,im));
+    __m256 const a = sqrt_ps(t);
+    _mm256_storeu_ps(amp + i,unsplit_ps(a));
+    __m256 const d = _mm256_sub_ps(a,kv);
+    vt = _mm256_add_ps(vt,t);
+    vd = _mm256_add_ps(vd,d);
+    vdd = _mm256_fmadd_ps(d,d,vdd);
+  }
+  sum_t = hsum_ps(vt);
+  sum_d = hsum_ps(vd);
+  sum_dd = hsum_ps(vdd);
+#endif
+  for(; i < n; i++){
+    float const t = cnrmf(x[i]);
+    amp[i] = sqrtf(t);
+    float const d = amp[i] - k;
+    sum_t += t;
+    sum_d += d;
+    sum_dd += d * d;
+  }
+  *power = sum_t / n;
+  *mean = k + sum_d / n;
+  *variance = max(0.0f,(sum_dd - sum_d * sum_d / n) / (n - 1));
+}
+
+// Frequency discriminator: out[i] = arg(x[i] * conj(x[i-1])) * scale, times min(1,|x[i]||x[i-1]|/threshold)
+// unless flat, for the experimental threshold reduction per Fred Harris (if I understood him)
+// x[-1] and its amplitude are passed in prev and prev_amp
+// Returns the sum of the raw angles; their extremes go in *maxf and *minf
+static float fm_discriminate(float * const out,complex float const * const x,float const * const amp,int const n,
+			     complex float const prev,float const prev_amp,float const scale,float const threshold,
+			     bool const flat,float * const maxf,float * const minf){
+  float const inv_thresh = 1 / max(threshold,FLT_MIN);
+  // First sample against the end of the last block
+  float ang = fast_atan2f(cimagf(x[0] * conjf(prev)),crealf(x[0] * conjf(prev)));
+  float sum = ang;
+  float hi = ang, lo = ang;
+  out[0] = flat ? ang * scale : ang * scale * min(1.0f,amp[0] * prev_amp * inv_thresh);
+  int i = 1;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 const sv = _mm256_set1_ps(scale);
+  __m256 const tv = _mm256_set1_ps(inv_thresh);
+  __m256 const one = _mm256_set1_ps(1);
+  __m256 vsum = _mm256_setzero_ps();
+  __m256 vhi = _mm256_set1_ps(ang), vlo = _mm256_set1_ps(ang);
+  for(; i + 8 <= n; i += 8){
+    __m256 re,im,pre,pim;
+    split_ps(x + i,&re,&im);
+    split_ps(x + i - 1,&pre,&pim);
+    __m256 const rp = _mm256_fmadd_ps(re,pre,_mm256_mul_ps(im,pim));
+    __m256 const ip = _mm256_fmsub_ps(im,pre,_mm256_mul_ps(re,pim));
+    __m256 const a = unsplit_ps(atan2_ps(ip,rp));
+    vsum = _mm256_add_ps(vsum,a);
+    vhi = _mm256_max_ps(vhi,a);
+    vlo = _mm256_min_ps(vlo,a);
+    __m256 o = _mm256_mul_ps(a,sv);
+    if(!flat){
+      __m256 const m = _mm256_mul_ps(_mm256_mul_ps(_mm256_loadu_ps(amp + i),_mm256_loadu_ps(amp + i - 1)),tv);
+      o = _mm256_mul_ps(o,_mm256_min_ps(m,one));
+    }
+    _mm256_storeu_ps(out + i,o);
+  }
+  sum += hsum_ps(vsum);
+  hi = hmax_ps(vhi);
+  lo = hmin_ps(vlo);
+#endif
+  for(; i < n; i++){
+    complex float const p = x[i] * conjf(x[i-1]);
+    ang = fast_atan2f(cimagf(p),crealf(p));
+    sum += ang;
+    hi = max(hi,ang);
+    lo = min(lo,ang);
+    out[i] = flat ? ang * scale : ang * scale * min(1.0f,amp[i] * amp[i-1] * inv_thresh);
+  }
+  *maxf = hi;
+  *minf = lo;
+  return sum;
+}
+
+// First order IIR s[i] = decay * s[i-1] + s[i], in place; state is the last output of the previous block
+// The vector version resolves the recursion 8 samples at a time with a log-step prefix scan
+// Returns the new state
+static float deemphasize(float * const s,int const n,float state,float const decay){
+  int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  float const d2 = decay * decay;
+  float const d4 = d2 * d2;
+  float const d8 = d4 * d4;
+  __m256 const dpow = _mm256_setr_ps(decay,d2,d2*decay,d4,d4*decay,d4*d2,d4*d2*decay,d8); // decay^(i+1)
+  __m256 const zero = _mm256_setzero_ps();
+  __m256i const sh1 = _mm256_setr_epi32(0,0,1,2,3,4,5,6);
+  __m256i const sh2 = _mm256_setr_epi32(0,0,0,1,2,3,4,5);
+  __m256i const sh4 = _mm256_setr_epi32(0,0,0,0,0,1,2,3);
+  for(; i + 8 <= n; i += 8){
+    __m256 v = _mm256_loadu_ps(s + i);
+    v = _mm256_fmadd_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(v,sh1),zero,0x01),_mm256_set1_ps(decay),v);
+    v = _mm256_fmadd_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(v,sh2),zero,0x03),_mm256_set1_ps(d2),v);
+    v = _mm256_fmadd_ps(_mm256_blend_ps(_mm256_permutevar8x32_ps(v,sh4),zero,0x0f),_mm256_set1_ps(d4),v);
+    v = _mm256_fmadd_ps(dpow,_mm256_set1_ps(state),v);
+    _mm256_storeu_ps(s + i,v);
+    state = s[i + 7];
+  }
+#endif
+  for(; i < n; i++)
+    state = s[i] += decay * state;
+  return state;
+}
+
 // FM demodulator thread
 void *demod_fm(void *arg){
   pthread_setname("fm");
@@ -25,46 +214,40 @@ void *demod_fm(void *arg){
 
   complex float state = 0;
   float const dsamprate = (float)demod->input.samprate / demod->filter.decimate; // Decimated (output) sample rate
+  float const deemph_decay = expf(-Deemph_rate / dsamprate);
   demod->sig.pdeviation = 0;
   demod->sig.foffset = 0;
   demod->output.channels = 1; // Only mono for now
   struct filter_out * const filter = demod->filter.out;
-  float lastaudio = 0; // state for impulse noise removal
+  float lastaudio = 0; // De-emphasis state
   int squelch_open = 0; // Number of blocks for which squelch remains open
 
   while(1){
     // Are we active?
     pthread_mutex_lock(&demod->demod_mutex);
-    while(demod->demod_type != FM_DEMOD)
+    while(demod->demod_type != FM_DEMOD && !demod->terminate)
       pthread_cond_wait(&demod->demod_cond,&demod->demod_mutex);
     pthread_mutex_unlock(&demod->demod_mutex);
+    if(demod->terminate)
+      break; // Channel deleted
+
+    // Coming from a mode with another filter output type?
+    set_filter_type(filter,COMPLEX);
 
     // Wait for next block of frequency domain data
-    execute_filter_output(filter,0);
+    struct tuning const tuning = get_tuning(demod);
+    execute_filter_output(filter,tuning.rotate);
+    fine_tune(demod,filter->output.c,filter->olen,tuning.residual);
 
     // Constant gain used by FM only; automatically adjusted by AGC in linear modes
     // We do this in the loop because BW can change
     float const gain = (demod->agc.headroom *  M_1_PI * dsamprate) / fabsf(demod->filter.low - demod->filter.high);
 
     
-    // Find average amplitude and variance for SNR estimation
-    // Use two passes to avoid possible numerical problems
+    // Power, and mean and variance of the amplitude for the SNR estimate, in one pass
     float amplitudes[filter->olen];
-    demod->sig.bb_power = 0;
-    float avg_amp = 0;
-    for(int n=0; n < filter->olen; n++){
-      float t = cnrmf(filter->output.c[n]);
-      demod->sig.bb_power += t;
-      avg_amp += amplitudes[n] = sqrtf(t);
-    }
-    demod->sig.bb_power /= filter->olen;
-    avg_amp /= filter->olen;
-
-    float fm_variance = 0;
-    for(int n=0; n < filter->olen; n++)
-      fm_variance += (amplitudes[n] - avg_amp) * (amplitudes[n] - avg_amp);
-
-    fm_variance /= (filter->olen - 1);
+    float avg_amp,fm_variance;
+    fm_amplitudes(amplitudes,filter->output.c,filter->olen,&demod->sig.bb_power,&avg_amp,&fm_variance);
 
     demod->sig.snr = fm_snr(avg_amp*avg_amp/fm_variance);
     demod->sig.snr = max(0.0f,demod->sig.snr); // Smoothed values can be a little inconsistent
@@ -78,39 +261,18 @@ void *demod_fm(void *arg){
       squelch_open--;
 
       // Actual FM demodulation
-      float pdev_pos = 0;
-      float pdev_neg = 0;
-      float avg_f = 0;
-
-      for(int n=0; n < filter->olen; n++){
-	complex float p = filter->output.c[n] * conjf(state);
-	state = filter->output.c[n];
-
-	float ang = cargf(p);
-	// Experimental threshold reduction per Fred Harris (if I understood him)
-	float amp = cabsf(p) / fm_variance;
-	if(amp > 1)
-	  amp = 1;
-
-
-	avg_f += ang; // Direct FM for frequency measurement
-	if(n == 0)
-	  pdev_pos = pdev_neg = ang;
-	else if(ang > pdev_pos)
-	  pdev_pos = ang;
-	else if(lastaudio < pdev_neg)
-	  pdev_neg = ang;
-
-	if(demod->opt.flat){
-	  samples[n] = ang * gain; // Straight FM, no threshold extension
-	} else {
-	  // Integrate to turn FM to PM; de-emphasis -6dB/octave, -20dB/decade.
-	  // 0.135 factor is empirical; gives -15 dB audio with 400 Hz modulation and 5 kHz deviation in 16 kHz BW, 26 dB SNR
-	  // 400 Hz at +-5 kHz gives -22.5 dB in FLAT mode
-	  samples[n] = lastaudio += ang * .114 * gain * amp;
-	  lastaudio *= 0.99376949; // 1/e at 300 Hz - who knows what the actual "standard" is??
-	}
-      }
+      // Flat is straight FM, with no threshold extension
+      // Otherwise we integrate to turn FM to PM; de-emphasis -6dB/octave, -20dB/decade.
+      // 0.135 factor is empirical; gives -15 dB audio with 400 Hz modulation and 5 kHz deviation in 16 kHz BW, 26 dB SNR
+      // 400 Hz at +-5 kHz gives -22.5 dB in FLAT mode
+      float pdev_pos,pdev_neg;
+      float const scale = demod->opt.flat ? gain : .114 * gain;
+      float avg_f = fm_discriminate(samples,filter->output.c,amplitudes,filter->olen,state,cabsf(state),
+				    scale,fm_variance,demod->opt.flat,&pdev_pos,&pdev_neg);
+      state = filter->output.c[filter->olen-1];
+      if(!demod->opt.flat)
+	lastaudio = deemphasize(samples,filter->olen,lastaudio,deemph_decay);
+
       avg_f /= filter->olen;  // Average FM output is freq offset
       // Update frequency offset and peak deviation
       demod->sig.foffset = dsamprate  * avg_f * M_1_2PI;
@@ -121,15 +283,10 @@ void *demod_fm(void *arg){
       demod->sig.pdeviation = dsamprate * max(pdev_pos,-pdev_neg) * M_1_2PI;
     } else {
       state = 0;
-      for(int n = 0; n < filter->olen; n++){
-	if(demod->opt.flat)
-	  samples[n] = 0;
-	else {
-	  // Continue to decay audio to prevent thump when squelch closes
-	  samples[n] = lastaudio;
-	  lastaudio *= 0.99376949; // 1/e at 300 Hz
-	}
-      }
+      memset(samples,0,sizeof(samples));
+      // Continue to decay audio to prevent thump when squelch closes
+      if(!demod->opt.flat)
+	lastaudio = deemphasize(samples,filter->olen,lastaudio,deemph_decay);
     }
 
     float output_level = 0;
@@ -138,6 +295,7 @@ void *demod_fm(void *arg){
     demod->output.level = output_level / filter->olen;
     send_mono_output(demod,samples,filter->olen);
   }
+  return NULL;
 }
 // The amplitude of a noisy FM signal has a Rice distribution
 // Given the ratio 'r' of the mean and standard deviation measurements, find the
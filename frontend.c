@@ -0,0 +1,316 @@
+// $Id$
+// Sample conditioning for SDR front ends: clip counting, DC removal, I/Q gain and phase
+// correction and Fs/4 frequency shift in one pass, gathering the statistics for the estimators,
+// and the sample ring from the USB callback to the decimator
+// Copyright 2026 agent
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#if defined(__linux__)
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
+#include "frontend.h"
+
+void init_iq_cond(struct iq_cond *cond,int rotate){
+  assert(cond != NULL);
+  if(cond == NULL)
+    return;
+  memset(cond,0,sizeof(*cond));
+  cond->gain_i = cond->gain_q = 1;
+  cond->secphi = 1;
+  cond->rotate = rotate & 3;
+}
+
+// Multiplication by i^k, as cos and sin; shared by the scalar and vector paths
+static float const Rot_cos[4] = { 1, 0, -1, 0 };
+static float const Rot_sin[4] = { 0, 1, 0, -1 };
+
+static inline __attribute__((always_inline)) complex float load_sample(void const *input,int i,enum iq_format const format){
+  switch(format){
+  case IQ_S8:
+    return CMPLXF(((int8_t const *)input)[2*i],((int8_t const *)input)[2*i+1]);
+  case IQ_S16:
+    return CMPLXF(((int16_t const *)input)[2*i],((int16_t const *)input)[2*i+1]);
+  case IQ_S32:
+    return CMPLXF(((int32_t const *)input)[2*i],((int32_t const *)input)[2*i+1]);
+  default:
+  case IQ_F32:
+    return ((complex float const *)input)[i];
+  }
+}
+
+#if defined(__AVX2__) && defined(__FMA__)
+// Four complex samples as eight floats
+static inline __attribute__((always_inline)) __m256 load_vector(void const *input,int i,enum iq_format const format){
+  switch(format){
+  case IQ_S8:
+    return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64((__m128i const *)((int8_t const *)input + 2*i))));
+  case IQ_S16:
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((__m128i const *)((int16_t const *)input + 2*i))));
+  case IQ_S32:
+    return _mm256_cvtepi32_ps(_mm256_loadu_si256((__m256i const *)((int32_t const *)input + 2*i)));
+  default:
+  case IQ_F32:
+    return _mm256_loadu_ps((float const *)input + 2*i);
+  }
+}
+
+// Sum of the even (I) and odd (Q) lanes
+static inline complex float hsum_complex(__m256 v){
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(v),_mm256_extractf128_ps(v,1));
+  s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+  float f[4];
+  _mm_storeu_ps(f,s);
+  return CMPLXF(f[0],f[1]);
+}
+#endif
+
+static inline __attribute__((always_inline)) void condition(struct iq_cond *cond,struct iq_stats *stats,complex float *output,void const *input,float const scale,int const cnt,enum iq_format const format){
+  float const dci = crealf(cond->DC), dcq = cimagf(cond->DC);
+  float const gi = cond->gain_i, gq = cond->gain_q;
+  float const secphi = cond->secphi, tanphi = cond->tanphi;
+  int const rotate = cond->rotate;
+  int phase = cond->phase;
+
+  complex float sum = 0;
+  float i_energy = 0, q_energy = 0, dotprod = 0;
+  int clips = 0;
+  int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  {
+    // With a whole number of Fs/4 steps per sample, every group of four
+    // samples starts at the same rotation, so one pattern covers the block
+    float c[8], s[8];
+    for(int k=0; k < 4; k++){
+      int const p = (phase + k*rotate) & 3;
+      c[2*k] = c[2*k+1] = Rot_cos[p];
+      s[2*k] = -Rot_sin[p];
+      s[2*k+1] = Rot_sin[p];
+    }
+    __m256 const rc = _mm256_loadu_ps(c);
+    __m256 const rs = _mm256_loadu_ps(s);
+    __m256 const vscale = _mm256_set1_ps(scale);
+    __m256 const vdc = _mm256_setr_ps(dci,dcq,dci,dcq,dci,dcq,dci,dcq);
+    __m256 const vgain = _mm256_setr_ps(gi,gq,gi,gq,gi,gq,gi,gq);
+    __m256 const vsec = _mm256_setr_ps(1,secphi,1,secphi,1,secphi,1,secphi);
+    __m256 const vtan = _mm256_setr_ps(0,-tanphi,0,-tanphi,0,-tanphi,0,-tanphi);
+    __m256 const minus1 = _mm256_set1_ps(-1);
+    __m256 vsum = _mm256_setzero_ps();
+    __m256 venergy = _mm256_setzero_ps();
+    __m256 vdot = _mm256_setzero_ps();
+
+    for(; i + 4 <= cnt; i += 4){
+      __m256 x = _mm256_mul_ps(load_vector(input,i,format),vscale);
+      clips += __builtin_popcount(_mm256_movemask_ps(_mm256_cmp_ps(x,minus1,_CMP_LT_OQ)));
+      x = _mm256_max_ps(x,minus1);
+      vsum = _mm256_add_ps(vsum,x);
+      x = _mm256_sub_ps(x,vdc);
+      venergy = _mm256_fmadd_ps(x,x,venergy);
+      x = _mm256_mul_ps(x,vgain);
+      __m256 sw = _mm256_permute_ps(x,0xb1); // Q I Q I...
+      vdot = _mm256_fmadd_ps(x,sw,vdot);     // Both lanes of each pair get I*Q
+      x = _mm256_fmadd_ps(x,vsec,_mm256_mul_ps(sw,vtan)); // Q = secphi*Q - tanphi*I
+      sw = _mm256_permute_ps(x,0xb1);
+      x = _mm256_fmadd_ps(x,rc,_mm256_mul_ps(sw,rs));
+      _mm256_storeu_ps((float *)(output + i),x);
+    }
+    sum = hsum_complex(vsum);
+    complex float const e = hsum_complex(venergy);
+    i_energy = crealf(e);
+    q_energy = cimagf(e);
+    complex float const d = hsum_complex(vdot);
+    dotprod = 0.5f * (crealf(d) + cimagf(d));
+    phase = (phase + i*rotate) & 3;
+  }
+#endif
+  for(; i < cnt; i++){
+    complex float samp = load_sample(input,i,format) * scale;
+    float si = crealf(samp), sq = cimagf(samp);
+    clips += (si < -1) + (sq < -1);
+    si = si < -1 ? -1 : si;
+    sq = sq < -1 ? -1 : sq;
+    sum += CMPLXF(si,sq);
+    si -= dci;
+    sq -= dcq;
+    i_energy += si * si;
+    q_energy += sq * sq;
+    si *= gi;
+    sq *= gq;
+    dotprod += si * sq;
+    sq = secphi * sq - tanphi * si;
+    output[i] = CMPLXF(Rot_cos[phase] * si - Rot_sin[phase] * sq,Rot_sin[phase] * si + Rot_cos[phase] * sq);
+    phase = (phase + rotate) & 3;
+  }
+  cond->phase = phase;
+  stats->sum += sum;
+  stats->i_energy += i_energy;
+  stats->q_energy += q_energy;
+  stats->dotprod += dotprod;
+  stats->clips += clips;
+}
+
+// Condition cnt complex samples, each component scaled by 'scale' after conversion to float
+// Statistics are added to *stats, so a block may be done in pieces
+// Output may not overlap input unless both are IQ_F32 at the same address
+void iq_condition(struct iq_cond *cond,struct iq_stats *stats,complex float *output,void const *input,enum iq_format format,float scale,int cnt){
+  assert(cond != NULL && stats != NULL);
+  switch(format){
+  case IQ_S8:
+    condition(cond,stats,output,input,scale,cnt,IQ_S8);
+    break;
+  case IQ_S16:
+    condition(cond,stats,output,input,scale,cnt,IQ_S16);
+    break;
+  case IQ_S32:
+    condition(cond,stats,output,input,scale,cnt,IQ_S32);
+    break;
+  case IQ_F32:
+    condition(cond,stats,output,input,scale,cnt,IQ_F32);
+    break;
+  }
+}
+
+// Ring positions run modulo 2*size; the extra bit tells a full ring from an empty one
+static inline int ring_offset(struct iq_ring const *ring,unsigned int pos){
+  return pos < (unsigned int)ring->size ? (int)pos : (int)(pos - ring->size);
+}
+static inline unsigned int ring_advance(struct iq_ring const *ring,unsigned int pos,int cnt){
+  pos += cnt;
+  return pos >= 2U * ring->size ? pos - 2U * ring->size : pos;
+}
+static inline int ring_count(struct iq_ring const *ring,unsigned int wp,unsigned int rp){
+  return wp >= rp ? (int)(wp - rp) : (int)(wp + 2U * ring->size - rp);
+}
+
+// Sleep until ring->wp moves from wp or the timeout expires; returns 0 on timeout
+#if defined(__linux__)
+static int ring_wait(struct iq_ring *ring,unsigned int wp){
+  struct timespec ts;
+  ts.tv_sec = ring->timeout / 1000;
+  ts.tv_nsec = (ring->timeout % 1000) * 1000000L;
+  if(syscall(SYS_futex,&ring->wp,FUTEX_WAIT_PRIVATE,wp,&ts,NULL,0) == -1 && errno == ETIMEDOUT)
+    return 0;
+  return 1;
+}
+static void ring_wake(struct iq_ring *ring){
+  syscall(SYS_futex,&ring->wp,FUTEX_WAKE_PRIVATE,1,NULL,NULL,0);
+}
+#else
+static int ring_wait(struct iq_ring *ring,unsigned int wp){
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME,&ts);
+  ts.tv_sec += ring->timeout / 1000;
+  ts.tv_nsec += (ring->timeout % 1000) * 1000000L;
+  if(ts.tv_nsec >= 1000000000L){
+    ts.tv_sec++;
+    ts.tv_nsec -= 1000000000L;
+  }
+  int r = 0;
+  pthread_mutex_lock(&ring->mutex);
+  while(__atomic_load_n(&ring->wp,__ATOMIC_SEQ_CST) == wp && r == 0)
+    r = pthread_cond_timedwait(&ring->cond,&ring->mutex,&ts);
+  pthread_mutex_unlock(&ring->mutex);
+  return r != ETIMEDOUT;
+}
+static void ring_wake(struct iq_ring *ring){
+  pthread_mutex_lock(&ring->mutex);
+  pthread_cond_signal(&ring->cond);
+  pthread_mutex_unlock(&ring->mutex);
+}
+#endif
+
+// Ring of 'size' complex samples; the consumer counts an underrun after waiting 'timeout' ms
+struct iq_ring *create_iq_ring(int size,int timeout){
+  assert(size > 0);
+  if(size <= 0)
+    return NULL;
+  struct iq_ring * const ring = calloc(1,sizeof(*ring));
+  if(ring == NULL)
+    return NULL;
+  ring->buf = malloc(size * sizeof(*ring->buf));
+  if(ring->buf == NULL){
+    free(ring);
+    return NULL;
+  }
+  ring->size = size;
+  ring->timeout = timeout > 0 ? timeout : 1000;
+  pthread_mutex_init(&ring->mutex,NULL);
+  pthread_cond_init(&ring->cond,NULL);
+  return ring;
+}
+
+void delete_iq_ring(struct iq_ring *ring){
+  if(ring == NULL)
+    return;
+  pthread_cond_destroy(&ring->cond);
+  pthread_mutex_destroy(&ring->mutex);
+  free(ring->buf);
+  free(ring);
+}
+
+// Producer: claim room for cnt samples, returning where to write them
+// The first *first go at the returned pointer, the rest at ring->buf
+// Returns NULL and counts an overrun if the consumer hasn't made room
+complex float *iq_ring_write_start(struct iq_ring *ring,int cnt,int *first){
+  assert(ring != NULL && first != NULL);
+  unsigned int const wp = __atomic_load_n(&ring->wp,__ATOMIC_RELAXED); // We're the only writer
+  unsigned int const rp = __atomic_load_n(&ring->rp,__ATOMIC_ACQUIRE);  // Consumer is done with what's behind it
+  if(cnt > ring->size - ring_count(ring,wp,rp)){
+    ring->overruns++;
+    return NULL;
+  }
+  int const offset = ring_offset(ring,wp);
+  *first = cnt < ring->size - offset ? cnt : ring->size - offset;
+  return ring->buf + offset;
+}
+
+// Producer: publish cnt samples written after iq_ring_write_start(), waking the consumer only if it's asleep
+void iq_ring_write_done(struct iq_ring *ring,int cnt){
+  assert(ring != NULL);
+  unsigned int const wp = __atomic_load_n(&ring->wp,__ATOMIC_RELAXED);
+  __atomic_store_n(&ring->wp,ring_advance(ring,wp,cnt),__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&ring->waiters,__ATOMIC_SEQ_CST) != 0)
+    ring_wake(ring);
+}
+
+// Consumer: samples from the read position to the end of the buffer
+int iq_ring_read_contig(struct iq_ring const *ring){
+  assert(ring != NULL);
+  return ring->size - ring_offset(ring,__atomic_load_n(&ring->rp,__ATOMIC_RELAXED));
+}
+
+// Consumer: wait until cnt samples are available and return the oldest
+// cnt must not exceed iq_ring_read_contig(); the samples are ours, and may be
+// overwritten in place, until iq_ring_read_done()
+complex float *iq_ring_read_start(struct iq_ring *ring,int cnt){
+  assert(ring != NULL && cnt <= iq_ring_read_contig(ring));
+  unsigned int const rp = __atomic_load_n(&ring->rp,__ATOMIC_RELAXED); // We're the only writer
+  while(1){
+    unsigned int const wp = __atomic_load_n(&ring->wp,__ATOMIC_ACQUIRE);
+    if(ring_count(ring,wp,rp) >= cnt)
+      break;
+    __atomic_add_fetch(&ring->waiters,1,__ATOMIC_SEQ_CST);
+    // Recheck after announcing ourselves so we can't miss the wakeup
+    if(__atomic_load_n(&ring->wp,__ATOMIC_SEQ_CST) == wp && !ring_wait(ring,wp))
+      ring->underruns++;
+    __atomic_sub_fetch(&ring->waiters,1,__ATOMIC_SEQ_CST);
+  }
+  return ring->buf + ring_offset(ring,rp);
+}
+
+// Consumer: hand cnt samples back to the producer
+void iq_ring_read_done(struct iq_ring *ring,int cnt){
+  assert(ring != NULL);
+  unsigned int const rp = __atomic_load_n(&ring->rp,__ATOMIC_RELAXED);
+  __atomic_store_n(&ring->rp,ring_advance(ring,rp,cnt),__ATOMIC_RELEASE);
+}
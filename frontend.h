@@ -0,0 +1,64 @@
+#ifndef _FRONTEND_H
+#define _FRONTEND_H 1
+
+#include <complex.h>
+#include <pthread.h>
+
+// Sample conditioning shared by the SDR front end programs:
+// DC removal, I/Q gain and phase balance, and an optional Fs/4 frequency shift
+
+enum iq_format {
+  IQ_S8,   // Interleaved signed 8-bit integers
+  IQ_S16,  // Interleaved signed 16-bit integers, host order
+  IQ_S32,  // Interleaved signed 32-bit integers, host order
+  IQ_F32,  // Interleaved floats
+};
+
+// Corrections applied to each sample, updated by the caller between blocks
+struct iq_cond {
+  complex float DC;   // Subtracted from each scaled sample
+  float gain_i;       // Gain balance
+  float gain_q;
+  float secphi;       // Phase correction
+  float tanphi;
+  int rotate;         // Fs/4 steps per sample; 1 shifts up by Fs/4, 0 disables
+  int phase;          // Rotation of the next sample, 0-3
+};
+
+// Statistics for the caller's estimators; iq_condition() adds to them
+struct iq_stats {
+  complex float sum;  // Scaled samples before DC removal
+  float i_energy;     // After DC removal, before gain correction
+  float q_energy;
+  float dotprod;      // Sum of I*Q after gain correction, before phase correction
+  int clips;          // Samples below -1 after scaling, clamped to -1
+};
+
+void init_iq_cond(struct iq_cond *cond,int rotate);
+void iq_condition(struct iq_cond *cond,struct iq_stats *stats,complex float *output,void const *input,enum iq_format format,float scale,int cnt);
+
+// Single producer, single consumer sample ring between a USB callback and the thread that drains it
+// Neither side takes a lock. Each index is written only by its owner and published with release
+// semantics; the consumer sleeps on a futex only when the ring is short, and the producer makes
+// a system call only when the consumer is asleep
+struct iq_ring {
+  complex float *buf;
+  int size;              // Samples, any size
+  unsigned int wp;       // Write and read positions modulo 2*size, so full and empty differ
+  unsigned int rp;
+  unsigned int waiters;  // Consumer asleep on wp
+  int timeout;           // Milliseconds the consumer may wait before counting an underrun
+  unsigned long long overruns;  // Transfers dropped because the ring was full
+  unsigned long long underruns; // Consumer waits that timed out with the ring still short
+  pthread_mutex_t mutex; // Used only where futexes aren't available
+  pthread_cond_t cond;
+};
+struct iq_ring *create_iq_ring(int size,int timeout);
+void delete_iq_ring(struct iq_ring *ring);
+complex float *iq_ring_write_start(struct iq_ring *ring,int cnt,int *first);
+void iq_ring_write_done(struct iq_ring *ring,int cnt);
+int iq_ring_read_contig(struct iq_ring const *ring);
+complex float *iq_ring_read_start(struct iq_ring *ring,int cnt);
+void iq_ring_read_done(struct iq_ring *ring,int cnt);
+
+#endif
@@ -32,6 +32,7 @@
 #include "fcd.h"
 #include "sdr.h"
 #include "misc.h"
+#include "frontend.h"
 #include "status.h"
 #include "multicast.h"
 #include "dsp.h"
@@ -328,10 +329,8 @@ int main(int argc,char *argv[]){
   }
   errmsg("uid %d; device %d; dest %s; blocksize %d; RTP SSRC %lx; status file %s\n",getuid(),Device,Metadata_dest,Blocksize,Rtp.ssrc,Status_filename);
   // Gain and phase corrections. These will be updated every block
-  float gain_q = 1;
-  float gain_i = 1;
-  float secphi = 1;
-  float tanphi = 0;
+  struct iq_cond cond;
+  init_iq_cond(&cond,0);
   struct timeval tp;
   gettimeofday(&tp,NULL);
   // Timestamp is in nanoseconds for futureproofing, but time of day is only available in microsec
@@ -361,34 +360,14 @@ int main(int argc,char *argv[]){
 
     dp += Blocksize * 2 * sizeof(*sampbuf);
 
-    float i_energy=0, q_energy=0;
-    complex float samp_sum = 0;
-    float dotprod = 0;
-    
-    for(int i=0; i<2*Blocksize; i += 2){
-      complex float samp = CMPLXF(sampbuf[i],sampbuf[i+1]) * SCALE16;
-
-      samp_sum += samp; // Accumulate average DC values
-      samp -= sdr->DC;   // remove smoothed DC offset (which can be fractional)
-
-      // Must correct gain and phase before frequency shift
-      // accumulate I and Q energies before gain correction
-      i_energy += crealf(samp) * crealf(samp);
-      q_energy += cimagf(samp) * cimagf(samp);
-    
-      // Balance gains, keeping constant total energy
-      __real__ samp *= gain_i;
-      __imag__ samp *= gain_q;
-    
-      // Accumulate phase error
-      dotprod += crealf(samp) * cimagf(samp);
-
-      // Correct phase
-      __imag__ samp = secphi * cimagf(samp) - tanphi * crealf(samp);
-      
+    struct iq_stats stats;
+    memset(&stats,0,sizeof(stats));
+    complex float samps[Blocksize];
+    iq_condition(&cond,&stats,samps,sampbuf,IQ_S16,SCALE16,Blocksize);
+    for(int i=0; i<Blocksize; i++){
       // Cast is necessary since htons() is a macro!
-      sampbuf[i] = htons((signed short)round(crealf(samp) * SHRT_MAX));
-      sampbuf[i+1] = htons((signed short)round(cimagf(samp) * SHRT_MAX));
+      sampbuf[2*i] = htons((signed short)round(crealf(samps[i]) * SHRT_MAX));
+      sampbuf[2*i+1] = htons((signed short)round(cimagf(samps[i]) * SHRT_MAX));
     }
 
     if(send(Rtp_sock,buffer,dp - buffer,0) == -1){
@@ -414,17 +393,18 @@ int main(int argc,char *argv[]){
 
     // Update every block
     // estimates of DC offset, signal powers and phase error
-    sdr->DC += DC_alpha * (samp_sum - Blocksize*sdr->DC);
-    float block_energy = i_energy + q_energy; // Normalize for complex pairs
+    sdr->DC += DC_alpha * (stats.sum - Blocksize*sdr->DC);
+    cond.DC = sdr->DC;
+    float block_energy = stats.i_energy + stats.q_energy; // Normalize for complex pairs
     if(block_energy > 0){ // Avoid divisions by 0, etc
       sdr->in_power = block_energy/Blocksize; // Average A/D output power per channel  
-      sdr->imbalance += rate_factor * ((i_energy / q_energy) - sdr->imbalance);
-      float dpn = 2 * dotprod / block_energy;
+      sdr->imbalance += rate_factor * ((stats.i_energy / stats.q_energy) - sdr->imbalance);
+      float dpn = 2 * stats.dotprod / block_energy;
       sdr->sinphi += rate_factor * (dpn - sdr->sinphi);
-      gain_q = sqrtf(0.5 * (1 + sdr->imbalance));
-      gain_i = sqrtf(0.5 * (1 + 1./sdr->imbalance));
-      secphi = 1/sqrtf(1 - sdr->sinphi * sdr->sinphi); // sec(phi) = 1/cos(phi)
-      tanphi = sdr->sinphi * secphi;      // tan(phi) = sin(phi) * sec(phi) = sin(phi)/cos(phi)
+      cond.gain_q = sqrtf(0.5 * (1 + sdr->imbalance));
+      cond.gain_i = sqrtf(0.5 * (1 + 1./sdr->imbalance));
+      cond.secphi = 1/sqrtf(1 - sdr->sinphi * sdr->sinphi); // sec(phi) = 1/cos(phi)
+      cond.tanphi = sdr->sinphi * cond.secphi;      // tan(phi) = sin(phi) * sec(phi) = sin(phi)/cos(phi)
     }
   }
   // Can't really get here
@@ -61,6 +61,7 @@ struct session {
 int Quiet;
 int Mcast_ttl = 0; // We don't transmit
 double Duration = INFINITY;
+int Rcvbuf_size = 1 << 20; // 1 MB
 char IQ_mcast_address_text[256];
 
 struct sockaddr Sender;
@@ -91,7 +92,7 @@ int main(int argc,char *argv[]){
   // Defaults
   Quiet = 0;
   int c;
-  while((c = getopt(argc,argv,"I:l:qd:")) != EOF){
+  while((c = getopt(argc,argv,"I:U:l:qd:")) != EOF){
     switch(c){
     case 'I':
       strlcpy(IQ_mcast_address_text,optarg,sizeof(IQ_mcast_address_text));
@@ -105,8 +106,11 @@ int main(int argc,char *argv[]){
     case 'd':
       Duration = strtod(optarg,NULL);
       break;
+    case 'U':
+      Rcvbuf_size = strtol(optarg,NULL,0);
+      break;
     default:
-      fprintf(stderr,"Usage: %s -I iq multicast address [-l locale] [-q]\n",argv[0]);
+      fprintf(stderr,"Usage: %s -I iq multicast address [-l locale] [-q] [-U rcvbuf]\n",argv[0]);
       exit(1);
       break;
     }
@@ -123,9 +127,8 @@ int main(int argc,char *argv[]){
     fprintf(stderr,"Can't set up I/Q input\n");
     exit(1);
   }
-  int n = 1 << 20; // 1 MB
-  if(setsockopt(Input_fd,SOL_SOCKET,SO_RCVBUF,&n,sizeof(n)) == -1)
-    perror("setsockopt");
+  if(Rcvbuf_size > 0)
+    set_rcvbuf(Input_fd,Rcvbuf_size);
 
   // Graceful signal catch
   signal(SIGPIPE,closedown);
@@ -156,16 +159,24 @@ void input_loop(){
 
   double t = 0;
 
+  // Kernel receive timestamps give each file an accurate start time
+  struct pktring * const ring = pktring_create(Input_fd,PKTRING_SLOTS,MAXPKT,1);
+  if(ring == NULL){
+    fprintf(stderr,"Can't allocate input buffers\n");
+    exit(1);
+  }
   while(!isfinite(Duration) || t < Duration){
     // Receive I/Q data from front end
-    unsigned char buffer[MAXPKT];
-    socklen_t socksize = sizeof(Sender);
-    int size = recvfrom(Input_fd,buffer,sizeof(buffer),0,&Sender,&socksize);
+    unsigned char *buffer;
+    struct sockaddr_storage *ssp;
+    struct timespec *when;
+    int size = pktring_recv(ring,&buffer,&ssp,&when);
     if(size <= 0){    // ??
-      perror("recvfrom");
+      perror("recvmmsg");
       usleep(50000);
       continue;
     }
+    memcpy(&Sender,ssp,sizeof(Sender));
     if(size < RTP_MIN_SIZE)
       continue; // Too small for RTP, ignore
 
@@ -286,9 +297,13 @@ void input_loop(){
       attrprintf(fd,"source","%s",sender_text);
       attrprintf(fd,"multicast","%s",IQ_mcast_address_text);
       
-      struct timeval tv;
-      gettimeofday(&tv,NULL);
-      attrprintf(fd,"unixstarttime","%ld.%06ld",(long)tv.tv_sec,(long)tv.tv_usec);
+      if(when->tv_sec != 0){
+	attrprintf(fd,"unixstarttime","%ld.%09ld",(long)when->tv_sec,(long)when->tv_nsec);
+      } else {
+	struct timeval tv;
+	gettimeofday(&tv,NULL);
+	attrprintf(fd,"unixstarttime","%ld.%06ld",(long)tv.tv_sec,(long)tv.tv_usec);
+      }
     }
     int sample_count = size / (sizeof(*samples) * sp->channels);
     off_t offset = rtp_process(&sp->rtp_state,&rtp,sample_count);
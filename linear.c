@@ -11,6 +11,9 @@
 #include <fftw3.h>
 #include <pthread.h>
 #include <string.h>
+#if defined(__AVX2__) && defined(__FMA__)
+#include <immintrin.h>
+#endif
 
 #include "misc.h"
 #include "dsp.h"
@@ -18,6 +21,148 @@
 #include "radio.h"
 
 
+// AGC
+// Lots of people seem to have strong opinions how AGCs should work
+// so there's probably a lot of work to do here
+// The attack_factor feature doesn't seem to work well; if it's at all
+// slow you get an annoying "pumping" effect.
+// But if it's too fast, brief spikes can deafen you for some time
+// What to do?
+
+// The gain is decided once per sub-block from its peak, so the per-sample
+// loops that apply it don't serialize on agc.gain and vectorize cleanly
+#define AGC_BLOCK 32
+
+struct agc_state {
+  int hangcount;
+  float rate;             // recovery_rate the ramp was built for
+  float ramp[AGC_BLOCK+1]; // rate^k
+};
+
+// Peak power of n complex samples
+static float peak_power_c(complex float const * const x,int const n){
+  int i = 0;
+  float peak = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 vpeak = _mm256_setzero_ps();
+  for(; i + 4 <= n; i += 4){
+    __m256 const v = _mm256_loadu_ps((float const *)(x + i));
+    __m256 const sq = _mm256_mul_ps(v,v);
+    vpeak = _mm256_max_ps(vpeak,_mm256_add_ps(sq,_mm256_permute_ps(sq,0xb1))); // |s|^2 in both halves of each pair
+  }
+  __m128 p = _mm_max_ps(_mm256_castps256_ps128(vpeak),_mm256_extractf128_ps(vpeak,1));
+  p = _mm_max_ps(p,_mm_movehl_ps(p,p));
+  peak = _mm_cvtss_f32(p);
+#endif
+  for(; i < n; i++)
+    peak = max(peak,cnrmf(x[i]));
+  return peak;
+}
+// Peak power of n real samples
+static float peak_power_r(float const * const x,int const n){
+  int i = 0;
+  float peak = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 vpeak = _mm256_setzero_ps();
+  for(; i + 8 <= n; i += 8){
+    __m256 const v = _mm256_loadu_ps(x + i);
+    vpeak = _mm256_max_ps(vpeak,_mm256_mul_ps(v,v));
+  }
+  __m128 p = _mm_max_ps(_mm256_castps256_ps128(vpeak),_mm256_extractf128_ps(vpeak,1));
+  p = _mm_max_ps(p,_mm_movehl_ps(p,p));
+  p = _mm_max_ss(p,_mm_shuffle_ps(p,p,1));
+  peak = _mm_cvtss_f32(p);
+#endif
+  for(; i < n; i++)
+    peak = max(peak,x[i] * x[i]);
+  return peak;
+}
+
+// Fill gain[0..n-1] for one sub-block whose peak amplitude is 'peak'
+// Attack puts the peak at the headroom and restarts the hang timer;
+// the gain then holds until the hang runs out and recovers by recovery_rate per sample,
+// but never so far that this sub-block's peak would exceed the headroom
+static void agc_gains(struct demod * const demod,struct agc_state * const agc,float * const gain,float const peak,int const n){
+  float g = demod->agc.gain;
+  if(!demod->opt.agc){
+    for(int i=0; i < n; i++)
+      gain[i] = g;
+    return;
+  }
+  float const headroom = demod->agc.headroom;
+  if(isnan(g) || peak * g > headroom){
+    if(peak > 0){
+      g = headroom / peak; // Startup, or attack
+      agc->hangcount = demod->agc.hangtime;
+    }
+    for(int i=0; i < n; i++)
+      gain[i] = g;
+  } else {
+    int const hold = min(n,agc->hangcount);
+    for(int i=0; i < hold; i++)
+      gain[i] = g;
+    agc->hangcount -= hold;
+    if(hold < n){
+      if(agc->rate != demod->agc.recovery_rate){
+	agc->rate = demod->agc.recovery_rate;
+	agc->ramp[0] = 1;
+	for(int k=1; k <= AGC_BLOCK; k++)
+	  agc->ramp[k] = agc->ramp[k-1] * agc->rate;
+      }
+      float const limit = peak > 0 ? headroom / peak : INFINITY;
+      float const * const ramp = agc->ramp + 1 - hold;
+      for(int i=hold; i < n; i++){
+	float const r = g * ramp[i];
+	gain[i] = r < limit ? r : limit;
+      }
+      g = gain[n-1];
+    }
+  }
+  demod->agc.gain = g;
+}
+
+// ISB sidebands are split only after fine tuning, so they split at the carrier itself.
+// A CROSS_CONJ filter output would split them at the nearest FFT bin, before the residual
+// could be applied. A second COMPLEX output of the same block passes just the upper sideband;
+// the lower is what's left of the full passband
+struct isb_state {
+  struct filter_out *upper;
+  float low,high,beta; // Edges (relative to the output sample rate) and window 'upper' has
+};
+
+// Upper sideband filter for the current edges, or NULL if the passband has none
+static struct filter_out *isb_upper(struct demod * const demod,struct isb_state * const isb){
+  float const low = max(0.0f,demod->filter.low) / demod->output.samprate;
+  float const high = max(0.0f,demod->filter.high) / demod->output.samprate;
+  if(high <= low)
+    return NULL;
+  if(isb->upper == NULL){
+    isb->upper = create_filter_output(demod->filter.in,NULL,demod->filter.decimate,COMPLEX);
+    isb->low = isb->high = NAN;
+  }
+  if(low != isb->low || high != isb->high || demod->filter.kaiser_beta != isb->beta){
+    set_filter(isb->upper,low,high,demod->filter.kaiser_beta);
+    isb->low = low;
+    isb->high = high;
+    isb->beta = demod->filter.kaiser_beta;
+  }
+  return isb->upper;
+}
+
+// Fine tune both sidebands of z[] (u[] holds just the upper, or is NULL) by 'freq' Hz,
+// then put LSB on I and USB on Q, scaled as CROSS_CONJ output would be
+static void isb_split(struct demod * const demod,complex float * const z,complex float const * const u,int const n,double const freq){
+  complex float tune[n];
+  for(int i=0; i < n; i++)
+    tune[i] = 1;
+  fine_tune(demod,tune,n,freq); // Same phasors for both sidebands
+  for(int i=0; i < n; i++){
+    complex float const upper = u != NULL ? u[i] * tune[i] : 0;
+    complex float const lower = z[i] * tune[i] - upper;
+    z[i] = CMPLXF(2 * crealf(lower),2 * cimagf(upper));
+  }
+}
+
 void *demod_linear(void *arg){
   pthread_setname("linear");
   assert(arg != NULL);
@@ -26,7 +171,7 @@ void *demod_linear(void *arg){
   demod->opt.loop_bw = 5; // eventually to be set from mode table
 
   // AGC
-  int hangcount = 0;
+  struct agc_state agc = { .hangcount = 0, .rate = NAN };
 
   // Coherent mode parameters
   float const snrthresh = 2;     // Loop lock threshold at +3 dB SNR
@@ -45,16 +190,58 @@ void *demod_linear(void *arg){
 
   // Detection filter
   struct filter_out * const filter = demod->filter.out;
+  struct isb_state isb = { .upper = NULL };
 
   while(1){
     // Are we active?
     pthread_mutex_lock(&demod->demod_mutex);
-    while(demod->demod_type != LINEAR_DEMOD)
+    while(demod->demod_type != LINEAR_DEMOD && !demod->terminate)
       pthread_cond_wait(&demod->demod_cond,&demod->demod_mutex);
     pthread_mutex_unlock(&demod->demod_mutex);
+    if(demod->terminate)
+      break; // Channel deleted
+
+    // Use the cheapest filter output for the current mode
+    struct tuning const tuning = get_tuning(demod);
+    set_filter_type(filter,output_type(LINEAR_DEMOD,demod->output.channels,demod->filter.isb,demod->opt.pll,demod->opt.env,tuning.real_exact));
+
+    if(filter->out_type == REAL){
+      // Mono with no PLL or envelope detector: just I, from the c2r IFFT
+      // Tuning and the post-detection shift are both done by rotating the spectrum
+      execute_filter_output(filter,tuning.real_rotate);
+      float energy = 0;
+      float output_level = 0;
+      float gain[AGC_BLOCK];
+      for(int b=0; b < filter->olen; b += AGC_BLOCK){
+	float * const r = filter->output.r + b;
+	int const n = min(AGC_BLOCK,(int)filter->olen - b);
+	agc_gains(demod,&agc,gain,sqrtf(peak_power_r(r,n)),n);
+	for(int i=0; i < n; i++){
+	  energy += r[i] * r[i];
+	  r[i] *= gain[i];
+	  output_level += r[i] * r[i];
+	}
+      }
+      demod->output.level = output_level / filter->olen;
+      send_mono_output(demod,filter->output.r,filter->olen);
+      demod->sig.bb_power = energy / filter->olen;
+      continue;
+    }
 
     // Wait for new samples
-    execute_filter_output(filter,0);
+    execute_filter_output(filter,tuning.rotate);
+    // Without a PLL in between, the post-detection shift can share the tuning mixer
+    // ISB applies it after the split, to I and Q
+    bool const own_shift = demod->opt.pll || demod->filter.isb;
+    if(demod->filter.isb){
+      struct filter_out * const upper = isb_upper(demod,&isb);
+      if(upper != NULL){
+	upper->blocknum = filter->blocknum - 1; // Same block as the full passband
+	execute_filter_output(upper,tuning.rotate);
+      }
+      isb_split(demod,filter->output.c,upper != NULL ? upper->output.c : NULL,filter->olen,tuning.residual);
+    } else
+      fine_tune(demod,filter->output.c,filter->olen,tuning.residual + (own_shift ? 0 : demod->tune.shift));
 
     
     if(demod->opt.pll){
@@ -76,30 +263,20 @@ void *demod_linear(void *arg){
       }
       demod->sig.lock_timer = lock_count;
       
+      // Derotate by the VCO, tracking the carrier (or, squared, a suppressed carrier)
+      run_pll_block(&pll,filter->output.c,filter->olen,demod->opt.square);
       float signal = 0;
       float noise = 0;
       for(int n=0;n<filter->olen;n++){
-	complex float s = filter->output.c[n];
-	s *= conjf(pll.vco.phasor);
-	float phase;
-	if(demod->opt.square){
-	  phase = cargf(s*s);
-	} else {
-	  phase = cargf(s);
-	}
-	run_pll(&pll,phase);
-	filter->output.c[n] = s;
-	
-	float rp = crealf(s) * crealf(s);
-	float ip = cimagf(s) * cimagf(s);
-	signal += rp;
-	noise += ip;
+	complex float const s = filter->output.c[n];
+	signal += crealf(s) * crealf(s);
+	noise += cimagf(s) * cimagf(s);
       }
-      demod->sig.cphase = carg(pll.vco.phasor);
+      demod->sig.cphase = pll_phase(&pll);
       if(demod->opt.square)
 	demod->sig.cphase /= 2; // Squaring doubles the phase
 
-      demod->sig.foffset = pll.vco.freq * demod->output.samprate;
+      demod->sig.foffset = pll.freq * demod->output.samprate;
       if(noise != 0){
 	demod->sig.snr = (signal / noise) - 1; // S/N as power ratio; meaningful only in coherent modes
 	if(demod->sig.snr < 0)
@@ -111,39 +288,33 @@ void *demod_linear(void *arg){
     float samples[filter->olen]; // for mono output
     float energy = 0;
     float output_level = 0;
-    for(int n=0; n<filter->olen; n++){
-      complex float s = filter->output.c[n] * step_osc(&demod->shift);
-      float norm = cnrmf(s);
-      energy += norm;
-      float amplitude = sqrtf(norm);
-      
-      // AGC
-      // Lots of people seem to have strong opinions how AGCs should work
-      // so there's probably a lot of work to do here
-      // The attack_factor feature doesn't seem to work well; if it's at all
-      // slow you get an annoying "pumping" effect.
-      // But if it's too fast, brief spikes can deafen you for some time
-      // What to do?
-      if(demod->opt.agc){
-	if(isnan(demod->agc.gain) || amplitude * demod->agc.gain > demod->agc.headroom){
-	  demod->agc.gain = demod->agc.headroom / amplitude; // Startup
-	  hangcount = demod->agc.hangtime;
-	} else if(hangcount > 0){
-	  hangcount--;
-	} else {
-	  demod->agc.gain *= demod->agc.recovery_rate;
-	}
-      }
+    if(own_shift)
+      mix_osc(&demod->shift,filter->output.c,filter->olen);
+    float gain[AGC_BLOCK];
+    for(int b=0; b < filter->olen; b += AGC_BLOCK){
+      complex float * const s = filter->output.c + b;
+      int const n = min(AGC_BLOCK,(int)filter->olen - b);
+      agc_gains(demod,&agc,gain,sqrtf(peak_power_c(s,n)),n);
       if(demod->opt.env){
 	// AM envelope detection -- should re-add DC removal
-	samples[n] = amplitude * demod->agc.gain;
-	output_level += samples[n] * samples[n];
+	for(int i=0; i < n; i++){
+	  float const norm = cnrmf(s[i]);
+	  energy += norm;
+	  samples[b+i] = sqrtf(norm) * gain[i];
+	  output_level += samples[b+i] * samples[b+i];
+	}
       } else if(demod->output.channels == 1) {
-	samples[n] = crealf(s) * demod->agc.gain;
-	output_level += samples[n] * samples[n];
+	for(int i=0; i < n; i++){
+	  energy += cnrmf(s[i]);
+	  samples[b+i] = crealf(s[i]) * gain[i];
+	  output_level += samples[b+i] * samples[b+i];
+	}
       } else {
-	filter->output.c[n] = s * demod->agc.gain;
-	output_level += cnrmf(filter->output.c[n]);
+	for(int i=0; i < n; i++){
+	  energy += cnrmf(s[i]);
+	  s[i] *= gain[i];
+	  output_level += cnrmf(s[i]);
+	}
       }
     }
     demod->output.level = output_level / (filter->olen * demod->output.channels);
@@ -155,4 +326,6 @@ void *demod_linear(void *arg){
     // Total baseband power (I+Q), scaled to each sample
     demod->sig.bb_power = energy / filter->olen;
   }
+  delete_filter_output(isb.upper);
+  return NULL;
 }
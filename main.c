@@ -40,6 +40,10 @@ static int Nthreads = 1;
 static char const *Locale = "en_US.UTF-8";
 int Mcast_ttl = 1;
 static float Blocktime = 20; // 20 milliseconds
+static int Rcvbuf_size = 0;  // I/Q input socket buffer; 0 = system default
+static char const *Fbus_out; // Publish our forward FFTs on this shared memory bus
+static char const *Fbus_in;  // Take forward FFTs from another radio's bus instead of doing our own
+int Max_channels = 1; // More than 1 enables creation of channels through the control channel
 
 // Primary control blocks for downconvert/filter/demodulate and output
 // Note: initialized to all zeroes, like all global variables
@@ -62,6 +66,7 @@ static struct option Options[] =
    {"fft-size", required_argument, NULL, 'N'},
    {"status-out", required_argument, NULL, 'R'},
    {"ssrc", required_argument, NULL, 'S'},
+   {"max-channels", required_argument, NULL, 'M'},
    {"ttl", required_argument, NULL, 'T'},
    {"agc-recover", required_argument, NULL, 'a'},
    {"block-time", required_argument, NULL, 'b'},
@@ -78,10 +83,19 @@ static struct option Options[] =
    {"headroom", required_argument, NULL, 'r'},
    {"shift", required_argument, NULL, 's'},
    {"fft-threads", required_argument, NULL, 't'},
+   {"wisdom-file", required_argument, NULL, 'W'},
+   {"rcvbuf", required_argument, NULL, 'U'},
+   {"reorder", required_argument, NULL, 'j'},
+   {"fbus-in", required_argument, NULL, 'B'},
+   {"fbus-out", required_argument, NULL, 'O'},
+   {"pipeline", required_argument, NULL, 'P'},
+   {"cpus", required_argument, NULL, 'C'},
+   {"samprate", required_argument, NULL, 'o'},
+   {"encoding", required_argument, NULL, 'E'},
    {NULL, 0, NULL, 0},
   };
 
-static char Optstring[] = "A:D:FI:N:R:S:T:a:b:c:e:f:h:ik:l:m:pqr:s:t:";
+static char Optstring[] = "A:B:C:D:E:FI:M:N:O:P:R:S:T:U:W:a:b:c:e:f:h:ij:k:l:m:o:pqr:s:t:";
 
 
 // The main program sets up the demodulator parameter defaults,
@@ -129,7 +143,8 @@ int main(int argc,char *argv[]){
   struct demod * const demod = &Demod; // Only one demodulator per program for now
   memset(demod,0,sizeof(*demod)); // Just in case it's ever dynamic
 
-  demod->output.samprate = DAC_samprate; // currently 48 kHz, hard to change
+  demod->output.samprate = DAC_samprate; // 8, 12, 16, 24 or 48 kHz with --samprate
+  demod->output.encoding = S16BE;
   demod->filter.interpolate = 1;
   // Set receiver defaults, can be overridden by command line args
   demod->filter.kaiser_beta = 3.0; // Reasonable compromise
@@ -137,11 +152,13 @@ int main(int argc,char *argv[]){
   demod->demod_type = 1; // FM
   demod->opt.agc = 1; // AGC is on by default
   demod->agc.gain = dB2voltage(80.); // Empirical starting point
-  demod->agc.recovery_rate = powf(10.,6/20./demod->output.samprate);
   demod->output.channels = 1;
   demod->tune.freq = 147.435e6;  // LA "animal house" repeater, active all night for testing
   demod->filter.high = 8000;
   demod->filter.low = -8000;
+  demod->input.reorder_window = 3; // Packets; enough for the usual out-of-order delivery on a LAN
+  demod->input.pipeline = 4;       // Blocks between receive/convert and FFT threads
+  demod->input.input_cpu = demod->input.fft_cpu = -1;
   demod->output.rtp.ssrc = Starttime.tv_sec & 0xffffffff;
   demod->output.status_fd = demod->output.ctl_fd = demod->output.data_fd = demod->output.rtcp_fd = -1;
 
@@ -149,11 +166,13 @@ int main(int argc,char *argv[]){
   pthread_cond_init(&demod->sdr.status_cond,NULL);
   pthread_mutex_init(&demod->doppler.mutex,NULL);
   pthread_mutex_init(&demod->shift.mutex,NULL);
-  pthread_mutex_init(&demod->second_LO.mutex,NULL);
+  pthread_mutex_init(&demod->fine.mutex,NULL);
   pthread_mutex_init(&demod->demod_mutex,NULL);
   pthread_cond_init(&demod->demod_cond,NULL);
 
   demod->input.status_fd = -1;
+  demod->output.state = calloc(256,sizeof(struct state));
+  Channels = demod;
   
   // First pass over options to pick up I/O sockets
   // -T must be specified ahead of output argument it modifies
@@ -205,10 +224,37 @@ int main(int argc,char *argv[]){
     case 'T': // TTL on output packets
       Mcast_ttl = strtol(optarg,NULL,0);
       break;
+    case 'U': // Socket receive buffer for I/Q input, bytes
+      Rcvbuf_size = strtol(optarg,NULL,0);
+      break;
+    case 'B': // Frequency domain bus to attach to
+      Fbus_in = optarg;
+      break;
+    case 'O': // Frequency domain bus to publish
+      Fbus_out = optarg;
+      break;
+    case 'o': // Output sample rate; needed before the SDR status sets the decimation ratio
+      demod->output.samprate = strtol(optarg,NULL,0);
+      break;
+    case 'E': // Output encoding
+      if(strcasecmp(optarg,"s16") == 0 || strcasecmp(optarg,"s16be") == 0)
+	demod->output.encoding = S16BE;
+      else if(strcasecmp(optarg,"float") == 0 || strcasecmp(optarg,"f32") == 0 || strcasecmp(optarg,"f32be") == 0)
+	demod->output.encoding = F32BE;
+      else {
+	fprintf(stderr,"Unknown encoding %s; use s16 or f32\n",optarg);
+	exit(1);
+      }
+      break;
     default: // Ignore others for now
       break;
     }
   }
+  if(pt_from_info(demod->output.samprate,1,demod->output.encoding) < 0){
+    fprintf(stderr,"Unsupported output sample rate %'d Hz; use 8000, 12000, 16000, 24000 or 48000\n",demod->output.samprate);
+    exit(1);
+  }
+  demod->agc.recovery_rate = powf(10.,6/20./demod->output.samprate);
   if(demod->input.status_fd == -1){
     fprintf(stderr,"No valid SDR metadata address given with -I\n");
     exit(1);
@@ -230,13 +276,26 @@ int main(int argc,char *argv[]){
     pthread_cond_wait(&demod->sdr.status_cond,&demod->sdr.status_mutex);
   pthread_mutex_unlock(&demod->sdr.status_mutex);
   fprintf(stderr,"%'d Hz\n",demod->input.samprate);
+  if(demod->input.samprate % demod->output.samprate != 0){
+    fprintf(stderr,"Input sample rate %'d Hz is not a multiple of the output sample rate %'d Hz\n",
+	    demod->input.samprate,demod->output.samprate);
+    exit(1);
+  }
 
-  // Input socket for I/Q data from SDR, set from OUTPUT_DEST_SOCKET in SDR metadata
-  demod->input.data_fd = setup_mcast(NULL,(struct sockaddr *)&demod->input.data_dest_address,0,0,0);
-  if(demod->input.data_fd == -1){
-    fprintf(stderr,"Can't set up I/Q input\n");
+  if(Fbus_in != NULL && Fbus_out != NULL){
+    fprintf(stderr,"--fbus-in and --fbus-out are mutually exclusive\n");
     exit(1);
   }
+  if(Fbus_in == NULL){
+    // Input socket for I/Q data from SDR, set from OUTPUT_DEST_SOCKET in SDR metadata
+    demod->input.data_fd = setup_mcast(NULL,(struct sockaddr *)&demod->input.data_dest_address,0,0,0);
+    if(demod->input.data_fd == -1){
+      fprintf(stderr,"Can't set up I/Q input\n");
+      exit(1);
+    }
+    if(Rcvbuf_size > 0)
+      set_rcvbuf(demod->input.data_fd,Rcvbuf_size);
+  }
 
   // Go back and re-read rest of args
   optind = 1;
@@ -266,6 +325,20 @@ int main(int argc,char *argv[]){
     case 'i':
       demod->filter.isb = 1;
       break;
+    case 'j': // I/Q input reorder window, packets
+      demod->input.reorder_window = max(0,(int)strtol(optarg,NULL,0));
+      break;
+    case 'P': // Blocks queued between the input and FFT threads; 0 = don't split them
+      demod->input.pipeline = max(0,(int)strtol(optarg,NULL,0));
+      break;
+    case 'C': // Cores for the input and FFT threads: input[,fft]
+      {
+	char *ep;
+	demod->input.input_cpu = strtol(optarg,&ep,0);
+	if(*ep == ',')
+	  demod->input.fft_cpu = strtol(ep+1,NULL,0);
+      }
+      break;
     case 'k':   // Kaiser window shape parameter; 0 = rectangular
       demod->filter.kaiser_beta = strtof(optarg,NULL);
       break;
@@ -297,11 +370,17 @@ int main(int argc,char *argv[]){
     case 'H':
       demod->agc.hangtime = strtod(optarg,NULL) * demod->output.samprate;
       break;
-    case 'A': case 'I': case 'R': case 'D': case 'S': case 'T':
+    case 'A': case 'I': case 'R': case 'D': case 'S': case 'T': case 'U': case 'B': case 'O': case 'o': case 'E':
       break;
     case 'N':
       N = strtol(optarg,NULL,0);
       break;
+    case 'M':
+      Max_channels = strtol(optarg,NULL,0);
+      break;
+    case 'W':   // Where to load and save FFTW wisdom (plans)
+      Wisdom_file = optarg;
+      break;
     default:
       fprintf(stderr,"option %c unknown\n",c);
       break;
@@ -323,24 +402,72 @@ int main(int argc,char *argv[]){
   // L = data block size
   // M = filter impulse response duration
   // N = FFT size = L + M - 1
-  demod->filter.L = demod->input.samprate * Blocktime / 1000; // Blocktime is in milliseconds
-  // Make FIR order equal to blocksize
-  if(N <= 0)
-    N = nextfastfft(2*demod->filter.L - 1); // Factors of 2, 5 and 7
-  demod->filter.M = N - demod->filter.L + 1;
-
-  demod->filter.in = create_filter_input(demod->filter.L,demod->filter.M,COMPLEX);
-  // experimental forward filter that puts frequency domain data in filesystem
-  //  demod->filter.in = create_filter_input_file(demod->filter.L,demod->filter.M,COMPLEX,"/run/user/1000/filter");
-  demod->filter.out = create_filter_output(demod->filter.in,NULL,demod->filter.decimate,demod->filter.isb ? CROSS_CONJ : COMPLEX);
+  if(Fbus_in != NULL){
+    // Another radio process does the forward FFTs; its block sizes are ours
+    demod->filter.in = attach_filter_input(Fbus_in);
+    if(demod->filter.in == NULL){
+      fprintf(stderr,"Can't attach to frequency domain bus %s: %s\n",Fbus_in,strerror(errno));
+      exit(1);
+    }
+    demod->filter.L = demod->filter.in->ilen;
+    demod->filter.M = demod->filter.in->impulse_length;
+  } else {
+    demod->filter.L = demod->input.samprate * Blocktime / 1000; // Blocktime is in milliseconds
+    // Make FIR order equal to blocksize
+    if(N <= 0){
+      N = nextfastfft(2*demod->filter.L - 1); // Factors of 2, 5 and 7
+      // The output IFFT is N/decimate points, so lower output rates need more factors of the ratio
+      while(N != 0 && demod->filter.decimate > 1 && N % demod->filter.decimate != 0)
+	N = nextfastfft(N);
+      if(N == 0){
+	// nextfastfft() ran out: the ratio has a prime factor above 7
+	fprintf(stderr,"No FFT size for decimation ratio %d (%'d Hz in, %'d Hz out)\n",
+		demod->filter.decimate,demod->input.samprate,demod->output.samprate);
+	exit(1);
+      }
+    }
+    demod->filter.M = N - demod->filter.L + 1;
+
+    if(Fbus_out != NULL)
+      demod->filter.in = create_filter_input_bus(demod->filter.L,demod->filter.M,COMPLEX,Fbus_out,FBUS_SLOTS);
+    else
+      demod->filter.in = create_filter_input(demod->filter.L,demod->filter.M,COMPLEX);
+    if(demod->filter.in == NULL){
+      fprintf(stderr,"Can't create filter input\n");
+      exit(1);
+    }
+  }
+  demod->filter.out = create_filter_output(demod->filter.in,NULL,demod->filter.decimate,
+					   output_type(demod->demod_type,demod->output.channels,demod->filter.isb,demod->opt.pll,demod->opt.env,demod->tuning.real_exact));
+  limit_filter_edges(demod);
   set_filter(demod->filter.out,
 	     demod->filter.low/demod->output.samprate,
 	     demod->filter.high/demod->output.samprate,
 	     demod->filter.kaiser_beta);
 
-  // Start processing I/Q data stream
-  pthread_t proc_samples_thread;
-  pthread_create(&proc_samples_thread,NULL,proc_samples,demod);
+  // Design the filters for every mode now so switching modes later is just a pointer swap
+  for(int i = 0; i < Nmodes; i++){
+    struct modetab const * const mp = &Modes[i];
+    // Edges past Nyquist are held to it when the mode is selected (limit_filter_edges()), so design it that way
+    float const low = max(-0.5f,min(0.5f,min(mp->low,mp->high) / demod->output.samprate));
+    float const high = max(-0.5f,min(0.5f,max(mp->low,mp->high) / demod->output.samprate));
+    // A mode that can use REAL output falls back to COMPLEX when not tuned near a bin
+    enum filtertype const type = output_type(mp->demod_type,mp->channels,mp->isb,mp->pll,mp->env,true);
+    preload_filter(demod->filter.out,low,high,demod->filter.kaiser_beta,type);
+    if(type == REAL)
+      preload_filter(demod->filter.out,low,high,demod->filter.kaiser_beta,COMPLEX);
+    if(mp->isb && high > max(0.0f,low))
+      preload_filter(demod->filter.out,max(0.0f,low),high,demod->filter.kaiser_beta,COMPLEX); // Upper sideband alone
+  }
+
+  // Start processing I/Q data stream, unless someone else is doing it for us
+  if(Fbus_in == NULL){
+    pthread_t proc_samples_thread;
+    pthread_create(&proc_samples_thread,NULL,proc_samples,demod);
+  }
+  // Estimate the noise floor for every channel from the same spectra
+  pthread_t noise_thread;
+  pthread_create(&noise_thread,NULL,estimate_noise,demod);
 
   // Graceful signal catch
   signal(SIGPIPE,closedown);
@@ -353,10 +480,7 @@ int main(int argc,char *argv[]){
   set_shift(demod,demod->tune.shift);
   set_freq(demod,demod->tune.freq,NAN);
   // Start demodulators
-  pthread_t fm_demod_thread,linear_demod_thread;
-
-  pthread_create(&fm_demod_thread,NULL,demod_fm,demod);  
-  pthread_create(&linear_demod_thread,NULL,demod_linear,demod);
+  start_demod(demod);
 
   while(1){
     usleep(1000000); // probably get rid of this
@@ -393,7 +517,7 @@ void *rtcp_send(void *arg){
 
     sr.ntp_timestamp = now_time;
     // The zero is to remind me that I start timestamps at zero, but they could start anywhere
-    sr.rtp_timestamp = 0 + runtime * 48000;
+    sr.rtp_timestamp = 0 + runtime * demod->output.samprate;
     sr.packet_count = demod->output.rtp.seq;
     sr.byte_count = demod->output.rtp.bytes;
     
@@ -438,6 +562,10 @@ void *rtcp_send(void *arg){
 }
 static void closedown(int a){
   fprintf(stderr,"Received signal %d, exiting\n",a);
+  // Don't leave our frequency domain bus behind for consumers to attach to
+  struct filter_in const * const master = Demod.filter.in;
+  if(master != NULL && master->shared && !master->attached && master->path != NULL)
+    unlink(master->path);
   if(a == SIGTERM)
     exit(0); // Return success when terminated by systemd
   else
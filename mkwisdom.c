@@ -0,0 +1,118 @@
+// $Id$
+// Precompute FFTW plans for the filter sizes 'radio' will use and save them as wisdom,
+// so the receiver doesn't have to measure them (or fall back to estimated plans) at startup
+// Copyright 2026 agent
+
+#define _GNU_SOURCE 1
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <getopt.h>
+#include <complex.h>
+#undef I
+#include <fftw3.h>
+
+#include "misc.h"
+#include "filter.h"
+
+static float Blocktime = 20;     // milliseconds, as in radio
+static int Out_samprate = 48000; // Hz, as in radio
+static int Nthreads = 1;
+
+static struct option Options[] =
+  {
+   {"blocktime", required_argument, NULL, 'b'},
+   {"fft-size", required_argument, NULL, 'N'},
+   {"level", required_argument, NULL, 'l'},
+   {"output-samprate", required_argument, NULL, 'o'},
+   {"fft-threads", required_argument, NULL, 't'},
+   {"wisdom-file", required_argument, NULL, 'W'},
+   {NULL, 0, NULL, 0},
+  };
+static char Optstring[] = "N:W:b:l:o:t:";
+
+static void usage(char const *name){
+  fprintf(stderr,"Usage: %s [-b blocktime_ms] [-N fft_size] [-l estimate|measure|patient|exhaustive] [-o output_samprate] [-t fft_threads] [-W wisdom_file] samprate [samprate...]\n",name);
+  exit(1);
+}
+
+int main(int argc,char *argv[]){
+  int N = -1;
+  int c;
+  while((c = getopt_long(argc,argv,Optstring,Options,NULL)) != -1){
+    switch(c){
+    case 'b':
+      Blocktime = strtof(optarg,NULL);
+      break;
+    case 'N':
+      N = strtol(optarg,NULL,0);
+      break;
+    case 'l':
+      if(strcasecmp(optarg,"estimate") == 0)
+	FFTW_planning_level = FFTW_ESTIMATE;
+      else if(strcasecmp(optarg,"measure") == 0)
+	FFTW_planning_level = FFTW_MEASURE;
+      else if(strcasecmp(optarg,"patient") == 0)
+	FFTW_planning_level = FFTW_PATIENT;
+      else if(strcasecmp(optarg,"exhaustive") == 0)
+	FFTW_planning_level = FFTW_EXHAUSTIVE;
+      else
+	usage(argv[0]);
+      break;
+    case 'o':
+      Out_samprate = strtol(optarg,NULL,0);
+      break;
+    case 't':
+      Nthreads = strtol(optarg,NULL,0);
+      break;
+    case 'W':
+      Wisdom_file = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      break;
+    }
+  }
+  if(optind >= argc || Out_samprate <= 0)
+    usage(argv[0]);
+
+  fftwf_init_threads();
+  fftwf_make_planner_thread_safe();
+  fftwf_plan_with_nthreads(Nthreads);
+
+  for(int i = optind; i < argc; i++){
+    int const samprate = strtol(argv[i],NULL,0);
+    if(samprate <= 0 || samprate % Out_samprate != 0){
+      fprintf(stderr,"%s: sample rate must be a multiple of %d Hz\n",argv[i],Out_samprate);
+      continue;
+    }
+    // Same sizing as radio's main()
+    int const L = samprate * Blocktime / 1000;
+    int const n = N > 0 ? N : nextfastfft(2*L - 1);
+    int const M = n - L + 1;
+    int const decimate = samprate / Out_samprate;
+    if(n % decimate != 0){
+      fprintf(stderr,"%s: FFT size %d not divisible by decimation ratio %d\n",argv[i],n,decimate);
+      continue;
+    }
+    fprintf(stderr,"samprate %d: L = %d, M = %d, N = %d, N/decimate = %d\n",samprate,L,M,n,n/decimate);
+
+    // Creating the filters plans everything radio will ask for, including the
+    // kaiser window transforms in set_filter(); the plan cache saves the wisdom
+    struct filter_in * const in = create_filter_input(L,M,COMPLEX);
+    struct filter_out * const cout = create_filter_output(in,NULL,decimate,COMPLEX);
+    set_filter(cout,-0.1,0.1,3.0);
+    struct filter_out * const rout = create_filter_output(in,NULL,decimate,REAL);
+    set_filter(rout,0.0,0.1,3.0);
+    delete_filter_output(rout);
+    delete_filter_output(cout);
+    delete_filter_input(in);
+  }
+  if(save_wisdom(Wisdom_file) != 0){
+    fprintf(stderr,"Can't write %s\n",Wisdom_file);
+    exit(1);
+  }
+  fprintf(stderr,"Wisdom saved in %s\n",Wisdom_file);
+  exit(0);
+}
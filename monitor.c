@@ -53,7 +53,7 @@ struct session {
 
   struct rtp_state rtp_state;
   uint32_t ssrc;            // RTP Sending Source ID
-  int type;                 // RTP type (10,11,20,111)
+  int type;                 // RTP type (10,11,20,111, or any PCM type in PT_table)
 
   uint32_t start_timestamp;
   long long start_rptr;
@@ -67,6 +67,7 @@ struct session {
   int frame_size;           // Samples in a frame
   float gain;               // Gain; 1 = 0 dB
   float pan;                // Stereo position: 0 = center; -1 = full left; +1 = full right
+  float last[2];            // Previous PCM frame, for interpolating lower sample rates up to SAMPRATE
 
   unsigned long packets;    // RTP packets for this session
   unsigned long empties;    // RTP but no data
@@ -79,7 +80,7 @@ struct session {
 
 
 // Global config variables
-#define SAMPRATE 48000        // Too hard to handle other sample rates right now
+#define SAMPRATE 48000        // Output rate; PCM streams at rates that divide it are interpolated up
 #define SAMPPCALLBACK (SAMPRATE/50)     // 20 ms @ 48 kHz
 #define MAX_MCAST 20          // Maximum number of multicast addresses
 
@@ -93,6 +94,7 @@ int List_audio;               // List audio output devices and exit
 int Verbose;                  // Verbosity flag (currently unused)
 int Quiet;                    // Disable curses
 int Playout = SAMPRATE/10;    // 100 millisecond playout delay by default
+int Rcvbuf_size = 0;          // Input socket buffer, bytes; 0 = system default
 
 // Global variables
 char *Mcast_address_text[MAX_MCAST]; // Multicast address(es) we're listening to
@@ -122,7 +124,7 @@ static int pa_callback(const void *,void *,unsigned long,const PaStreamCallbackT
 void *decode_task(void *x);
 void *sockproc(void *arg);
 
-static char Optstring[] = "LR:vI:qu:p:";
+static char Optstring[] = "LR:U:vI:qu:p:";
 static struct  option Options[] = {
    {"list-audio", no_argument, NULL, 'L'},
    {"audio-dev", required_argument, NULL, 'R'},
@@ -132,6 +134,7 @@ static struct  option Options[] = {
    {"quiet", no_argument, NULL, 'q'},
    {"update", required_argument, NULL, 'u'},
    {"playout", required_argument, NULL, 'p'},
+   {"rcvbuf", required_argument, NULL, 'U'},
    {NULL, 0, NULL, 0},
 };
 
@@ -172,8 +175,11 @@ int main(int argc,char * const argv[]){
     case 'p':
       Playout = strtol(optarg,NULL,0) * SAMPRATE/1000;
       break;
+    case 'U':
+      Rcvbuf_size = strtol(optarg,NULL,0);
+      break;
     default:
-      fprintf(stderr,"Usage: %s [-v] [-q] [-L] [-R audio device] -I mcast_address [-I mcast_address]\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-v] [-q] [-L] [-R audio device] [-U rcvbuf] -I mcast_address [-I mcast_address]\n",argv[0]);
       exit(1);
     }
   }
@@ -304,6 +310,14 @@ void *sockproc(void *arg){
     fprintf(stderr,"Can't set up input %s\n",mcast_address_text);
     pthread_exit(NULL);
   }
+  if(Rcvbuf_size > 0)
+    set_rcvbuf(input_fd,Rcvbuf_size);
+  // Packets are received in batches, then copied out since the sessions queue them
+  struct pktring * const ring = pktring_create(input_fd,PKTRING_SLOTS,PKTSIZE,0);
+  if(ring == NULL){
+    fprintf(stderr,"Can't allocate input buffers\n");
+    pthread_exit(NULL);
+  }
   struct packet *pkt = NULL;
 
   // Main loop begins here
@@ -317,19 +331,22 @@ void *sockproc(void *arg){
     pkt->data = NULL;
     pkt->len = 0;
     
-    struct sockaddr_storage sender;
-    socklen_t socksize = sizeof(sender);
-    int size = recvfrom(input_fd,&pkt->content,sizeof(pkt->content),0,(struct sockaddr *)&sender,&socksize);
+    unsigned char *buffer;
+    struct sockaddr_storage *ssp;
+    int size = pktring_recv(ring,&buffer,&ssp,NULL);
     
     if(size == -1){
       if(errno != EINTR){ // Happens routinely, e.g., when window resized
-	perror("recvfrom");
+	perror("recvmmsg");
 	usleep(1000);
       }
       continue;  // Reuse current buffer
     }
     if(size <= RTP_MIN_SIZE)
       continue; // Must be big enough for RTP header and at least some data
+    struct sockaddr_storage sender;
+    memcpy(&sender,ssp,sizeof(sender));
+    memcpy(pkt->content,buffer,size);
     
     // Convert RTP header to host format
     unsigned char *dp = ntoh_rtp(&pkt->rtp,pkt->content);
@@ -491,13 +508,18 @@ void *decode_task(void *arg){
 
       assert(left_delay >= 0 && right_delay >= 0);
     }
+    // Output samples per stream sample; Opus timestamps are always at 48 kHz
+    struct pt_table const * const pt = &PT_table[pkt->rtp.type & 0x7f];
+    bool const pcm = pt->samprate > 0 && SAMPRATE % pt->samprate == 0;
+    int const upsample = pcm ? SAMPRATE / pt->samprate : 1;
+
     // Find where to write in circular output buffer
     // Handle wraparound in timestamp (unlikely but possible in long-lived stream)
     // This can still fail if there's an outage more than 2^31 samples long without a mark (seems unlikely)
     while(sp->timestamp_upper + pkt->rtp.timestamp - sp->start_timestamp < 0)
       sp->timestamp_upper += (1LL << 32);
 
-    sp->wptr = sp->start_rptr + sp->timestamp_upper + pkt->rtp.timestamp - sp->start_timestamp + sp->playout;
+    sp->wptr = sp->start_rptr + (sp->timestamp_upper + pkt->rtp.timestamp - sp->start_timestamp) * upsample + sp->playout;
 
     if(pkt->rtp.marker || sp->reset || sp->wptr > Rptr + BUFFERSIZE || sp->wptr < Rptr){
       if(sp->wptr < Rptr)
@@ -511,30 +533,13 @@ void *decode_task(void *arg){
       sp->timestamp_upper = 0;
       sp->playout = Playout;
       sp->wptr = Rptr + sp->playout;
+      sp->last[0] = sp->last[1] = 0; // Interpolate up from silence
     }
 
     unsigned int left = sp->wptr + left_delay;
     unsigned int right = sp->wptr + right_delay;
-    signed short *data_ints = (signed short *)&pkt->data[0];	
 
     switch(pkt->rtp.type){
-    case PCM_STEREO_PT:
-      sp->channels = 2;
-      sp->frame_size = pkt->len / 4; // Number of stereo samples
-      for(int i=0; i < sp->frame_size; i++){
-	Output_buffer[left++ & (BUFFERSIZE-1)][0] += SCALE * (signed short)ntohs(*data_ints++) * left_gain;
-	Output_buffer[right++ & (BUFFERSIZE-1)][1] += SCALE * (signed short)ntohs(*data_ints++) * right_gain;
-      }
-      break;
-    case PCM_MONO_PT:
-      sp->channels = 1;
-      sp->frame_size = pkt->len / 2; // Number of stereo samples
-      for(int i=0; i < sp->frame_size; i++){
-	float s = SCALE * (signed short)ntohs(*data_ints++);
-	Output_buffer[left++ & (BUFFERSIZE-1)][0] += s * left_gain;
-	Output_buffer[right++ & (BUFFERSIZE-1)][1] += s * right_gain;
-      }
-      break;
     case OPUS_PT:
     case 20:
       sp->channels = 2;
@@ -557,8 +562,33 @@ void *decode_task(void *arg){
       }
       break;
     default:
-      sp->channels = 0;
-      sp->frame_size = 0;
+      if(!pcm){
+	sp->channels = 0;
+	sp->frame_size = 0;
+	break;
+      }
+      // PCM at any rate and encoding in PT_table
+      if(pkt->len < 2)
+	break; // Not even one sample; don't declare an empty array
+      {
+	int const channels = pt->channels;
+	float samples[pkt->len / 2]; // Enough for the smallest encoding
+	int const n = pcm_to_float(samples,pkt->len / 2,pkt->data,pkt->len,pkt->rtp.type);
+	sp->channels = channels;
+	sp->frame_size = n / channels;
+	for(int i=0; i < sp->frame_size; i++){
+	  float const l = samples[channels * i];
+	  float const r = samples[channels * i + channels - 1]; // Same as l when mono
+	  // Linear interpolation from the previous frame; just this frame when upsample == 1
+	  for(int k=1; k <= upsample; k++){
+	    float const f = (float)k / upsample;
+	    Output_buffer[left++ & (BUFFERSIZE-1)][0] += (sp->last[0] + f * (l - sp->last[0])) * left_gain;
+	    Output_buffer[right++ & (BUFFERSIZE-1)][1] += (sp->last[1] + f * (r - sp->last[1])) * right_gain;
+	  }
+	  sp->last[0] = l;
+	  sp->last[1] = r;
+	}
+      }
       break;
     }
     free(pkt); pkt = NULL;
@@ -594,11 +624,6 @@ void *display(void *arg){
       int bw = 0; // Audio bandwidth (not bitrate) in kHz
       char *type,typebuf[30];
       switch(sp->type){
-     case PCM_STEREO_PT:
-      case PCM_MONO_PT:
-	type = "PCM";
-	bw = SAMPRATE / 2000;
-	break;
       case 20: // for temporary backward compatibility
       case OPUS_PT:
 	switch(sp->opus_bandwidth){
@@ -628,8 +653,13 @@ void *display(void *arg){
 	type = typebuf;
 	break;
       default:
-	snprintf(typebuf,sizeof(typebuf),"%d",sp->type);
-	bw = 0; // Unknown
+	if(PT_table[sp->type & 0x7f].samprate != 0){
+	  snprintf(typebuf,sizeof(typebuf),"PCM %s",PT_table[sp->type & 0x7f].encoding == F32BE ? "float" : "s16");
+	  bw = PT_table[sp->type & 0x7f].samprate / 2000;
+	} else {
+	  snprintf(typebuf,sizeof(typebuf),"%d",sp->type);
+	  bw = 0; // Unknown
+	}
 	type = typebuf;
 	break;
       }
@@ -2,18 +2,21 @@
 // Multicast socket and RTP utility routines
 // Copyright 2018 Phil Karn, KA9Q
 
+#define _GNU_SOURCE 1 // for recvmmsg()
 #include <stdio.h>
+#include <stdlib.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <string.h>
 #include <net/if.h>
-#if defined(linux)
+#if defined(__linux__)
 #include <bsd/string.h>
 #endif
 #include <limits.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <ifaddrs.h>
+#include "misc.h"
 #include "multicast.h"
 
 #define EF_TOS 0x2e // Expedited Forwarding type of service, widely used for VoIP (which all this is, sort of)
@@ -21,7 +24,7 @@
 // Set options on multicast socket
 static void soptions(int fd,int mcast_ttl){
   // Failures here are not fatal
-#if defined(linux)
+#if defined(__linux__)
   int freebind = 1;
   if(setsockopt(fd,IPPROTO_IP,IP_FREEBIND,&freebind,sizeof(freebind)) != 0)
     perror("freebind failed");
@@ -307,6 +310,64 @@ void  *ntoh_rtp(struct rtp_header *rtp,void  *data){
 }
 
 
+// PCM payload types we send and understand
+struct pt_table const PT_table[128] = {
+  [PCM_STEREO_PT] = {48000, 2, S16BE},
+  [PCM_MONO_PT] = {48000, 1, S16BE},
+  [100] = {8000, 1, S16BE},
+  [101] = {8000, 2, S16BE},
+  [102] = {12000, 1, S16BE},
+  [103] = {12000, 2, S16BE},
+  [104] = {16000, 1, S16BE},
+  [105] = {16000, 2, S16BE},
+  [106] = {24000, 1, S16BE},
+  [107] = {24000, 2, S16BE},
+  [112] = {8000, 1, F32BE},
+  [113] = {8000, 2, F32BE},
+  [114] = {12000, 1, F32BE},
+  [115] = {12000, 2, F32BE},
+  [116] = {16000, 1, F32BE},
+  [117] = {16000, 2, F32BE},
+  [118] = {24000, 1, F32BE},
+  [119] = {24000, 2, F32BE},
+  [120] = {48000, 1, F32BE},
+  [121] = {48000, 2, F32BE},
+};
+
+// Find the payload type for a PCM stream, or -1 if there isn't one
+int pt_from_info(int samprate,int channels,enum encoding encoding){
+  for(int type = 0; type < 128; type++){
+    if(PT_table[type].samprate == samprate && PT_table[type].channels == channels && PT_table[type].encoding == encoding)
+      return type;
+  }
+  return -1;
+}
+
+// Convert the payload of a PCM packet of the given type to floats, full scale = +/-1
+// Returns the number of floats (frames * channels), or -1 if the type isn't PCM
+int pcm_to_float(float *out,int maxsamples,unsigned char const *data,int bytes,int type){
+  if(type < 0 || type >= 128)
+    return -1;
+  int n = 0;
+  switch(PT_table[type].encoding){
+  case S16BE:
+    n = min(maxsamples,bytes / 2);
+    for(int i=0; i < n; i++)
+      out[i] = (int16_t)get16(data + 2*i) * (1.0f / SHRT_MAX);
+    break;
+  case F32BE:
+    n = min(maxsamples,bytes / 4);
+    for(int i=0; i < n; i++){
+      uint32_t const w = get32(data + 4*i);
+      memcpy(&out[i],&w,sizeof(out[i]));
+    }
+    break;
+  default:
+    return -1;
+  }
+  return n;
+}
+
 // Convert RTP header from internal host structure to network (wire) big-endian format
 // Written to be insensitive to host byte order and C structure layout and padding
 void *hton_rtp(void *data, struct rtp_header *rtp){
@@ -391,3 +452,156 @@ void update_sockcache(struct sockcache *sc,struct sockaddr *sa){
   }
 }
 
+
+// Set socket receive buffer size; at high packet rates the default is easily overrun
+// Linux caps this at net.core.rmem_max (and reports twice what it actually uses)
+int set_rcvbuf(int const fd,int const size){
+  if(size > 0 && setsockopt(fd,SOL_SOCKET,SO_RCVBUF,&size,sizeof(size)) != 0)
+    perror("so_rcvbuf failed");
+  int actual = 0;
+  socklen_t len = sizeof(actual);
+  getsockopt(fd,SOL_SOCKET,SO_RCVBUF,&actual,&len);
+  if(actual < size)
+    fprintf(stderr,"receive buffer limited to %d bytes (requested %d); check net.core.rmem_max\n",actual,size);
+  return actual;
+}
+
+struct pktring *pktring_create(int const fd,int const slots,int const bufsize,int const timestamps){
+  assert(fd != -1 && slots > 0 && bufsize > 0);
+  if(fd == -1 || slots <= 0 || bufsize <= 0)
+    return NULL;
+
+  struct pktring * const ring = calloc(1,sizeof(*ring));
+  if(ring == NULL)
+    return NULL;
+  ring->fd = fd;
+  ring->slots = slots;
+  ring->bufsize = bufsize;
+  ring->timestamps = timestamps;
+  ring->controlsize = timestamps ? CMSG_SPACE(sizeof(struct timespec)) : 0;
+  ring->buffers = malloc((size_t)slots * bufsize);
+  ring->lengths = calloc(slots,sizeof(*ring->lengths));
+  ring->senders = calloc(slots,sizeof(*ring->senders));
+  ring->times = calloc(slots,sizeof(*ring->times));
+  ring->iov = calloc(slots,sizeof(*ring->iov));
+  ring->control = timestamps ? calloc(slots,ring->controlsize) : NULL;
+#if defined(__linux__)
+  ring->msgs = calloc(slots,sizeof(struct mmsghdr));
+#else
+  ring->msgs = calloc(slots,sizeof(struct msghdr));
+#endif
+  if(ring->buffers == NULL || ring->lengths == NULL || ring->senders == NULL || ring->times == NULL
+     || ring->iov == NULL || ring->msgs == NULL || (timestamps && ring->control == NULL)){
+    pktring_destroy(ring);
+    return NULL;
+  }
+  for(int i=0; i < slots; i++){
+    ring->iov[i].iov_base = ring->buffers + (size_t)i * bufsize;
+    ring->iov[i].iov_len = bufsize;
+  }
+  if(timestamps){
+    int on = 1;
+#if defined(SO_TIMESTAMPNS)
+    if(setsockopt(fd,SOL_SOCKET,SO_TIMESTAMPNS,&on,sizeof(on)) != 0)
+      perror("so_timestampns failed");
+#else
+    if(setsockopt(fd,SOL_SOCKET,SO_TIMESTAMP,&on,sizeof(on)) != 0)
+      perror("so_timestamp failed");
+#endif
+  }
+  return ring;
+}
+
+void pktring_destroy(struct pktring * const ring){
+  if(ring == NULL)
+    return;
+  free(ring->buffers);
+  free(ring->lengths);
+  free(ring->senders);
+  free(ring->times);
+  free(ring->iov);
+  free(ring->control);
+  free(ring->msgs);
+  free(ring);
+}
+
+// Point a message header at buffer i; the kernel overwrites the lengths, so this is done before every receive
+static void setup_msghdr(struct pktring * const ring,struct msghdr * const msg,int const i){
+  memset(msg,0,sizeof(*msg));
+  msg->msg_name = &ring->senders[i];
+  msg->msg_namelen = sizeof(ring->senders[i]);
+  msg->msg_iov = &ring->iov[i];
+  msg->msg_iovlen = 1;
+  if(ring->control != NULL){
+    msg->msg_control = ring->control + (size_t)i * ring->controlsize;
+    msg->msg_controllen = ring->controlsize;
+  }
+}
+
+static void get_timestamp(struct msghdr * const msg,struct timespec * const ts){
+  memset(ts,0,sizeof(*ts));
+  for(struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg,cm)){
+    if(cm->cmsg_level != SOL_SOCKET)
+      continue;
+#if defined(SCM_TIMESTAMPNS)
+    if(cm->cmsg_type == SCM_TIMESTAMPNS){
+      memcpy(ts,CMSG_DATA(cm),sizeof(*ts));
+      return;
+    }
+#endif
+    if(cm->cmsg_type == SCM_TIMESTAMP){
+      struct timeval tv;
+      memcpy(&tv,CMSG_DATA(cm),sizeof(tv));
+      ts->tv_sec = tv.tv_sec;
+      ts->tv_nsec = tv.tv_usec * 1000;
+      return;
+    }
+  }
+}
+
+// Refill the ring, waiting for at least one packet but taking everything already queued
+static int pktring_fill(struct pktring * const ring){
+  ring->count = ring->next = 0;
+#if defined(__linux__)
+  struct mmsghdr * const msgs = ring->msgs;
+  for(int i=0; i < ring->slots; i++)
+    setup_msghdr(ring,&msgs[i].msg_hdr,i);
+
+  int const n = recvmmsg(ring->fd,msgs,ring->slots,MSG_WAITFORONE,NULL);
+  if(n <= 0)
+    return -1;
+  for(int i=0; i < n; i++){
+    ring->lengths[i] = msgs[i].msg_len;
+    if(ring->timestamps)
+      get_timestamp(&msgs[i].msg_hdr,&ring->times[i]);
+  }
+#else
+  struct msghdr * const msg = ring->msgs;
+  setup_msghdr(ring,msg,0);
+  int const len = recvmsg(ring->fd,msg,0);
+  if(len < 0)
+    return -1;
+  int const n = 1;
+  ring->lengths[0] = len;
+  if(ring->timestamps)
+    get_timestamp(msg,&ring->times[0]);
+#endif
+  ring->count = n;
+  ring->calls++;
+  ring->packets += n;
+  return n;
+}
+
+int pktring_recv(struct pktring * const ring,unsigned char ** const data,struct sockaddr_storage ** const sender,struct timespec ** const timestamp){
+  assert(ring != NULL && data != NULL);
+  if(ring->next >= ring->count && pktring_fill(ring) < 0)
+    return -1;
+
+  int const i = ring->next++;
+  *data = ring->iov[i].iov_base;
+  if(sender != NULL)
+    *sender = &ring->senders[i];
+  if(timestamp != NULL)
+    *timestamp = &ring->times[i];
+  return ring->lengths[i];
+}
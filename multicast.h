@@ -7,7 +7,9 @@
 #define _MULTICAST_H 1
 #include <stdint.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <netdb.h>
+#include <time.h>
 #include <assert.h>
 
 #define NTP_EPOCH 2208988800UL // Seconds between Jan 1 1900 and Jan 1 1970
@@ -24,6 +26,24 @@
 #define PCM_STEREO_PT (10)
 #define OPUS_PT (111) // Hard-coded NON-standard payload type for OPUS (should be dynamic with sdp)
 
+// Audio sample encodings
+enum encoding {
+  NO_ENCODING = 0,
+  S16BE,   // 16-bit signed integers, big endian (network order)
+  F32BE,   // IEEE 32-bit floats, big endian (network order), full scale = +/-1
+};
+
+// PCM payload types: sample rate, channels and encoding
+// PCM_STEREO_PT and PCM_MONO_PT are 48 kHz 16-bit; the others are NON-standard
+struct pt_table {
+  int samprate;   // 0 = not a PCM type
+  int channels;
+  enum encoding encoding;
+};
+extern struct pt_table const PT_table[128];
+int pt_from_info(int samprate,int channels,enum encoding encoding);
+int pcm_to_float(float *out,int maxsamples,unsigned char const *data,int bytes,int type);
+
 // Internal representation of RTP header -- NOT what's on wire!
 struct rtp_header {
   int version;
@@ -98,6 +118,41 @@ struct sockcache {
 };
 
 
+// Batched packet receiver
+// A ring of preallocated buffers refilled with one recvmmsg() call (where available) whenever it runs dry
+#define PKTRING_SLOTS 64   // Default number of buffers
+
+struct pktring {
+  int fd;
+  int slots;                         // Number of buffers
+  int bufsize;                       // Size of each buffer
+  int count;                         // Buffers filled by the last receive call
+  int next;                          // Next filled buffer to hand out
+  int timestamps;                    // Kernel receive timestamps requested
+  unsigned char *buffers;            // slots * bufsize bytes
+  int *lengths;
+  struct sockaddr_storage *senders;
+  struct timespec *times;            // Zero unless timestamps are on
+  struct iovec *iov;
+  unsigned char *control;            // Ancillary data (timestamps)
+  int controlsize;                   // per buffer
+  void *msgs;                        // struct mmsghdr (Linux) or struct msghdr
+  long long calls;                   // Receive system calls
+  long long packets;                 // Packets received
+};
+
+struct pktring *pktring_create(int fd,int slots,int bufsize,int timestamps);
+void pktring_destroy(struct pktring *);
+// Return the length of the next packet and point to it, blocking only when the ring is empty
+// The data stays valid until the next call
+int pktring_recv(struct pktring *,unsigned char **data,struct sockaddr_storage **sender,struct timespec **timestamp);
+// Packets already in the ring; useful with select(), which can't see them
+static inline int pktring_pending(struct pktring const *ring){
+  return ring->count - ring->next;
+}
+// Set socket receive buffer size, returning what the kernel actually allowed
+int set_rcvbuf(int fd,int size);
+
 // Convert between internal and wire representations of RTP header
 void *ntoh_rtp(struct rtp_header *,void *);
 void *hton_rtp(void *, struct rtp_header *);
@@ -28,7 +28,9 @@
 struct session {
   struct session *prev;       // Linked list pointers
   struct session *next; 
-  int type;                 // input RTP type (10,11)
+  int type;                 // input RTP type (any PCM type in PT_table)
+  int samprate;             // input sample rate; the encoder runs at this rate
+  int frame_size;           // input samples per Opus frame
   
   struct sockaddr sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
@@ -49,11 +51,9 @@ struct session {
 
 // Global config variables
 int const Bufsize = 16384;     // Maximum samples/words per RTP packet - must be bigger than Ethernet MTU
-int const Samprate = 48000;   // Too hard to handle other sample rates right now
-                              // Opus will notice the actual audio bandwidth, so there's no real cost to this
+int const Samprate = 48000;   // Opus RTP timestamps always count at 48 kHz, whatever the encoder's input rate
 
 int const Channels = 2;       // Stereo - no penalty if the audio is actually mono, Opus will figure it out
-float const SCALE = 1./SHRT_MAX;
 
 // Command line params
 int Verbose;                  // Verbosity flag (currently unused)
@@ -62,6 +62,7 @@ int Discontinuous = 0;        // Off by default
 float Opus_blocktime = 20;    // 20 ms, a reasonable default
 int Fec = 0;                  // Use forward error correction
 int Mcast_ttl = 10;           // our multicast output is frequently routed
+int Rcvbuf_size = 0;          // PCM input socket buffer, bytes; 0 = system default
 
 // Global variables
 int Status_fd = -1;           // Reading from radio status
@@ -91,12 +92,13 @@ struct option Options[] =
    {"ttl", required_argument, NULL, 'T'},
    {"fec", required_argument, NULL, 'f'},
    {"bitrate", required_argument, NULL, 'o'},
+   {"rcvbuf", required_argument, NULL, 'U'},
    {"verbose", no_argument, NULL, 'v'},
    {"discontinuous", no_argument, NULL, 'x'},
    {NULL, 0, NULL, 0},
   };
    
-char Optstring[] = "A:B:I:R:S:T:f:o:vx";
+char Optstring[] = "A:B:I:R:S:T:U:f:o:vx";
 
 struct sockaddr_storage Status_dest_address;
 struct sockaddr_storage Status_input_source_address;
@@ -162,6 +164,9 @@ int main(int argc,char * const argv[]){
     case 'T':
       Mcast_ttl = strtol(optarg,NULL,0);
       break;
+    case 'U':
+      Rcvbuf_size = strtol(optarg,NULL,0);
+      break;
     case 'f':
       Fec = strtol(optarg,NULL,0);
       break;
@@ -175,7 +180,7 @@ int main(int argc,char * const argv[]){
       Discontinuous = 1;
       break;
     default:
-      fprintf(stderr,"Usage: %s [-x] [-v] [-o bitrate] [-B blocktime] [-T mcast_ttl] -I input_mcast_address -R output_mcast_address\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-x] [-v] [-o bitrate] [-B blocktime] [-T mcast_ttl] [-U rcvbuf] -I input_mcast_address -R output_mcast_address\n",argv[0]);
       fprintf(stderr,"Defaults: %s -o %d -B %.1f -I (none) -R (none) -T %d\n",argv[0],Opus_bitrate,Opus_blocktime,Mcast_ttl);
       exit(1);
     }
@@ -304,17 +309,25 @@ void *input(void *arg){
   if(Verbose)
     fprintf(stderr,"input thread running\n");
 
+  if(Rcvbuf_size > 0)
+    set_rcvbuf(Input_fd,Rcvbuf_size);
+  struct pktring * const ring = pktring_create(Input_fd,PKTRING_SLOTS,Bufsize,0);
+  if(ring == NULL){
+    fprintf(stderr,"Can't allocate input buffers\n");
+    exit(1);
+  }
   while(1){
-    unsigned char buffer[Bufsize];
-    socklen_t socksize = sizeof(PCM_source_address);
-    int size = recvfrom(Input_fd,buffer,sizeof(buffer),0,(struct sockaddr *)&PCM_source_address,&socksize);
+    unsigned char *buffer;
+    struct sockaddr_storage *sender;
+    int size = pktring_recv(ring,&buffer,&sender,NULL);
     if(size == -1){
       if(errno != EINTR){ // Happens routinely
-	perror("recvfrom");
+	perror("recvmmsg");
 	usleep(1000);
       }
       continue;
     }
+    memcpy(&PCM_source_address,sender,sizeof(PCM_source_address));
     if(size <= RTP_MIN_SIZE){
       usleep(500); // Avoid tight loop
       continue; // Too small to be valid RTP
@@ -331,17 +344,11 @@ void *input(void *arg){
     if(size < 0)
       continue; // Bogus RTP header?
 
-    int frame_size = 0;
-    switch(rtp_hdr.type){
-    case PCM_STEREO_PT:
-      frame_size = size / (2 * sizeof(short));
-      break;
-    case PCM_MONO_PT:
-      frame_size = size / sizeof(short);
-      break;
-    default:
-      goto endloop; // Discard all but mono and stereo PCM to avoid polluting session table
-    }
+    // Opus can encode every rate in PT_table directly
+    struct pt_table const * const pt = &PT_table[rtp_hdr.type];
+    if(pt->samprate == 0)
+      goto endloop; // Discard all but PCM to avoid polluting session table
+    int const frame_size = size / ((pt->encoding == F32BE ? sizeof(float) : sizeof(int16_t)) * pt->channels);
 
     struct session *sp = lookup_session((struct sockaddr *)&PCM_source_address,rtp_hdr.ssrc);
     if(sp == NULL){
@@ -352,11 +359,13 @@ void *input(void *arg){
       }
       getnameinfo((struct sockaddr *)&PCM_source_address,sizeof(PCM_source_address),sp->addr,sizeof(sp->addr),
 		    sp->port,sizeof(sp->port),NI_NOFQDN|NI_DGRAM);
-      sp->audio_buffer = malloc(Channels * sizeof(float) * Opus_frame_size);
+      sp->samprate = pt->samprate;
+      sp->frame_size = round(Opus_blocktime * sp->samprate / 1000.);
+      sp->audio_buffer = malloc(Channels * sizeof(float) * sp->frame_size);
       sp->audio_index = 0;
       sp->rtp_state_out.ssrc = rtp_hdr.ssrc;
       int error = 0;
-      sp->opus = opus_encoder_create(Samprate,Channels,OPUS_APPLICATION_AUDIO,&error);
+      sp->opus = opus_encoder_create(sp->samprate,Channels,OPUS_APPLICATION_AUDIO,&error);
       if(error != OPUS_OK || !sp->opus){
 	fprintf(stderr,"opus_encoder_create error %d\n",error);
 	exit(1);
@@ -381,40 +390,23 @@ void *input(void *arg){
       // Always seems to return error -5 even when OK??
       error = opus_encoder_ctl(sp->opus,OPUS_FRAMESIZE_ARG,Opus_blocktime);
       if(0 && error != OPUS_OK)
-	fprintf(stderr,"opus_encoder_ctl set framesize %d (%.1lf ms): error %d\n",Opus_frame_size,Opus_blocktime,error);
+	fprintf(stderr,"opus_encoder_ctl set framesize %d (%.1lf ms): error %d\n",sp->frame_size,Opus_blocktime,error);
     }
     sp->type = rtp_hdr.type;
     int samples_skipped = rtp_process(&sp->rtp_state_in,&rtp_hdr,frame_size);
     if(samples_skipped < 0)
       goto endloop; // Old dupe
     
-    if(rtp_hdr.marker || samples_skipped > 4*Opus_frame_size){
+    if(rtp_hdr.marker || samples_skipped > 4*sp->frame_size){
       // reset encoder state after 4 frames of complete silence or a RTP marker bit
       opus_encoder_ctl(sp->opus,OPUS_RESET_STATE);
       sp->silence = 1;
     }
-    int sampcount = 0;
-    signed short *samples = (signed short *)dp;
-    switch(rtp_hdr.type){
-    case PCM_STEREO_PT: // Stereo
-      sampcount = size / 4;  // # 32-bit word samples
-      for(int i=0; i < sampcount; i++){
-	float left = SCALE * (signed short)ntohs(samples[2*i]);
-	float right = SCALE * (signed short)ntohs(samples[2*i+1]);
-	send_samples(sp,left,right);
-      }
-      break;
-    case PCM_MONO_PT: // Mono; send to both stereo channels
-      sampcount = size / 2;
-      for(int i=0;i<sampcount;i++){
-	float left = SCALE * (signed short)ntohs(samples[i]);
-	float right = left;
-	send_samples(sp,left,right);
-      }
-      break;
-    default:
-      sampcount = 0;
-      break; // ignore
+    {
+      float samples[size / 2]; // Enough for the smallest encoding
+      int const n = pcm_to_float(samples,size / 2,dp,size,rtp_hdr.type);
+      for(int i=0; i + pt->channels <= n; i += pt->channels)
+	send_samples(sp,samples[i],samples[i + pt->channels - 1]); // Mono goes to both stereo channels
     }
 
   endloop:;
@@ -497,7 +489,7 @@ int send_samples(struct session *sp,float left,float right){
   int size = 0;
   sp->audio_buffer[sp->audio_index++] = left;
   sp->audio_buffer[sp->audio_index++] = right;  
-  if(sp->audio_index >= Opus_frame_size * Channels){
+  if(sp->audio_index >= sp->frame_size * Channels){
     sp->audio_index = 0;
 
     // Set up to transmit Opus RTP/UDP/IP
@@ -516,12 +508,12 @@ int send_samples(struct session *sp,float left,float right){
       rtp_hdr.marker = 0;
 
     rtp_hdr.timestamp = sp->rtp_state_out.timestamp;
-    sp->rtp_state_out.timestamp += Opus_frame_size; // Always increase timestamp
+    sp->rtp_state_out.timestamp += Opus_frame_size; // Always increase timestamp, at 48 kHz
     
     unsigned char outbuffer[Bufsize];
     unsigned char *dp = outbuffer;
     dp = hton_rtp(dp,&rtp_hdr);
-    size = opus_encode_float(sp->opus,sp->audio_buffer,Opus_frame_size,dp,sizeof(outbuffer) - (dp - outbuffer));
+    size = opus_encode_float(sp->opus,sp->audio_buffer,sp->frame_size,dp,sizeof(outbuffer) - (dp - outbuffer));
     dp += size;
     if(!Discontinuous || size > 2){
       // ship it
@@ -5,8 +5,11 @@
 #include <assert.h>
 #include <math.h>
 #include <complex.h>
+#include <stdbool.h>
+#include "misc.h"
 #include "osc.h"
 #include "dsp.h"
+#include "cvec.h"
 
 const int Renorm_rate = 16384; // Renormalize oscillators this often
 
@@ -49,6 +52,86 @@ complex double step_osc(struct osc *osc){
   return r;
 }
 
+// Advance oscillator by n samples without generating them, as if step_osc() had been called n times
+// Exact in O(1), so it can also keep oscillators in step across gaps in the input
+void skip_osc(struct osc *osc,long long n){
+  if(n <= 0)
+    return;
+
+  double const theta = carg(osc->phasor_step); // radians/sample
+  if(osc->rate != 0){
+    // Step k advances the phase by theta + k*dtheta, k = 1...n
+    double const dtheta = carg(osc->phasor_step_step);
+    osc->phasor *= cis(n * theta + dtheta * 0.5 * n * (n + 1));
+    osc->phasor_step *= cis(n * dtheta);
+  } else
+    osc->phasor *= cis(n * theta);
+
+  osc->steps += n;
+  if(osc->steps >= Renorm_rate)
+    renorm_osc(osc);
+}
+
+// Precompute the phasor offsets for the next OSC_BLOCK samples from the current phasor_step
+// Without a chirp this happens only when the frequency changes; with one, for every block
+static void make_table(struct osc *osc){
+  complex double t = 1;
+  complex double step = osc->phasor_step;
+  for(int j=0; j < OSC_BLOCK; j++){
+    osc->table[j] = t;
+    if(osc->rate != 0)
+      step *= osc->phasor_step_step;
+    t *= step;
+  }
+  osc->block_step = t;
+  osc->table_step = osc->phasor_step;
+}
+
+// Shared by block_osc() and mix_osc()
+// Each block of OSC_BLOCK phasors comes from the double-precision phasor times the float table,
+// so float rounding never accumulates; the phasor itself is advanced exactly between blocks
+static void run_osc(struct osc *osc,complex float * restrict buf,int n,bool const mix){
+  while(n > 0){
+    if(osc->rate != 0 || osc->table_step != osc->phasor_step)
+      make_table(osc);
+
+    int const chunk = min(n,OSC_BLOCK);
+    complex float const base = osc->phasor;
+    cvec const vbase = cv_set1(base);
+    int i = 0;
+    for(; i + CVLEN <= chunk; i += CVLEN){
+      cvec p = cv_mul(vbase,cv_load(osc->table + i));
+      if(mix)
+	p = cv_mul(p,cv_load(buf + i));
+      cv_store(buf + i,p);
+    }
+    for(; i < chunk; i++){
+      complex float const p = base * osc->table[i];
+      buf[i] = mix ? buf[i] * p : p;
+    }
+    if(chunk == OSC_BLOCK && osc->rate == 0){
+      osc->phasor *= osc->block_step;
+      osc->steps += chunk;
+      if(osc->steps >= Renorm_rate)
+	renorm_osc(osc);
+    } else
+      skip_osc(osc,chunk);
+
+    buf += chunk;
+    n -= chunk;
+  }
+}
+
+// Write the next n oscillator phasors into out[], as from n calls to step_osc()
+void block_osc(struct osc *osc,complex float *out,int n){
+  run_osc(osc,out,n,false);
+}
+
+// Multiply buf[] in place by the next n oscillator phasors
+void mix_osc(struct osc *osc,complex float *buf,int n){
+  run_osc(osc,buf,n,true);
+}
+
 void renorm_osc(struct osc *osc){
   osc->steps = 0;
   osc->phasor /= cabs(osc->phasor);
@@ -60,8 +143,24 @@ void renorm_osc(struct osc *osc){
 #include <stdlib.h>
 
 
+// NCO sine table: Nco_table[i] = exp(j*2*pi*i/2^NCO_BITS)
+static complex float Nco_table[1 << NCO_BITS];
+static pthread_once_t Nco_once = PTHREAD_ONCE_INIT;
+static void make_nco_table(void){
+  for(int i=0; i < (1 << NCO_BITS); i++)
+    Nco_table[i] = cispi(2.0 * i / (1 << NCO_BITS));
+}
+
+// NCO output for a 32-bit phase: table entry for the top bits, corrected to first order
+// for the rest. Error < 2e-5, well below the phase noise of anything we'll track
+static inline complex float nco(uint32_t const phase){
+  float const frac = (phase & ((1U << (32 - NCO_BITS)) - 1)) * (float)(2 * M_PI / 4294967296.);
+  return Nco_table[phase >> (32 - NCO_BITS)] * CMPLXF(1,frac);
+}
+
 // Initialize digital phase lock loop with bandwidth, damping factor, initial VCO frequency and sample rate
 void init_pll(struct pll *pll,float nf,float damping,double freq,float samprate){
+  pthread_once(&Nco_once,make_nco_table);
 
   pll->samptime = 1./samprate;
   freq *= pll->samptime; // initial VCO frequency in cycles/sample
@@ -77,6 +176,9 @@ void init_pll(struct pll *pll,float nf,float damping,double freq,float samprate)
   pll->prop_gain = tau2 / tau1;
   pll->integrator_gain = 1 / tau1;
   pll->integrator = freq * pll->samptime / pll->integrator_gain; // To give specified frequency
+  pll->phase = 0;
+  pll->freq = freq;
+  pll->step = (int32_t)lrintf(pll->freq * 4294967296.f);
 #if 0
   fprintf(stderr,"init_pll(%p,%f,%f,%f,%f)\n",pll,nf,damping,freq,samprate);
   fprintf(stderr,"natfreq %lg tau1 %lg tau2 %lg propgain %lg intgain %lg\n",
@@ -84,25 +186,32 @@ void init_pll(struct pll *pll,float nf,float damping,double freq,float samprate)
 #endif
 }
 
-
-// Step the PLL through one sample, return VCO control voltage
-// Initial implementation, will probably be slow because of the sincos() for every sample
-// Return PLL freq in cycles/sample
-float run_pll(struct pll *pll,float phase){
-
+// Loop filter: update the VCO frequency from a phase error in radians
+static inline float pll_update(struct pll * const pll,float const phase){
   float feedback = pll->integrator_gain * pll->integrator + pll->prop_gain * phase;
   pll->integrator += phase;
-  
-  feedback = feedback > 0.49 ? 0.49 : feedback < -0.49 ? -0.49 : feedback;
-  set_osc(&pll->vco,feedback,0); // This may be a CPU problem on every sample
-  step_osc(&pll->vco);
-#if 0
-  if((random() & 0xffff) == 0){
-    fprintf(stderr,"phase %f integrator %g feedback %g pll_freq %g\n",
-	    phase,pll->integrator,feedback,feedback/pll->samptime);
-  }
-#endif
-   
+
+  feedback = feedback > 0.49f ? 0.49f : feedback < -0.49f ? -0.49f : feedback;
+  pll->freq = feedback;
+  pll->step = (int32_t)lrintf(feedback * 4294967296.f); // |feedback| < 0.5 fits
   return feedback;
 }
 
+// Run the PLL over a block of samples, derotating each in place by the VCO
+// The phase detector is fast_atan2f() of each derotated sample, or of its square (for suppressed carriers)
+void run_pll_block(struct pll *pll,complex float *buf,int n,bool const square){
+  uint32_t phase = pll->phase;
+  for(int i=0; i < n; i++){
+    complex float const s = buf[i] * conjf(nco(phase));
+    buf[i] = s;
+    complex float const d = square ? s * s : s;
+    pll_update(pll,fast_atan2f(cimagf(d),crealf(d)));
+    phase += pll->step;
+  }
+  pll->phase = phase;
+}
+
+// Current VCO phase in radians
+float pll_phase(struct pll const *pll){
+  return (int32_t)pll->phase * (float)(2 * M_PI / 4294967296.);
+}
@@ -5,6 +5,10 @@
 #include <pthread.h>
 #include <math.h>
 #include <complex.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define OSC_BLOCK 64 // Phasors generated per resync by the block functions
 
 struct osc {
   double freq;
@@ -14,11 +18,21 @@ struct osc {
   complex double phasor_step_step;
   pthread_mutex_t mutex;
   int steps; // Steps since last normalize
+
+  // Block generation: phasor_step^j (with any chirp) for j = 0...OSC_BLOCK-1, rebuilt when phasor_step changes
+  complex double table_step;      // phasor_step the table was built for
+  complex double block_step;      // phasor_step^OSC_BLOCK, exact, when rate == 0
+  complex float table[OSC_BLOCK];
 };
 
+// The PLL's VCO is a numerically controlled oscillator private to the loop: a 32-bit phase
+// accumulator (2^32 = one cycle) and a sine table, so it needs no lock and no sincos per sample
+#define NCO_BITS 10 // log2 of sine table size
 struct pll {
   float samptime;
-  struct osc vco;
+  uint32_t phase;     // VCO phase
+  uint32_t step;      // VCO phase increment per sample
+  float freq;         // VCO frequency, cycles/sample
   float integrator_gain;
   float prop_gain;
   float integrator;
@@ -31,12 +45,16 @@ struct pll {
 // Osc functions
 void set_osc(struct osc *osc,double f,double r);
 complex double step_osc(struct osc *osc);
+void block_osc(struct osc *osc,complex float *out,int n);
+void mix_osc(struct osc *osc,complex float *buf,int n);
+void skip_osc(struct osc *osc,long long n);
 void renorm_osc(struct osc *osc);
 int is_phasor_init(const complex double x);
 
 // PLL functions
 void init_pll(struct pll *pll,float bw,float damping,double freq,float samprate);
-float run_pll(struct pll *pll,float phase);
+void run_pll_block(struct pll *pll,complex float *buf,int n,bool square);
+float pll_phase(struct pll const *pll);
 
 
 #endif
@@ -32,6 +32,8 @@ struct session {
   struct rtp_state rtp_state_in;
   struct rtp_state rtp_state_out;
 
+  int samprate;      // Input PCM sample rate
+  int samppbit;      // Samples per bit at that rate
   int input_pointer;
   struct filter_in *filter_in;
   pthread_t decode_thread;
@@ -40,20 +42,19 @@ struct session {
 
 // Config constants
 #define MAX_MCAST 20          // Maximum number of multicast addresses
-float const SCALE = 1./32768;
 int const PKTSIZE = 16384;
+// Filter sizes at 48 kHz; scaled with the input sample rate
 int const AN = 2048; // Should be power of 2 for FFT efficiency
 int const AL = 1000; // 25 bit times
 //int const AM = AN - AL + 1; // should be >= Samppbit, i.e., samprate / bitrate
 int const AM = 1049;
-float const Samprate = 48000;
-float const Bitrate = 1200;
-//int const Samppbit = Samprate/Bitrate;
-int const Samppbit = 40;
+int const Samprate = 48000;
+int const Bitrate = 1200;  // Input sample rate must be a multiple
 
 // Command line params
 int Verbose;
 int Mcast_ttl = 10;           // Very low intensity output
+int Rcvbuf_size = 0;          // PCM input socket buffer, bytes; 0 = system default
 
 // Global variables
 int Nfds;          // Number of PCM streams
@@ -85,10 +86,11 @@ struct option Options[] =
    {"ax25-out", required_argument, NULL, 'R'},
    {"status-in", required_argument, NULL, 'S'},
    {"ttl", required_argument, NULL, 'T'},
+   {"rcvbuf", required_argument, NULL, 'U'},
    {"verbose", no_argument, NULL, 'v'},
    {NULL, 0, NULL, 0},
   };
-char Optstring[] = "A:I:R:S:T:v";
+char Optstring[] = "A:I:R:S:T:U:v";
 
 
 int main(int argc,char *argv[]){
@@ -154,11 +156,14 @@ int main(int argc,char *argv[]){
     case 'T':
       Mcast_ttl = strtol(optarg,NULL,0);
       break;
+    case 'U':
+      Rcvbuf_size = strtol(optarg,NULL,0);
+      break;
     case 'v':
       Verbose++;
       break;
     default:
-      fprintf(stderr,"Usage: %s [--verbose|-v] [--ttl|-T mcast_ttl] [--pcm-in|-I input_mcast_address [--pcm-in|-I address2]] [--ax25-out|-R output_mcast_address] [input_address ...]\n",argv[0]);
+      fprintf(stderr,"Usage: %s [--verbose|-v] [--ttl|-T mcast_ttl] [--rcvbuf|-U bytes] [--pcm-in|-I input_mcast_address [--pcm-in|-I address2]] [--ax25-out|-R output_mcast_address] [input_address ...]\n",argv[0]);
       exit(1);
     }
   }
@@ -270,6 +275,16 @@ void *input(void *arg){
   struct rtp_header rtp_hdr;
   struct sockaddr sender;
 
+  // Each socket is drained in batches; select() can't see what's already in its ring
+  struct pktring *ring[MAX_MCAST];
+  for(int i=0; i < Nfds; i++){
+    if(Input_fd[i] == -1)
+      continue;
+    if(Rcvbuf_size > 0)
+      set_rcvbuf(Input_fd[i],Rcvbuf_size);
+    ring[i] = pktring_create(Input_fd[i],PKTRING_SLOTS,PKTSIZE,0);
+    assert(ring[i] != NULL);
+  }
   while(1){
     // Wait for traffic to arrive
     fd_set fdset = Fdset_template;
@@ -283,69 +298,78 @@ void *input(void *arg){
       if(Input_fd[fd_index] == -1 || !FD_ISSET(Input_fd[fd_index],&fdset))
 	continue;
 
-      unsigned char buffer[PKTSIZE];
-      socklen_t socksize = sizeof(sender);
-      int size = recvfrom(Input_fd[fd_index],buffer,sizeof(buffer),0,&sender,&socksize);
-      if(size == -1){
-	if(errno != EINTR){ // Happens routinely
-	  perror("recvfrom");
-	  usleep(1000); // avoid tight loop
+      do {
+	unsigned char *buffer;
+	struct sockaddr_storage *ssp;
+	int size = pktring_recv(ring[fd_index],&buffer,&ssp,NULL);
+	if(size == -1){
+	  if(errno != EINTR){ // Happens routinely
+	    perror("recvmmsg");
+	    usleep(1000); // avoid tight loop
+	  }
+	  continue;
 	}
-	continue;
-      }
-      if(size < RTP_MIN_SIZE)
-	continue; // Too small to be valid RTP
-
-      // Extract RTP header
-      unsigned char *dp = buffer;
-      dp = ntoh_rtp(&rtp_hdr,dp);
-      size -= dp - buffer;
+	memcpy(&sender,ssp,sizeof(sender));
+	if(size < RTP_MIN_SIZE)
+	  continue; // Too small to be valid RTP
+
+	// Extract RTP header
+	unsigned char *dp = buffer;
+	dp = ntoh_rtp(&rtp_hdr,dp);
+	size -= dp - buffer;
       
-      if(rtp_hdr.pad){
-	// Remove padding
-	size -= dp[size-1];
-	rtp_hdr.pad = 0;
-      }
-      if(size < 0)
-	continue; // garbled RTP header?
-      
-      if(rtp_hdr.type != PCM_MONO_PT)
-	continue; // Only mono PCM for now
+	if(rtp_hdr.pad){
+	  // Remove padding
+	  size -= dp[size-1];
+	  rtp_hdr.pad = 0;
+	}
+	if(size < 0)
+	  continue; // garbled RTP header?
       
-      struct session *sp = lookup_session(rtp_hdr.ssrc);
-      if(sp == NULL){
-	// Not found
-	if((sp = make_session(rtp_hdr.ssrc)) == NULL){
-	  fprintf(stdout,"No room for new session!!\n");
-	  fflush(stdout);
+	// Any mono PCM whose rate is a whole number of samples per bit: 12, 24 or 48 kHz
+	struct pt_table const * const pt = &PT_table[rtp_hdr.type];
+	if(pt->samprate == 0 || pt->channels != 1 || pt->samprate % Bitrate != 0)
 	  continue;
-	}
-	sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = rtp_hdr.ssrc;
-	sp->input_pointer = 0;
-	sp->filter_in = create_filter_input(AL,AM,REAL);
-	pthread_create(&sp->decode_thread,NULL,decode_task,sp); // One decode thread per stream
-	if(Verbose){
-	  update_sockcache(&sp->source,&sender); // Not needed except for verbose debugging
-	  fprintf(stdout,"New session from %s:%s, ssrc %x\n",sp->source.host,sp->source.port,sp->rtp_state_in.ssrc);
-	  fflush(stdout);
-	}
-      }
-      int sample_count = size / sizeof(signed short); // 16-bit sample count
-      int skipped_samples = rtp_process(&sp->rtp_state_in,&rtp_hdr,sample_count);
-      if(skipped_samples < 0)
-	continue;	// Drop probable duplicate(s)
       
-      // Ignore skipped_samples > 0; no real need to maintain sample count when squelch closes
-      // Even if its caused by dropped RTP packets there's no FEC to fix it anyway
-      signed short *samples = (signed short *)dp;
-      while(sample_count-- > 0){
-	// Swap sample to host order, convert to float
-	sp->filter_in->input.r[sp->input_pointer++] = ntohs(*samples++) * SCALE;
-	if(sp->input_pointer == sp->filter_in->ilen){
-	  execute_filter_input(sp->filter_in); // Wakes up any threads waiting for data on this filter
+	struct session *sp = lookup_session(rtp_hdr.ssrc);
+	if(sp == NULL){
+	  // Not found
+	  if((sp = make_session(rtp_hdr.ssrc)) == NULL){
+	    fprintf(stdout,"No room for new session!!\n");
+	    fflush(stdout);
+	    continue;
+	  }
+	  sp->rtp_state_out.ssrc = sp->rtp_state_in.ssrc = rtp_hdr.ssrc;
+	  sp->samprate = pt->samprate;
+	  sp->samppbit = sp->samprate / Bitrate;
 	  sp->input_pointer = 0;
+	  sp->filter_in = create_filter_input(AL * sp->samprate / Samprate,AM * sp->samprate / Samprate,REAL);
+	  pthread_create(&sp->decode_thread,NULL,decode_task,sp); // One decode thread per stream
+	  if(Verbose){
+	    update_sockcache(&sp->source,&sender); // Not needed except for verbose debugging
+	    fprintf(stdout,"New session from %s:%s, ssrc %x\n",sp->source.host,sp->source.port,sp->rtp_state_in.ssrc);
+	    fflush(stdout);
+	  }
 	}
-      }
+	if(sp->samprate != pt->samprate)
+	  continue; // Rate can't change within a session
+
+	float samples[size / 2 + 1]; // Enough for the smallest encoding
+	int sample_count = pcm_to_float(samples,size / 2,dp,size,rtp_hdr.type);
+	int skipped_samples = rtp_process(&sp->rtp_state_in,&rtp_hdr,sample_count);
+	if(skipped_samples < 0)
+	  continue;	// Drop probable duplicate(s)
+      
+	// Ignore skipped_samples > 0; no real need to maintain sample count when squelch closes
+	// Even if its caused by dropped RTP packets there's no FEC to fix it anyway
+	for(int i=0; i < sample_count; i++){
+	  sp->filter_in->input.r[sp->input_pointer++] = samples[i];
+	  if(sp->input_pointer == sp->filter_in->ilen){
+	    execute_filter_input(sp->filter_in); // Wakes up any threads waiting for data on this filter
+	    sp->input_pointer = 0;
+	  }
+	}
+      } while(pktring_pending(ring[fd_index]) > 0);
     }
   }
   return NULL; // Never gets here
@@ -405,18 +429,18 @@ void *decode_task(void *arg){
   assert(sp != NULL);
 
   struct filter_out *filter = create_filter_output(sp->filter_in,NULL,1,COMPLEX);
-  set_filter(filter,+100./Samprate,+4000./Samprate,3.0); // Creates analytic, band-limited signal
+  set_filter(filter,+100./sp->samprate,+4000./sp->samprate,3.0); // Creates analytic, band-limited signal
 
   // Tone replica generators (-1200 and -2200 Hz)
   struct osc mark;
   memset(&mark,0,sizeof(mark));
   pthread_mutex_init(&mark.mutex,NULL);
-  set_osc(&mark,-1200./Samprate, 0.0);
+  set_osc(&mark,-1200./sp->samprate, 0.0);
   
   struct osc space;
   memset(&space,0,sizeof(space));
   pthread_mutex_init(&space.mutex,NULL);
-  set_osc(&space,-2200./Samprate, 0.0);  
+  set_osc(&space,-2200./sp->samprate, 0.0);  
     
   // Tone integrators
   int symphase = 0;
@@ -437,25 +461,30 @@ void *decode_task(void *arg){
   while(1){
     execute_filter_output(filter,0);    // Blocks until data appears
 
+    complex float mark_phasors[filter->olen];
+    complex float space_phasors[filter->olen];
+    block_osc(&mark,mark_phasors,filter->olen);
+    block_osc(&space,space_phasors,filter->olen);
+
     for(int n=0; n<filter->olen; n++){
 
       // Spin down by 1200 and 2200 Hz, accumulate each in boxcar (comb) filters
       // Mark and space each have in-phase and offset integrators for timing recovery
       float complex s;
-      s = filter->output.c[n] * step_osc(&mark);
+      s = filter->output.c[n] * mark_phasors[n];
       mark_accum += s;
       mark_offset_accum += s;
 
-      s = filter->output.c[n] * step_osc(&space);
+      s = filter->output.c[n] * space_phasors[n];
       space_accum += s;
       space_offset_accum += s;
 
-      if(++symphase == Samppbit/2){
+      if(++symphase == sp->samppbit/2){
 	// Finish offset integrator and reset
 	mid_val = cnrmf(mark_offset_accum) - cnrmf(space_offset_accum);
 	mark_offset_accum = space_offset_accum = 0;
       }
-      if(symphase < Samppbit)
+      if(symphase < sp->samppbit)
 	continue;
       
       // Finished whole bit
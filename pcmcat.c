@@ -14,6 +14,8 @@
 #include <sys/socket.h>
 #include <netdb.h>
 #include <time.h>
+#include <limits.h>
+#include <math.h>
 
 #include "multicast.h"
 
@@ -21,7 +23,7 @@ struct pcmstream {
   struct pcmstream *prev;       // Linked list pointers
   struct pcmstream *next; 
   uint32_t ssrc;            // RTP Sending Source ID
-  int type;                 // RTP type (10,11,20)
+  int type;                 // RTP type (any PCM type in PT_table)
   
   struct sockaddr sender;
   char addr[NI_MAXHOST];    // RTP Sender IP address
@@ -32,17 +34,18 @@ struct pcmstream {
 
 // Config constants
 int const Bufsize = 2048;
-float const Samprate = 48000;
 
 // Command line params
 char *Mcast_address_text;
 int Quiet;
 int Stereo;   // Force stereo output; otherwise output mono, downmixing if necessary
+int Float;    // Write host-order 32-bit floats; otherwise 16-bit integers
 
 int Input_fd = -1;
 struct pcmstream *Pcmstream;
 int Sessions; // Session count - limit to 1 for now
 uint32_t Ssrc; // Requested SSRC
+int Rcvbuf_size = 0; // Input socket buffer, bytes; 0 = system default
 
 struct pcmstream *lookup_session(const struct sockaddr *sender,const uint32_t ssrc);
 struct pcmstream *make_session(struct sockaddr const *sender,uint32_t ssrc,uint16_t seq,uint32_t timestamp);
@@ -52,8 +55,11 @@ int main(int argc,char *argv[]){
   setlocale(LC_ALL,getenv("LANG"));
 
   int c;
-  while((c = getopt(argc,argv,"qhs:2")) != EOF){
+  while((c = getopt(argc,argv,"fqhs:U:2")) != EOF){
     switch(c){
+    case 'f': // Float output
+      Float++;
+      break;
     case '2': // Force stereo
       Stereo++;
       break;
@@ -63,9 +69,12 @@ int main(int argc,char *argv[]){
     case 's':
       Ssrc = strtol(optarg,NULL,0);
       break;
+    case 'U':
+      Rcvbuf_size = strtol(optarg,NULL,0);
+      break;
     case 'h':
     default:
-      fprintf(stderr,"Usage: %s [-v] [-s ssrc] mcast_address\n",argv[0]);
+      fprintf(stderr,"Usage: %s [-2] [-f] [-q] [-s ssrc] [-U rcvbuf] mcast_address\n",argv[0]);
       fprintf(stderr,"       hex ssrc requires 0x prefix\n");
       exit(1);
     }
@@ -83,23 +92,31 @@ int main(int argc,char *argv[]){
 	    Mcast_address_text);
     exit(1);
   }
+  if(Rcvbuf_size > 0)
+    set_rcvbuf(Input_fd,Rcvbuf_size);
+  struct pktring * const ring = pktring_create(Input_fd,PKTRING_SLOTS,Bufsize,0);
+  if(ring == NULL){
+    fprintf(stderr,"Can't allocate input buffers\n");
+    exit(1);
+  }
 
 
   // audio input thread
   // Receive audio multicasts, multiplex into sessions, send to output
   // What do we do if we get different streams?? think about this
   while(1){
-    struct sockaddr sender;
-    socklen_t socksize = sizeof(sender);
-    unsigned char buffer[Bufsize];
-    int size = recvfrom(Input_fd,buffer,sizeof(buffer),0,&sender,&socksize);
+    unsigned char *buffer;
+    struct sockaddr_storage *ssp;
+    int size = pktring_recv(ring,&buffer,&ssp,NULL);
     if(size == -1){
       if(errno != EINTR){ // Happens routinely
-	perror("recvmsg");
+	perror("recvmmsg");
 	usleep(1000);
       }
       continue;
     }
+    struct sockaddr sender;
+    memcpy(&sender,ssp,sizeof(sender));
     if(size < RTP_MIN_SIZE)
       continue; // Too small to be valid RTP
 
@@ -114,7 +131,8 @@ int main(int argc,char *argv[]){
     if(size <= 0)
       continue;
 
-    if(rtp.type != PCM_STEREO_PT && rtp.type != PCM_MONO_PT)
+    struct pt_table const * const pt = &PT_table[rtp.type];
+    if(pt->samprate == 0)
       continue; // Discard unknown RTP types to avoid polluting session table
 
     struct pcmstream *sp = lookup_session(&sender,rtp.ssrc);
@@ -137,18 +155,11 @@ int main(int argc,char *argv[]){
       if(!Quiet){
 	fprintf(stderr,"New session from 0x%x@%s:%s, type %d",sp->ssrc,sp->addr,sp->port,rtp.type);
 
-	switch(rtp.type){
-	case PCM_STEREO_PT:
-	  fprintf(stderr,", pcm stereo");
-	  if(!Stereo)
-	    fprintf(stderr,", downmixing to mono");
-	  break;
-	case PCM_MONO_PT:
-	  fprintf(stderr,", pcm mono");
-	  if(Stereo)
-	    fprintf(stderr,", expanding to pseudo-stereo");	    
-	  break;
-	}
+	fprintf(stderr,", pcm %s %s %'d Hz",pt->encoding == F32BE ? "float" : "s16",pt->channels == 2 ? "stereo" : "mono",pt->samprate);
+	if(pt->channels == 2 && !Stereo)
+	  fprintf(stderr,", downmixing to mono");
+	else if(pt->channels == 1 && Stereo)
+	  fprintf(stderr,", expanding to pseudo-stereo");
 	fprintf(stderr,"\n");
       }
 
@@ -159,39 +170,27 @@ int main(int argc,char *argv[]){
       continue; // old dupe? What if it's simply out of sequence?
 
     sp->type = rtp.type;
-    int samples = 0;
-
-    signed short *sdp = (signed short *)dp;
-    switch(rtp.type){
-    case PCM_STEREO_PT: // Stereo
-      samples = size / 4;
-      while(samples-- > 0){
-	// Swap sample to host order, cat to stdout
-	signed short left = ntohs(*sdp++);
-	signed short right = ntohs(*sdp++);
-	if(Stereo){
-	  fwrite(&left,sizeof(left),1,stdout);
-	  fwrite(&right,sizeof(right),1,stdout);
-	} else {
-	  // Downmix to mono
-	  signed short samp = (left + right) / 2;
-	  fwrite(&samp,sizeof(samp),1,stdout);
-	}
-      }
-      break;
-    case PCM_MONO_PT: // Mono
-      samples = size / 2;
-      while(samples-- > 0){
-	// Swap sample to host order, cat to stdout
-	signed short d = ntohs(*sdp++);
-	fwrite(&d,sizeof(d),1,stdout);
-	if(Stereo)
-	  fwrite(&d,sizeof(d),1,stdout);   // Force to pseudo-stereo
-      }
-      break;
-    default:
-      samples = 0;
-      break; // ignore
+    float samples[size / 2 + 1]; // Enough for the smallest encoding
+    int const n = pcm_to_float(samples,size / 2,dp,size,rtp.type);
+    int const frames = n / pt->channels;
+    int const outchans = Stereo ? 2 : 1;
+    float fout[frames * outchans];
+    for(int i=0; i < frames; i++){
+      float const left = samples[pt->channels * i];
+      float const right = samples[pt->channels * i + pt->channels - 1]; // Same as left when mono
+      if(Stereo){
+	fout[2*i] = left;
+	fout[2*i+1] = right;
+      } else
+	fout[i] = (left + right) / 2; // Downmix to mono
+    }
+    if(Float){
+      fwrite(fout,sizeof(*fout),frames * outchans,stdout);
+    } else {
+      short out[frames * outchans];
+      for(int i=0; i < frames * outchans; i++)
+	out[i] = fout[i] >= 1 ? SHRT_MAX : fout[i] <= -1 ? SHRT_MIN : lrintf(SHRT_MAX * fout[i]);
+      fwrite(out,sizeof(*out),frames * outchans,stdout);
     }
   }
   exit(0);
@@ -17,6 +17,9 @@
 #include <fftw3.h>
 #undef I
 #include <netinet/in.h>
+#if defined(__SSSE3__)
+#include <immintrin.h>
+#endif
 
 #include "misc.h"
 #include "dsp.h"
@@ -34,13 +37,440 @@
 float const SCALE16 = 1./SHRT_MAX; // Scale signed 16-bit int to float in range -1, +1
 float const SCALE8 = 1./INT8_MAX;       // Scale signed 8-bit int to float in range -1, +1
 
+// Payload unpackers: convert n complex samples from each RTP payload format to scaled complex float,
+// writing them straight into the filter input. Each returns the total energy of what it wrote
+// The vector versions turn every format into 8 little-endian int16s (4 complex samples) with byte shuffles,
+// then widen, convert and scale them together; the scalar loops pick up whatever is left
+#if defined(__SSSE3__)
+#if defined(__AVX2__)
+typedef __m256 eacc;
+static inline eacc eacc_zero(void){
+  return _mm256_setzero_ps();
+}
+static inline float eacc_sum(eacc const a){
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(a),_mm256_extractf128_ps(a,1));
+  s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+  s = _mm_add_ss(s,_mm_shuffle_ps(s,s,1));
+  return _mm_cvtss_f32(s);
+}
+// Widen 8 int16s to float, scale, store and accumulate energy
+static inline eacc widen_store(float * const out,__m128i const v,float const gain,eacc const acc){
+  __m256 const f = _mm256_mul_ps(_mm256_set1_ps(gain),_mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(v)));
+  _mm256_storeu_ps(out,f);
+  return _mm256_add_ps(acc,_mm256_mul_ps(f,f));
+}
+#else
+typedef __m128 eacc;
+static inline eacc eacc_zero(void){
+  return _mm_setzero_ps();
+}
+static inline float eacc_sum(eacc s){
+  s = _mm_add_ps(s,_mm_movehl_ps(s,s));
+  s = _mm_add_ss(s,_mm_shuffle_ps(s,s,1));
+  return _mm_cvtss_f32(s);
+}
+static inline eacc widen_store(float * const out,__m128i const v,float const gain,eacc const acc){
+  __m128 const g = _mm_set1_ps(gain);
+  // Sign-extend by shifting each int16 into the top of a 32-bit lane and back down
+  __m128 const lo = _mm_mul_ps(g,_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(v,v),16)));
+  __m128 const hi = _mm_mul_ps(g,_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(v,v),16)));
+  _mm_storeu_ps(out,lo);
+  _mm_storeu_ps(out+4,hi);
+  return _mm_add_ps(acc,_mm_add_ps(_mm_mul_ps(lo,lo),_mm_mul_ps(hi,hi)));
+}
+#endif
+#endif
+
+// IQ_PT12: two 12-bit signed integers packed big-endian into 3 bytes
+static float unpack_iq12(complex float * restrict out,unsigned char const * restrict dp,int const n,float const gain){
+  int i = 0;
+  float energy = 0;
+#if defined(__SSSE3__)
+  // Gather bytes 1,0 and 2,1 of each 3-byte group into a pair of int16s, then align the 12 bits to the top of each
+  __m128i const shuf = _mm_setr_epi8(1,0,2,1, 4,3,5,4, 7,6,8,7, 10,9,11,10);
+  __m128i const mask_i = _mm_set1_epi32(0x0000fff0);
+  __m128i const mask_q = _mm_set1_epi32(0xffff0000);
+  eacc acc = eacc_zero();
+  for(; i + 6 <= n; i += 4){ // Each load reads 16 bytes but consumes only 12
+    __m128i const v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)dp),shuf);
+    __m128i const w = _mm_or_si128(_mm_and_si128(v,mask_i),_mm_and_si128(_mm_slli_epi16(v,4),mask_q));
+    acc = widen_store((float *)&out[i],w,gain,acc);
+    dp += 12;
+  }
+  energy = eacc_sum(acc);
+#endif
+  for(; i < n; i++){
+    __real__ out[i] = gain * (short)(((dp[0] << 8) | dp[1]) & 0xfff0);
+    __imag__ out[i] = gain * (short)(((dp[1] << 8) | dp[2]) << 4);
+    energy += cnrmf(out[i]);
+    dp += 3;
+  }
+  return energy;
+}
+
+// PCM_STEREO_PT: two 16-bit signed integers, **BIG ENDIAN** (network order)
+static float unpack_be16(complex float * restrict out,unsigned char const * restrict dp,int const n,float const gain){
+  int i = 0;
+  float energy = 0;
+#if defined(__SSSE3__)
+  __m128i const swap = _mm_setr_epi8(1,0, 3,2, 5,4, 7,6, 9,8, 11,10, 13,12, 15,14);
+  eacc acc = eacc_zero();
+  for(; i + 4 <= n; i += 4){
+    __m128i const v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const *)dp),swap);
+    acc = widen_store((float *)&out[i],v,gain,acc);
+    dp += 16;
+  }
+  energy = eacc_sum(acc);
+#endif
+  signed short const *sp = (signed short const *)dp;
+  for(; i < n; i++){
+    // ntohs() returns UNSIGNED so the cast is necessary!
+    __real__ out[i] = gain * (signed short)ntohs(*sp++);
+    __imag__ out[i] = gain * (signed short)ntohs(*sp++);
+    energy += cnrmf(out[i]);
+  }
+  return energy;
+}
+
+// IQ_PT: two 16-bit signed integers LITTLE ENDIAN
+static float unpack_le16(complex float * restrict out,unsigned char const * restrict dp,int const n,float const gain){
+  int i = 0;
+  float energy = 0;
+#if defined(__SSSE3__)
+  eacc acc = eacc_zero();
+  for(; i + 4 <= n; i += 4){
+    acc = widen_store((float *)&out[i],_mm_loadu_si128((__m128i const *)dp),gain,acc);
+    dp += 16;
+  }
+  energy = eacc_sum(acc);
+#endif
+  signed short const *sp = (signed short const *)dp;
+  for(; i < n; i++){
+    __real__ out[i] = gain * *sp++;
+    __imag__ out[i] = gain * *sp++;
+    energy += cnrmf(out[i]);
+  }
+  return energy;
+}
+
+// IQ_PT8: two signed 8-bit integers
+static float unpack_s8(complex float * restrict out,unsigned char const * restrict dp,int const n,float const gain){
+  int i = 0;
+  float energy = 0;
+#if defined(__SSSE3__)
+  eacc acc = eacc_zero();
+  for(; i + 4 <= n; i += 4){
+    __m128i const v = _mm_loadl_epi64((__m128i const *)dp);
+    // Sign-extend bytes to int16s; the 8-bit gain already accounts for the scale
+    acc = widen_store((float *)&out[i],_mm_srai_epi16(_mm_unpacklo_epi8(v,v),8),gain,acc);
+    dp += 8;
+  }
+  energy = eacc_sum(acc);
+#endif
+  for(; i < n; i++){
+    __real__ out[i] = gain * (signed char)*dp++;
+    __imag__ out[i] = gain * (signed char)*dp++;
+    energy += cnrmf(out[i]);
+  }
+  return energy;
+}
+
+// Small RTP reorder window on the I/Q input
+// An in-order packet is released straight from the receive ring without copying;
+// one arriving ahead of a gap is copied into a slot and held until the gap fills, or until
+// a packet more than 'window' sequence numbers ahead shows up. Only then is the missing
+// packet given up and zero-filled (by rtp_process() seeing the jump). Packets arriving
+// after that are counted as late and discarded, since their place in the stream is gone
+// Sequence numbers are extended to 64 bits so slot indices don't jump when the 16-bit
+// RTP sequence wraps, which they would for any window that doesn't divide 65536
+#define REORDER_RESYNC 1000 // A sequence jump this big either way is a restarted sender
+
+struct reorder {
+  int window;            // Max packets held; 0 disables reordering
+  bool init;
+  uint32_t ssrc;
+  uint64_t next;         // Next sequence number to release, extended
+  uint32_t timestamp;    // RTP timestamp of the last packet released
+  int held;              // Occupied slots
+  struct packet *slots;  // 'window' entries, indexed by extended sequence number % window; len == 0 when free
+  struct packet *last;   // Slot most recently released, freed on the next call
+  bool pending;          // 'arrival' not yet released or held
+  struct packet arrival; // Newest packet; data still points into the receive ring
+};
+
+// Start over at this packet; anything held belongs to the old stream
+static void reorder_sync(struct reorder *ro,struct rtp_header const *rtp){
+  for(int i=0; i < ro->window; i++)
+    ro->slots[i].len = 0;
+  ro->held = 0;
+  ro->last = NULL;
+  ro->next = rtp->seq;
+  ro->timestamp = rtp->timestamp;
+  ro->ssrc = rtp->ssrc;
+  ro->init = true;
+}
+
+// Offer a newly received packet. Follow with calls to reorder_get() until it returns NULL
+static void reorder_put(struct demod *demod,struct reorder *ro,struct rtp_header const *rtp,unsigned char *data,int len){
+  if(!ro->init || rtp->ssrc != ro->ssrc)
+    reorder_sync(ro,rtp);
+
+  int ahead = (int16_t)(rtp->seq - (uint16_t)ro->next);
+  // A genuinely late or early packet has its timestamp on the same side of the last one
+  // released as its sequence number. If they disagree, or the jump is huge, the sender
+  // restarted with the same SSRC and a new random sequence number
+  int32_t const dt = (int32_t)(rtp->timestamp - ro->timestamp);
+  if((ahead < 0 && dt > 0) || (ahead > ro->window && dt < 0) || abs(ahead) > REORDER_RESYNC){
+    reorder_sync(ro,rtp);
+    ahead = 0;
+  }
+  if(ahead < 0){
+    pthread_mutex_lock(&demod->sdr.status_mutex);
+    demod->input.late++; // Already given up on, or a duplicate of one released
+    pthread_mutex_unlock(&demod->sdr.status_mutex);
+    return;
+  }
+  if(ahead > 0 && ahead <= ro->window){
+    struct packet const *p = &ro->slots[(ro->next + ahead) % ro->window];
+    if(p->len > 0 && p->rtp.seq == rtp->seq){
+      pthread_mutex_lock(&demod->sdr.status_mutex);
+      demod->input.rtp.dupes++;
+      pthread_mutex_unlock(&demod->sdr.status_mutex);
+      return;
+    }
+  }
+  ro->arrival.rtp = *rtp;
+  ro->arrival.data = data;
+  ro->arrival.len = len;
+  ro->pending = true;
+}
+
+// Return the next packet in sequence, or NULL if we have to wait for one
+// The returned packet is valid only until the next call
+static struct packet *reorder_get(struct reorder *ro){
+  if(ro->last != NULL){
+    ro->last->len = 0;
+    ro->last = NULL;
+  }
+  while(1){
+    if(ro->pending && ro->arrival.rtp.seq == (uint16_t)ro->next){
+      ro->pending = false;
+      ro->next++;
+      ro->timestamp = ro->arrival.rtp.timestamp;
+      return &ro->arrival;
+    }
+    if(ro->held > 0){
+      struct packet * const p = &ro->slots[ro->next % ro->window];
+      if(p->len > 0 && p->rtp.seq == (uint16_t)ro->next){
+	ro->held--;
+	ro->next++;
+	ro->timestamp = p->rtp.timestamp;
+	ro->last = p;
+	return p;
+      }
+    }
+    if(!ro->pending)
+      return NULL;
+
+    int const ahead = (int16_t)(ro->arrival.rtp.seq - (uint16_t)ro->next);
+    if(ahead > ro->window){
+      // Window expired; give up on the missing packet and move on
+      // With nothing held, skip the whole gap at once
+      if(ro->held == 0)
+	ro->next += ahead;
+      else
+	ro->next++;
+      continue;
+    }
+    // Ahead of a gap but within the window; copy out of the receive ring and hold it
+    struct packet * const p = &ro->slots[(ro->next + ahead) % ro->window];
+    p->rtp = ro->arrival.rtp;
+    memcpy(p->content,ro->arrival.data,ro->arrival.len);
+    p->data = p->content;
+    p->len = ro->arrival.len;
+    ro->held++;
+    ro->pending = false;
+    return NULL;
+  }
+}
+
+// Forward FFT of a full input block, tagged for slaves in other processes when the bus is shared
+static void run_filter_input(struct filter_in * const in,double const samprate,double const frequency,long long const timestamp){
+  in->samprate = samprate;
+  in->frequency = frequency;
+  in->timestamp = timestamp;
+  execute_filter_input(in);
+}
+
+// Pipelined input
+// Unless demod->input.pipeline is 0, receiving and converting samples runs on one thread and
+// the forward FFT on another, connected by a ring of that many sample blocks. The converter fills
+// one block while the FFT thread works on an earlier one, so an FFT that runs long delays only
+// the FFT thread instead of backing up the socket. Each side sleeps only when the ring is
+// empty (FFT thread) or full (converter). Where the filter's input window is double mapped,
+// it's enlarged to hold the whole ring and the converter writes into it, so nothing is copied
+struct sample_block {
+  double samprate;        // Metadata captured when the block was completed
+  double frequency;
+  long long timestamp;
+  complex float *samples; // L samples
+};
+struct block_ring {
+  struct demod *demod;
+  unsigned int size;      // Blocks in ring
+  unsigned int head;      // Blocks completed; written only by the converter
+  unsigned int tail;      // Blocks transformed; written only by the FFT thread
+  unsigned int waiters;   // Threads asleep on head or tail
+  bool direct;            // Blocks are the filter's own input window; nothing to copy
+  complex float *next;    // Where the converter fills the head block, when direct
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  struct sample_block *blocks;
+};
+
+// Sleep until *index changes from value
+static void block_wait(struct block_ring * const ring,unsigned int const * const index,unsigned int const value){
+  pthread_mutex_lock(&ring->mutex);
+  __atomic_add_fetch(&ring->waiters,1,__ATOMIC_SEQ_CST);
+  while(__atomic_load_n(index,__ATOMIC_SEQ_CST) == value)
+    pthread_cond_wait(&ring->cond,&ring->mutex);
+  __atomic_sub_fetch(&ring->waiters,1,__ATOMIC_SEQ_CST);
+  pthread_mutex_unlock(&ring->mutex);
+}
+// Bump our index, waking the other side only if it's asleep
+static void block_advance(struct block_ring * const ring,unsigned int * const index){
+  __atomic_add_fetch(index,1,__ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&ring->waiters,__ATOMIC_SEQ_CST) != 0){
+    pthread_mutex_lock(&ring->mutex);
+    pthread_cond_broadcast(&ring->cond);
+    pthread_mutex_unlock(&ring->mutex);
+  }
+}
+
+// Pin the calling thread to one core; cpu < 0 leaves it to the scheduler
+static void pin_thread(int const cpu){
+  if(cpu < 0)
+    return;
+#if defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu,&set);
+  int const r = pthread_setaffinity_np(pthread_self(),sizeof(set),&set);
+  if(r != 0)
+    fprintf(stderr,"Can't pin thread to CPU %d: %s\n",cpu,strerror(r));
+#else
+  fprintf(stderr,"CPU pinning not supported; ignoring CPU %d\n",cpu);
+#endif
+}
+
+// FFT stage of the pipeline
+static void *fft_stage(void *arg){
+  struct block_ring * const ring = (struct block_ring *)arg;
+  struct demod * const demod = ring->demod;
+  pthread_setname("procfft");
+  pin_thread(demod->input.fft_cpu);
+
+  struct filter_in * const in = demod->filter.in;
+  while(1){
+    unsigned int const tail = ring->tail;
+    while(__atomic_load_n(&ring->head,__ATOMIC_SEQ_CST) == tail)
+      block_wait(ring,&ring->head,tail);
+
+    struct sample_block const b = ring->blocks[tail % ring->size];
+    if(ring->direct){
+      // Already in place in the window; free only once it's transformed
+      run_filter_input(in,b.samprate,b.frequency,b.timestamp);
+      block_advance(ring,&ring->tail);
+      continue;
+    }
+    memcpy(in->input.c,b.samples,in->ilen * sizeof(*in->input.c));
+    block_advance(ring,&ring->tail); // Block is free again as soon as it's copied
+    run_filter_input(in,b.samprate,b.frequency,b.timestamp);
+  }
+  return NULL;
+}
+
+static struct block_ring *create_block_ring(struct demod * const demod,unsigned int const size){
+  struct block_ring * const ring = calloc(1,sizeof(*ring));
+  assert(ring != NULL);
+  ring->demod = demod;
+  ring->size = size;
+  pthread_mutex_init(&ring->mutex,NULL);
+  pthread_cond_init(&ring->cond,NULL);
+  ring->blocks = calloc(size,sizeof(*ring->blocks));
+  assert(ring->blocks != NULL);
+  // With a double-mapped input window, the converter writes each block straight into it
+  ring->direct = set_filter_input_depth(demod->filter.in,size);
+  if(ring->direct){
+    ring->next = next_filter_input(demod->filter.in).c;
+    return ring;
+  }
+  for(unsigned int i=0; i < size; i++){
+    ring->blocks[i].samples = fftwf_alloc_complex(demod->filter.in->ilen);
+    assert(ring->blocks[i].samples != NULL);
+  }
+  return ring;
+}
+
+// Where the converter puts the block it's filling: straight into the filter input
+// when there's no pipeline or the pipeline runs ahead in the input window itself,
+// otherwise into the next free block of the ring
+static inline complex float *input_block(struct demod const * const demod,struct block_ring const * const ring){
+  if(ring == NULL)
+    return demod->filter.in->input.c;
+  if(ring->direct)
+    return ring->next;
+  return ring->blocks[ring->head % ring->size].samples;
+}
+
+// The converter has filled a block; transform it now or hand it to the FFT thread
+static void end_block(struct demod * const demod,struct block_ring * const ring,long long * const block_start){
+  double const samprate = demod->input.samprate;
+  double const frequency = get_first_LO(demod);
+  long long const timestamp = *block_start;
+  *block_start += demod->filter.in->ilen;
+  if(ring == NULL){
+    run_filter_input(demod->filter.in,samprate,frequency,timestamp);
+    return;
+  }
+  struct sample_block * const b = &ring->blocks[ring->head % ring->size];
+  b->samprate = samprate;
+  b->frequency = frequency;
+  b->timestamp = timestamp;
+  block_advance(ring,&ring->head);
+  if(ring->direct)
+    ring->next = next_filter_input(demod->filter.in).c;
+
+  // Don't start on the next block until it's free; meanwhile the socket buffer absorbs the input
+  unsigned int tail;
+  while(ring->head - (tail = __atomic_load_n(&ring->tail,__ATOMIC_SEQ_CST)) >= ring->size)
+    block_wait(ring,&ring->tail,tail);
+}
+
 void *proc_samples(void *arg){
   assert(arg);
   pthread_setname("procsamp");
 
   struct demod *demod = (struct demod *)arg;
+  pin_thread(demod->input.input_cpu);
+  struct block_ring *pipeline = NULL;
+  if(demod->input.pipeline > 0){
+    pipeline = create_block_ring(demod,demod->input.pipeline);
+    pthread_t fft_thread;
+    pthread_create(&fft_thread,NULL,fft_stage,pipeline);
+  }
   float block_energy = 0;
   int in_cnt = 0;
+  long long block_start = 0; // Input sample number of the first sample in the current block
+  struct pktring * const ring = pktring_create(demod->input.data_fd,PKTRING_SLOTS,PKTSIZE,0);
+  assert(ring != NULL);
+  struct reorder * const reorder = calloc(1,sizeof(*reorder));
+  assert(reorder != NULL);
+  reorder->window = demod->input.reorder_window;
+  if(reorder->window > 0){
+    reorder->slots = calloc(reorder->window,sizeof(*reorder->slots));
+    assert(reorder->slots != NULL);
+  }
 
   while(1){
     // Packet consists of Ethernet, IP and UDP header (already stripped)
@@ -53,155 +483,147 @@ void *proc_samples(void *arg){
     // Receive I/Q data from front end
     // Incoming RTP packets
 
-    struct packet pkt;
-
-    socklen_t socksize = sizeof(demod->input.data_source_address);
-    int size = recvfrom(demod->input.data_fd,pkt.content,sizeof(pkt.content),0,(struct sockaddr *)&demod->input.data_source_address,&socksize);
-    if(size <= 0){    // ??
-      perror("recvfrom");
+    unsigned char *buffer;
+    struct sockaddr_storage *sender;
+    int len = pktring_recv(ring,&buffer,&sender,NULL);
+    if(len <= 0){    // ??
+      perror("recvmmsg");
       usleep(50000);
       continue;
     }
-    if(size < RTP_MIN_SIZE)
+    if(len < RTP_MIN_SIZE)
       continue; // Too small for RTP, ignore
+    // update_channels() copies demod->input into every channel, so change it only under the status mutex
+    pthread_mutex_lock(&demod->sdr.status_mutex);
+    memcpy(&demod->input.data_source_address,sender,sizeof(demod->input.data_source_address));
+    pthread_mutex_unlock(&demod->sdr.status_mutex);
 
-    unsigned char *dp = ntoh_rtp(&pkt.rtp,pkt.content);
-    size -= (dp - pkt.content);
+    struct rtp_header hdr;
+    unsigned char *payload = ntoh_rtp(&hdr,buffer);
+    len -= (payload - buffer);
     
-    if(pkt.rtp.pad){
+    if(hdr.pad){
       // Remove padding
-      size -= dp[size-1];
-      pkt.rtp.pad = 0;
+      len -= payload[len-1];
+      hdr.pad = 0;
     }
-    if(size <= 0)
+    if(len <= 0)
       continue; // Bogus RTP header?
-    int sampcount;
-
-    switch(pkt.rtp.type){
-    case IQ_PT: // Little-endian 16 bit ints with old metadata header
-      dp += 24;
-      size -= 24;
-      if(size <= 0)
-	continue; // bogus
-      sampcount = size / (2 * sizeof(signed short));
-      break;
-    case IQ_PT8: // 8-bit ints no metadata
-      sampcount = size / (2 * sizeof(signed char));
-      break;
-    case PCM_STEREO_PT: // Big-endian 16 bits, no metadata header
-      sampcount = size / (2 * sizeof(signed short));
-      break;
-    case IQ_PT12:       // Big endian packed 12 bits, no metadata
-      sampcount = size / 3;
-      break;
-    default:
-      continue; // Unsupported type; ignore
-    }
-    pkt.data = dp;
-    pkt.len = size;
 
-    if(pkt.rtp.ssrc != demod->input.rtp.ssrc){
-      // SSRC changed; reset sample count.
-      // rtp_process will reset packet count
-      demod->input.samples = 0;
-    }
-    int time_step = rtp_process(&demod->input.rtp,&pkt.rtp,sampcount);
-    if(time_step < 0 || time_step > 192000){
-      // Old samples, or too big a jump; drop. Shouldn't happen if sequence number isn't old
-      continue;
-    } else if(time_step > 0){
-      // Samples were lost. Inject enough zeroes to keep the sample count and LO phase correct
-      // Arbitrary 1 sec limit just to keep things from blowing up
-      // Good enough for the occasional lost packet or two
-      // Note: we don't use marker bits since we don't suppress silence
-      demod->input.samples += time_step;
-      for(int i=0;i < time_step; i++){
-	demod->filter.in->input.c[in_cnt++] = 0;
-	// Keep the LOs running
-	(void) step_osc(&demod->second_LO);
-	(void) step_osc(&demod->doppler);
+    // Release whatever is now in sequence
+    reorder_put(demod,reorder,&hdr,payload,len);
+    struct packet *pkt;
+    while((pkt = reorder_get(reorder)) != NULL){
+      struct rtp_header * const rtp = &pkt->rtp;
+      unsigned char *dp = pkt->data;
+      int size = pkt->len;
+      int sampcount;
 
-	if(in_cnt == demod->filter.in->ilen){
-	  // Run filter but freeze everything else?
-	  demod->filter.out->out_type = demod->filter.isb ? CROSS_CONJ : COMPLEX;
-	  execute_filter_input(demod->filter.in);
-	  in_cnt = 0;
-	}
+      switch(rtp->type){
+      case IQ_PT: // Little-endian 16 bit ints with old metadata header
+	dp += 24;
+	size -= 24;
+	if(size <= 0)
+	  continue; // bogus
+	sampcount = size / (2 * sizeof(signed short));
+	break;
+      case IQ_PT8: // 8-bit ints no metadata
+	sampcount = size / (2 * sizeof(signed char));
+	break;
+      case PCM_STEREO_PT: // Big-endian 16 bits, no metadata header
+	sampcount = size / (2 * sizeof(signed short));
+	break;
+      case IQ_PT12:       // Big endian packed 12 bits, no metadata
+	sampcount = size / 3;
+	break;
+      default:
+	continue; // Unsupported type; ignore
       }
-    }
-    // Convert and scale samples to internal float-32 format
-    demod->input.samples += sampcount;
-    complex float sampbuf[sampcount];
-
-    switch(pkt.rtp.type){
-    default: // shuts up lint
-    case IQ_PT12:      // two 12-bit signed integers packed big-endian into 3 bytes
-      {
-	float gain = SCALE16 * demod->sdr.gain_factor;
-	for(int i=0; i<sampcount; i++){
-	  __real__ sampbuf[i] = gain * (short)(((dp[0] << 8) | dp[1]) & 0xfff0);
-	  __imag__ sampbuf[i] = gain * (short)(((dp[1] << 8) | dp[2]) << 4);
-	  dp += 3;
-	}
+
+      pthread_mutex_lock(&demod->sdr.status_mutex);
+      if(rtp->ssrc != demod->input.rtp.ssrc){
+	// SSRC changed; reset sample count.
+	// rtp_process will reset packet count
+	demod->input.samples = 0;
       }
-      break;
-    case PCM_STEREO_PT:      // Two 16-bit signed integers, **BIG ENDIAN** (network order)
-      {
-	signed short *sp = (signed short *)dp;
-	float gain = SCALE16 * demod->sdr.gain_factor;
-	for(int i=0; i<sampcount; i++){
-	  // ntohs() returns UNSIGNED so the cast is necessary!
-	  __real__ sampbuf[i] = gain * (signed short)ntohs(*sp++);
-	  __imag__ sampbuf[i] = gain * (signed short)ntohs(*sp++);
+      int time_step = rtp_process(&demod->input.rtp,rtp,sampcount);
+      if(time_step >= 0 && time_step <= 192000)
+	demod->input.samples += time_step + sampcount; // Zeroes for any lost, then this packet
+      pthread_mutex_unlock(&demod->sdr.status_mutex);
+      if(time_step < 0 || time_step > 192000){
+	// Old samples, or too big a jump; drop. Shouldn't happen if sequence number isn't old
+	continue;
+      } else if(time_step > 0){
+	// Samples were lost. Inject enough zeroes to keep the sample count and LO phase correct
+	// Arbitrary 1 sec limit just to keep things from blowing up
+	// Good enough for the occasional lost packet or two
+	// Note: we don't use marker bits since we don't suppress silence
+	while(time_step > 0){
+	  int const chunk = min(time_step,(int)demod->filter.in->ilen - in_cnt);
+	  memset(input_block(demod,pipeline) + in_cnt,0,chunk * sizeof(complex float));
+	  // Keep the Doppler oscillator running
+	  skip_osc(&demod->doppler,chunk);
+	  time_step -= chunk;
+	  in_cnt += chunk;
+	  if(in_cnt == demod->filter.in->ilen){
+	    // Run filter but freeze everything else?
+	    end_block(demod,pipeline,&block_start);
+	    in_cnt = 0;
+	  }
 	}
       }
-      break;
-    case IQ_PT:      // Two 16-bit signed integers LITTLE ENDIAN
-      {
-	signed short *sp = (signed short *)dp;
-	float gain = SCALE16 * demod->sdr.gain_factor;
-	for(int i=0; i<sampcount; i++){
-	  __real__ sampbuf[i] = gain * *sp++;
-	  __imag__ sampbuf[i] = gain * *sp++;
-	}
+      // Convert and scale samples to internal float-32 format directly into the filter input,
+      // splitting the packet wherever it crosses a block boundary
+      float const gain = (rtp->type == IQ_PT8 ? SCALE8 : SCALE16) * demod->sdr.gain_factor;
+      int bytes_per_sample;
+      switch(rtp->type){
+      case IQ_PT12:
+	bytes_per_sample = 3;
+	break;
+      case IQ_PT8:
+	bytes_per_sample = 2;
+	break;
+      default:
+	bytes_per_sample = 4;
+	break;
       }
-      break;
-    case IQ_PT8:      // Two signed 8-bit integers
-      {
-	float gain = SCALE8 * demod->sdr.gain_factor;
-	for(int i=0; i<sampcount; i++){
-	  __real__ sampbuf[i] = gain * (char)*dp++;
-	  __imag__ sampbuf[i] = gain * (char)*dp++;
+      while(sampcount > 0){
+	int const chunk = min(sampcount,(int)demod->filter.in->ilen - in_cnt);
+	complex float * const buf = input_block(demod,pipeline) + in_cnt;
+
+	switch(rtp->type){
+	default: // shuts up lint
+	case IQ_PT12:
+	  block_energy += unpack_iq12(buf,dp,chunk,gain);
+	  break;
+	case PCM_STEREO_PT:
+	  block_energy += unpack_be16(buf,dp,chunk,gain);
+	  break;
+	case IQ_PT:
+	  block_energy += unpack_le16(buf,dp,chunk,gain);
+	  break;
+	case IQ_PT8:
+	  block_energy += unpack_s8(buf,dp,chunk,gain);
+	  break;
 	}
-      }
-      break;
-    }
-    // Apply Doppler if active
-    if(demod->doppler.freq != 0){
-      for(int i=0; i < sampcount; i++){
-	sampbuf[i] *= step_osc(&demod->doppler);
-      }
-    }
+	dp += chunk * bytes_per_sample;
+	sampcount -= chunk;
+	in_cnt += chunk;
+
+	// Apply Doppler if active
+	// The second LO is applied in the frequency domain by each channel's filter
+	if(demod->doppler.freq != 0)
+	  mix_osc(&demod->doppler,buf,chunk);
 
-    for(int i=0; i < sampcount; i++){
-      complex float samp = sampbuf[i] * step_osc(&demod->second_LO);      // Mix down
-      block_energy += cnrmf(samp);
-
-      // Accumulate in filter input buffer
-      demod->filter.in->input.c[in_cnt++] = samp;
-      if(in_cnt == demod->filter.in->ilen){
-	// Filter buffer is full, execute it
-	demod->filter.out->out_type = demod->filter.isb ? CROSS_CONJ : COMPLEX;
-	execute_filter_input(demod->filter.in);
-	// Compute IF power and noise spectral density
-	demod->sig.if_power = block_energy / in_cnt;
-	block_energy = in_cnt = 0;
-	if(!isnan(demod->sig.n0))
-	  demod->sig.n0 += .005 * (compute_n0(demod) - demod->sig.n0);
-	else
-	  demod->sig.n0 = compute_n0(demod); // Happens at startup
-      } // Every FFT block
-    } // for each sample in I/Q packet
+	if(in_cnt == demod->filter.in->ilen){
+	  // Filter buffer is full, execute it
+	  end_block(demod,pipeline,&block_start);
+	  // Compute IF power; the noise floor is estimated by its own thread
+	  demod->sig.if_power = block_energy / in_cnt;
+	  block_energy = in_cnt = 0;
+	} // Every FFT block
+      } // for each block-sized piece of I/Q packet
+    } // for each packet released in sequence
   } // end of main loop
 }
 
@@ -259,6 +681,15 @@ double set_freq(struct demod * const demod,double const f,double new_lo2){
   assert(!isnan(f));
   assert(f != 0);
 
+  if(demod->dynamic){
+    // Channels sharing a front end can't retune it; stay within its passband
+    new_lo2 = -(f - get_first_LO(demod));
+    if(!LO2_in_range(demod,new_lo2,0))
+      return NAN;
+    demod->tune.freq = f;
+    set_second_LO(demod,new_lo2);
+    return f;
+  }
   demod->tune.freq = f;
 
   // No alias checking on explicitly provided lo2
@@ -337,26 +768,124 @@ int LO2_in_range(struct demod * const demod,double const f,int const avoid_alias
 
 // The next two frequency setting functions depend on the sample rate
 
+// REAL filter output can't be mixed after the inverse FFT, so both the second LO and the
+// post-detection shift are done by rotating the spectrum, to the nearest whole bin.
+// A bin is samprate/N, 25 Hz with the default 20 ms blocks, so the nearest one is up to half a bin off.
+// SSB voice mistuned by less than about 10 Hz still sounds natural, and a CW note moves as little,
+// so REAL output is used when the nearest bin is within REAL_TUNE_TOLERANCE: 80% of tunings
+// with 25 Hz bins, all of them with 20 Hz or finer. Otherwise output_type() picks COMPLEX, which fine_tune() tunes exactly
+#define REAL_TUNE_TOLERANCE 10.0 // Hz
+
+// Work out the rotations and residual for the current second LO, shift and sample rate,
+// and hand them to the demodulator threads all at once
+static void update_tuning(struct demod * const demod){
+  struct tuning t = {0};
+  if(demod->input.samprate != 0 && demod->filter.in != NULL){
+    struct filter_in const * const f = demod->filter.in;
+    int const N = f->ilen + f->impulse_length - 1;
+    double const samprate = demod->input.samprate;
+    t.rotate = lrint(-demod->tune.second_LO * N / samprate);
+    t.residual = demod->tune.second_LO + (double)t.rotate * samprate / N;
+
+    double const freq = demod->tune.second_LO + demod->tune.shift;
+    t.real_rotate = lrint(-freq * N / samprate);
+    t.real_exact = fabs(freq + (double)t.real_rotate * samprate / N) <= REAL_TUNE_TOLERANCE;
+  }
+  pthread_mutex_lock(&demod->sdr.status_mutex);
+  demod->tuning = t;
+  pthread_mutex_unlock(&demod->sdr.status_mutex);
+}
+
+// Tuning for the next block, consistent with itself even if a retune is under way
+struct tuning get_tuning(struct demod * const demod){
+  assert(demod != NULL);
+  pthread_mutex_lock(&demod->sdr.status_mutex);
+  struct tuning const t = demod->tuning;
+  pthread_mutex_unlock(&demod->sdr.status_mutex);
+  return t;
+}
+
 // Set second local oscillator (the one in software)
 // the caller must avoid aliasing, e.g., with LO2_in_range()
+// It's split into a rotation of the spectrum by a whole number of FFT bins, done by execute_filter_output(),
+// and a residual of less than half a bin applied by fine_tune() at the output sample rate
+// so no channel needs a mixer running at the input sample rate
 double set_second_LO(struct demod * const demod,double const second_LO){
   assert(demod != NULL);
   if(demod == NULL)
     return NAN;
 
-  // In case sample rate isn't set yet, just remember the frequency but don't divide by zero
+  // In case sample rate isn't set yet, just remember the frequency; update_tuning() won't divide by zero
   demod->tune.second_LO = second_LO;
-  if(demod->input.samprate != 0)
-    set_osc(&demod->second_LO,second_LO/demod->input.samprate, 0.0);
+  update_tuning(demod);
   return second_LO;
 }
 
+// New front end sample rate
+void set_input_samprate(struct demod * const demod,int const samprate){
+  assert(demod != NULL && samprate != 0);
+  if(demod == NULL || samprate == 0)
+    return;
+
+  demod->input.samprate = samprate;
+  // Oscillator and filter frequencies are fractions of the sample rate
+  set_second_LO(demod,demod->tune.second_LO);
+  set_osc(&demod->doppler,demod->tune.doppler/samprate,demod->tune.doppler_rate/((double)samprate*samprate));
+  demod->sdr.min_IF = -samprate/2; // in case they're not set explicitly
+  demod->sdr.max_IF = +samprate/2;
+
+  demod->filter.decimate = demod->input.samprate / demod->output.samprate;
+  if(demod->filter.out){
+    // this probably doesn't actually change
+    set_filter(demod->filter.out,
+	       demod->filter.low/demod->output.samprate,
+	       demod->filter.high/demod->output.samprate,
+	       demod->filter.kaiser_beta);
+  }
+}
+
+// With --fbus-in, proc_samples() runs in the producing process, not here, so take the sample rate,
+// front end frequency and sample count from the latest block on its bus
+// Called by the status thread, which owns sdr.status, like decode_sdr_status()
+void follow_filter_input(struct demod * const demod){
+  struct filter_in const * const in = demod->filter.in;
+  struct fbus_slot meta;
+  if(in == NULL || !in->attached || !latest_filter_metadata(in,&meta) || meta.samprate <= 0)
+    return;
+
+  int const samprate = lrint(meta.samprate);
+  if(samprate != demod->input.samprate)
+    set_input_samprate(demod,samprate);
+  if(!isnan(meta.frequency) && meta.frequency != demod->sdr.status.frequency){
+    // Recalculate LO2
+    demod->sdr.status.frequency = meta.frequency;
+    set_second_LO(demod,-(demod->tune.freq - get_first_LO(demod)));
+  }
+  pthread_mutex_lock(&demod->sdr.status_mutex);
+  demod->input.samples = meta.timestamp + in->ilen;
+  pthread_mutex_unlock(&demod->sdr.status_mutex);
+}
+
+// Apply the tuning residual to a block of filter output, called by the demodulator threads
+// 'freq' (Hz) is the residual from get_tuning(), plus any shift the demodulator folds into the same mixer
+void fine_tune(struct demod * const demod,complex float * const buf,int const n,double const freq){
+  assert(demod != NULL);
+  if(demod->output.samprate == 0)
+    return;
+
+  double const f = freq / demod->output.samprate;
+  if(f != demod->fine.freq || !is_phasor_init(demod->fine.phasor))
+    set_osc(&demod->fine,f,0.0);
+  mix_osc(&demod->fine,buf,n);
+}
+
 // Set audio frequency shift after downconversion and detection (linear modes only: SSB, IQ, DSB)
 double set_shift(struct demod * const demod,double const shift){
   assert(demod != NULL);
   demod->tune.shift = shift;
   if(demod->output.samprate != 0)
     set_osc(&demod->shift,shift / (double)demod->output.samprate, 0.0);
+  update_tuning(demod);
   return shift;
 }
 
@@ -365,6 +894,17 @@ double get_shift(struct demod * const demod){
   return demod->tune.shift;
 }
 
+// Hold the filter edges within the output Nyquist limit, e.g., the default
+// FM edges of +/-8 kHz at an 8 or 12 kHz output sample rate
+void limit_filter_edges(struct demod * const demod){
+  assert(demod != NULL);
+  if(demod->output.samprate == 0)
+    return;
+  float const nyquist = demod->output.samprate / 2.0f;
+  demod->filter.low = max(-nyquist,min(nyquist,demod->filter.low));
+  demod->filter.high = max(-nyquist,min(nyquist,demod->filter.high));
+}
+
 // Load mode table entry presets
 int preset_mode(struct demod * const demod,const char * const mode){
   assert(demod != NULL);
@@ -405,6 +945,7 @@ int preset_mode(struct demod * const demod,const char * const mode){
     pthread_mutex_unlock(&demod->demod_mutex);
   }
   set_shift(demod,demod->tune.shift);
+  limit_filter_edges(demod);
   set_filter(demod->filter.out,
 	     demod->filter.low/demod->output.samprate,
 	     demod->filter.high/demod->output.samprate,
@@ -414,52 +955,339 @@ int preset_mode(struct demod * const demod,const char * const mode){
 
 
 
-// Compute noise spectral density - experimental, my algorithm
-// The problem is telling signal from noise
-// Heuristic: first average all bins outside the bandwidth
-// Then recompute the average, tossing bins > 3 dB above the previous average
-// Hopefully this will get rid of any signals from the noise estimate
-float const compute_n0(struct demod const * const demod){
+// Cheapest filter output type that serves a mode
+// ISB is COMPLEX, split into sidebands by the demodulator after fine tuning. Mono linear modes
+// without a PLL or envelope detector use only I, which the c2r inverse FFT of REAL output gives
+// for half the work, provided the channel is tuned to a whole bin ('exact') since REAL output can't be fine tuned
+enum filtertype output_type(enum demod_type const type,int const channels,bool const isb,bool const pll,bool const env,bool const exact){
+  if(type == LINEAR_DEMOD && channels == 1 && !isb && !pll && !env && exact)
+    return REAL;
+  return COMPLEX;
+}
+
+// Start demodulator threads; each waits until its type is selected
+int start_demod(struct demod * const demod){
   assert(demod != NULL);
-  if(demod == NULL || demod->filter.in == NULL)
-    return NAN;
-  
-  struct filter_in const *f = demod->filter.in;
-  int const N = f->ilen + f->impulse_length - 1;
-
-  int low_n = (N * demod->filter.low) / demod->input.samprate;
-  int high_n = (N * demod->filter.high) / demod->input.samprate;
-  int bincount = N - (high_n - low_n);
-  if(bincount < 0 || bincount > N){
-    return 0; // Can this happen?
-  }
-  // Compute smoothed power spectrum
-  // There will be some spectral leakage because the convolution FFT we're using is unwindowed
-  // Includes both real and imaginary components
-  float power_spectrum[bincount];
-  int in = high_n + 1;
-  for(int n=0; n < bincount; n++){ // modulo operation without division
-    if(in >= N)
-      in -= N;
-    else if(in < 0)
-      in += N;
-    power_spectrum[n] = cnrmf(f->fdomain[in++]);
-  }
-  // compute average energy outside passband, then iterate computing a new average that
-  // omits bins > 3dB above the previous average. This should pick up only the noise
-  float avg_n = INFINITY;
-  for(int iter=0;iter<2;iter++){
-    int noisebins = 0;
-    float new_avg_n = 0;
-    for(int n=0; n < bincount; n++){
-      float const s = power_spectrum[n];
-      if(s < avg_n * 2){ // +3dB threshold
-	new_avg_n += s;
-	noisebins++;
+  if(demod == NULL)
+    return -1;
+
+  pthread_create(&demod->fm_thread,NULL,demod_fm,demod);
+  pthread_create(&demod->linear_thread,NULL,demod_linear,demod);
+  return 0;
+}
+
+// Additional channels share the front end and forward FFT of the first one
+// Each has its own filter_out and its own output SSRC
+struct demod *Channels;
+pthread_mutex_t Channel_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int Nchannels = 1;
+
+struct demod *create_channel(struct demod * const template,uint32_t const ssrc){
+  assert(template != NULL);
+  if(template == NULL || template->filter.in == NULL)
+    return NULL;
+
+  pthread_mutex_lock(&Channel_mutex);
+  if(Nchannels >= Max_channels){
+    pthread_mutex_unlock(&Channel_mutex);
+    return NULL;
+  }
+  struct demod * const demod = calloc(1,sizeof(*demod));
+  if(demod == NULL){
+    pthread_mutex_unlock(&Channel_mutex);
+    return NULL;
+  }
+  // Inherit front end, filter, mode and output settings
+  // The template's input counters change under its status mutex; our copy of that mutex is reinitialized below
+  pthread_mutex_lock(&template->sdr.status_mutex);
+  memcpy(demod,template,sizeof(*demod));
+  pthread_mutex_unlock(&template->sdr.status_mutex);
+  demod->next = NULL;
+  demod->dynamic = true;
+  demod->terminate = false;
+
+  memset(&demod->output.rtp,0,sizeof(demod->output.rtp));
+  demod->output.rtp.ssrc = ssrc;
+  demod->output.samples = 0;
+  demod->output.commands = 0;
+  demod->output.metadata_packets = 0;
+  demod->output.state = calloc(256,sizeof(struct state));
+
+  pthread_mutex_init(&demod->sdr.status_mutex,NULL);
+  pthread_cond_init(&demod->sdr.status_cond,NULL);
+  pthread_mutex_init(&demod->doppler.mutex,NULL);
+  pthread_mutex_init(&demod->shift.mutex,NULL);
+  pthread_mutex_init(&demod->fine.mutex,NULL);
+  pthread_mutex_init(&demod->demod_mutex,NULL);
+  pthread_cond_init(&demod->demod_cond,NULL);
+
+  demod->filter.out = create_filter_output(demod->filter.in,NULL,demod->filter.decimate,
+					   output_type(demod->demod_type,demod->output.channels,demod->filter.isb,demod->opt.pll,demod->opt.env,demod->tuning.real_exact));
+  limit_filter_edges(demod);
+  set_filter(demod->filter.out,
+	     demod->filter.low/demod->output.samprate,
+	     demod->filter.high/demod->output.samprate,
+	     demod->filter.kaiser_beta);
+  set_shift(demod,demod->tune.shift);
+
+  // Append to list
+  struct demod **dp = &Channels;
+  while(*dp != NULL)
+    dp = &(*dp)->next;
+  *dp = demod;
+  Nchannels++;
+  pthread_mutex_unlock(&Channel_mutex);
+
+  start_demod(demod);
+  return demod;
+}
+
+// Find channel by output SSRC
+struct demod *lookup_channel(uint32_t const ssrc){
+  pthread_mutex_lock(&Channel_mutex);
+  struct demod *demod;
+  for(demod = Channels; demod != NULL; demod = demod->next){
+    if(demod->output.rtp.ssrc == ssrc)
+      break;
+  }
+  pthread_mutex_unlock(&Channel_mutex);
+  return demod;
+}
+
+// Wait for the demod threads to notice they've been told to exit, then free everything
+static void *reap_channel(void *arg){
+  pthread_setname("reap");
+  struct demod * const demod = arg;
+
+  pthread_join(demod->fm_thread,NULL);
+  pthread_join(demod->linear_thread,NULL);
+  delete_filter_output(demod->filter.out);
+  pthread_mutex_destroy(&demod->sdr.status_mutex);
+  pthread_cond_destroy(&demod->sdr.status_cond);
+  pthread_mutex_destroy(&demod->doppler.mutex);
+  pthread_mutex_destroy(&demod->shift.mutex);
+  pthread_mutex_destroy(&demod->fine.mutex);
+  pthread_mutex_destroy(&demod->demod_mutex);
+  pthread_cond_destroy(&demod->demod_cond);
+  free(demod->output.state);
+  free(demod);
+  return NULL;
+}
+
+// The channel that owns the front end can't be deleted
+int delete_channel(struct demod * const demod){
+  assert(demod != NULL);
+  if(demod == NULL || !demod->dynamic)
+    return -1;
+
+  pthread_mutex_lock(&Channel_mutex);
+  struct demod **dp;
+  for(dp = &Channels; *dp != NULL; dp = &(*dp)->next){
+    if(*dp == demod)
+      break;
+  }
+  if(*dp == NULL){
+    pthread_mutex_unlock(&Channel_mutex);
+    return -1; // Not on list?
+  }
+  *dp = demod->next;
+  Nchannels--;
+  pthread_mutex_unlock(&Channel_mutex);
+
+  // The threads check this at least once per block
+  pthread_mutex_lock(&demod->demod_mutex);
+  demod->terminate = true;
+  pthread_cond_broadcast(&demod->demod_cond);
+  pthread_mutex_unlock(&demod->demod_mutex);
+
+  pthread_t reaper;
+  if(pthread_create(&reaper,NULL,reap_channel,demod) != 0)
+    return -1;
+  pthread_detach(reaper);
+  return 0;
+}
+
+// Noise floor estimation, by minimum statistics on the input spectrum
+// The bins of the master's latest block are grouped into cells; each cell's average bin power
+// is smoothed, and the noise floor is the minimum of the smoothed power over a sliding window
+// of subwindows, long enough to outlast intermittent signals. The minimum of noisy estimates
+// reads low, so it's scaled up by the expected bias for the window length and smoothing.
+// Runs in its own low priority thread every few blocks, so it never delays the forward FFT,
+// and serves every channel sharing the front end: each gets the median floor of the cells
+// around its passband as its N0, and the passband power above that floor as its SNR
+#define NOISE_CELLS 512     // Cells across the input spectrum
+#define NOISE_INTERVAL 8    // Blocks between updates
+#define NOISE_SMOOTH 0.3f   // Smoothing of cell power per update
+#define NOISE_SUBWINDOWS 4  // Minimum search window, in subwindows
+#define NOISE_SUBWINDOW 8   // Updates per subwindow
+
+// Bias of a minimum of D smoothed power estimates, each with Q equivalent degrees of freedom
+// R. Martin, "Noise power spectral density estimation based on optimal smoothing and minimum
+// statistics", IEEE Trans. Speech and Audio Processing, July 2001, eq. 17 and table III
+static float min_stat_bias(int const D,float const Q){
+  static float const Dtab[] = { 1, 2, 5, 8, 10, 15, 20, 30, 40, 60, 80, 120, 140, 160 };
+  static float const Mtab[] = { 0, 0.26, 0.48, 0.58, 0.61, 0.668, 0.705, 0.762, 0.8, 0.841, 0.865, 0.89, 0.9, 0.91 };
+  int const n = sizeof(Dtab) / sizeof(Dtab[0]);
+  float M = Mtab[n-1];
+  for(int i = 1; i < n; i++){
+    if(D <= Dtab[i]){
+      M = Mtab[i-1] + (Mtab[i] - Mtab[i-1]) * (D - Dtab[i-1]) / (Dtab[i] - Dtab[i-1]);
+      break;
+    }
+  }
+  float const Qt = (Q - 2 * M) / (1 - M);
+  return 1 + (D - 1) * 2 / Qt;
+}
+
+// Floor of a / b for b > 0; plain division truncates negative bins toward the wrong cell
+static inline int floor_div(int const a,int const b){
+  return a >= 0 ? a / b : -((b - 1 - a) / b);
+}
+
+// Sum of squares of n floats
+static float sumsq(float const *x,int n){
+  float sum = 0;
+  int i = 0;
+#if defined(__AVX2__) && defined(__FMA__)
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  for(; i + 16 <= n; i += 16){
+    __m256 const a = _mm256_loadu_ps(x+i);
+    __m256 const b = _mm256_loadu_ps(x+i+8);
+    acc0 = _mm256_fmadd_ps(a,a,acc0);
+    acc1 = _mm256_fmadd_ps(b,b,acc1);
+  }
+  sum = eacc_sum(_mm256_add_ps(acc0,acc1));
+#elif defined(__SSSE3__)
+  __m128 acc = _mm_setzero_ps();
+  for(; i + 4 <= n; i += 4){
+    __m128 const a = _mm_loadu_ps(x+i);
+    acc = _mm_add_ps(acc,_mm_mul_ps(a,a));
+  }
+  acc = _mm_add_ps(acc,_mm_movehl_ps(acc,acc));
+  acc = _mm_add_ss(acc,_mm_shuffle_ps(acc,acc,1));
+  sum = _mm_cvtss_f32(acc);
+#endif
+  for(; i < n; i++)
+    sum += x[i] * x[i];
+  return sum;
+}
+
+static int fcompare(void const *a,void const *b){
+  float const x = *(float const *)a;
+  float const y = *(float const *)b;
+  return x < y ? -1 : x > y ? 1 : 0;
+}
+
+// Set one channel's N0 and SNR from the cell floors and smoothed powers
+static void channel_noise(struct demod * const demod,float const *cell_floor,float const *cell_power,int const cells,int const cellsize,int const N){
+  int const samprate = demod->input.samprate;
+  if(samprate <= 0)
+    return;
+  // The channel's carrier is at -LO2 in the input spectrum
+  double const center = -demod->tune.second_LO;
+  int lo_bin = floor((center + demod->filter.low) * N / samprate);
+  int hi_bin = ceil((center + demod->filter.high) * N / samprate);
+  if(hi_bin < lo_bin)
+    return;
+  int const width = max(1,(hi_bin - lo_bin) / cellsize + 1); // Passband cells
+
+  // Median floor over the passband and as much again on each side
+  int const ncells = min(cells,3 * width);
+  float floors[ncells];
+  int first = floor_div(lo_bin,cellsize) - width;
+  first = ((first % cells) + cells) % cells;
+  for(int i = 0; i < ncells; i++)
+    floors[i] = cell_floor[(first + i) % cells];
+  qsort(floors,ncells,sizeof(floors[0]),fcompare);
+  float const noise = floors[ncells/2]; // Per bin
+
+  float signal = 0;
+  int const pfirst = ((floor_div(lo_bin,cellsize) % cells) + cells) % cells;
+  for(int i = 0; i < min(cells,width); i++)
+    signal += cell_power[(pfirst + i) % cells];
+  signal /= min(cells,width);
+
+  demod->sig.n0 = noise / ((float)N * samprate); // Power per Hz, normalized to 0 dBFS
+  demod->sig.passband_snr = noise > 0 ? max(0.0f,signal / noise - 1) : NAN;
+}
+
+void *estimate_noise(void *arg){
+  assert(arg != NULL);
+  struct demod * const demod = arg;
+  pthread_setname("noise");
+#if defined(SCHED_IDLE)
+  {
+    struct sched_param const param = {0};
+    pthread_setschedparam(pthread_self(),SCHED_IDLE,&param);
+  }
+#endif
+  struct filter_in * const master = demod->filter.in;
+  assert(master != NULL);
+  int const N = master->ilen + master->impulse_length - 1;
+  int const cellsize = max(1,N / NOISE_CELLS);
+  int const cells = (N + cellsize - 1) / cellsize;
+  float * const cell_power = calloc(cells,sizeof(*cell_power)); // Smoothed average bin power in each cell
+  float * const cell_floor = calloc(cells,sizeof(*cell_floor)); // Bias-corrected minimum of cell_power[]
+  float * const sub_min = calloc(NOISE_SUBWINDOWS * cells,sizeof(*sub_min)); // Minimum in each subwindow
+  float * const p = calloc(cells,sizeof(*p));
+  assert(cell_power != NULL && cell_floor != NULL && sub_min != NULL && p != NULL);
+  // A cell's raw power averages cellsize bins of 2 degrees of freedom each;
+  // smoothing multiplies that by (2 - a) / a
+  float const bias = min_stat_bias(NOISE_SUBWINDOWS * NOISE_SUBWINDOW,
+				   2.0f * cellsize * (2 - NOISE_SMOOTH) / NOISE_SMOOTH);
+  unsigned int last = 0;
+  bool init = false;
+  int sub = 0;   // Current subwindow
+  int count = 0; // Updates in it so far
+
+  while(1){
+    int const samprate = demod->input.samprate;
+    useconds_t const interval = samprate > 0 ? 1e6 * NOISE_INTERVAL * master->ilen / samprate : 100000;
+    complex float const *spectrum;
+    unsigned int const blocknum = latest_filter_block(master,&spectrum);
+    if(blocknum == 0 || blocknum == last){
+      usleep(blocknum == 0 ? 1000 : interval); // Nothing yet, or the master is busy with it; try again soon
+      continue;
+    }
+    for(int c = 0; c < cells; c++){
+      int const n = min(cellsize,N - c * cellsize);
+      p[c] = sumsq((float const *)&spectrum[c * cellsize],2 * n) / n;
+    }
+    if(filter_block_overwritten(master,blocknum)){
+      usleep(1000); // Torn read; try the next block
+      continue;
+    }
+    last = blocknum;
+    if(!init){
+      memcpy(cell_power,p,cells * sizeof(*cell_power));
+      for(int s = 0; s < NOISE_SUBWINDOWS; s++)
+	memcpy(sub_min + s * cells,p,cells * sizeof(*sub_min));
+      init = true;
+    } else {
+      float * const cur = sub_min + sub * cells;
+      for(int c = 0; c < cells; c++){
+	cell_power[c] += NOISE_SMOOTH * (p[c] - cell_power[c]);
+	cur[c] = count == 0 ? cell_power[c] : min(cur[c],cell_power[c]); // New subwindow starts over
       }
+      if(++count == NOISE_SUBWINDOW){
+	count = 0;
+	sub = (sub + 1) % NOISE_SUBWINDOWS;
+      }
+    }
+    for(int c = 0; c < cells; c++){
+      float m = sub_min[c];
+      for(int s = 1; s < NOISE_SUBWINDOWS; s++)
+	m = min(m,sub_min[s * cells + c]);
+      cell_floor[c] = bias * m;
+    }
+    channel_noise(demod,cell_floor,cell_power,cells,cellsize,N);
+    pthread_mutex_lock(&Channel_mutex);
+    for(struct demod *chan = Channels; chan != NULL; chan = chan->next){
+      if(chan != demod && chan->filter.in == master)
+	channel_noise(chan,cell_floor,cell_power,cells,cellsize,N);
     }
-    avg_n = new_avg_n / noisebins;
+    pthread_mutex_unlock(&Channel_mutex);
+    usleep(interval);
   }
-  // return noise power per Hz, normalized to 0dBFS
-  return avg_n / ((float)N*demod->input.samprate); // integer product can overflow 32 bits for large N and samprate
 }
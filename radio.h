@@ -1,8 +1,8 @@
 // $Id: radio.h,v 1.97 2019/01/24 05:00:00 karn Exp karn $
 // Internal structures and functions of the 'radio' program
 // Nearly all internal state is in the 'demod' structure
-// More than one can exist in the same program,
-// but so far it seems easier to just run separate instances of the 'radio' program.
+// More than one can exist in the same program; with --max-channels > 1 additional
+// demods sharing the same front end and forward FFT can be created through the control channel
 // Copyright 2018, Phil Karn, KA9Q
 #ifndef _RADIO_H
 #define _RADIO_H 1
@@ -19,6 +19,9 @@
 #include "sdr.h"
 #include "multicast.h"
 #include "osc.h"
+#include "filter.h"
+
+struct state;
 
 #define PKTSIZE 16384
 // Incoming RTP packets
@@ -31,6 +34,14 @@ struct packet {
   unsigned char content[PKTSIZE];
 };
 
+// Spectrum rotation and fine tuning for one block of filter output
+struct tuning {
+  int rotate;      // Second LO, in whole FFT bins; applied in the frequency domain
+  double residual; // Part of second LO finer than one bin, applied at the output rate by fine_tune()
+  int real_rotate; // Second LO plus post-detection shift to the nearest bin, for REAL output
+  bool real_exact; // real_rotate is close enough that REAL output needs no fine tuning
+};
+
 // Demodulator state block
 struct demod {
 
@@ -48,6 +59,11 @@ struct demod {
     struct sockaddr_storage data_source_address; // Source of I/Q data
     struct sockaddr_storage data_dest_address;   // Dest of I/Q data (typically multicast)
     struct rtp_state rtp; // State of the I/Q RTP receiver
+    int reorder_window;   // Max packets held while waiting for a missing one; 0 = no reordering
+    uint64_t late;        // Packets that arrived after their place was given up and zero-filled
+    int pipeline;         // Sample blocks queued between the receive/convert and FFT threads; 0 = one thread does both
+    int input_cpu;        // Cores to pin those two threads to; -1 = don't pin
+    int fft_cpu;
     uint64_t samples;    // Count of raw I/Q samples received
     int samprate;
     uint32_t command_tag;  // Our tag for pending command to front end
@@ -67,6 +83,7 @@ struct demod {
     float gain_factor;     // Multiply by incoming samples to scale by analog AGC settings
 
     // 'status' is written by the input thread and read by set_first_LO, etc, so it's protected by a mutex
+    // So are the counters in 'input' that the input thread updates, since update_channels() copies them
     pthread_mutex_t status_mutex;
     pthread_cond_t status_cond;     // Signalled whenever status changes
   } sdr;
@@ -80,8 +97,12 @@ struct demod {
     double doppler_rate;
   } tune;
 
+  // What the demodulators apply to each block, worked out from 'tune' and the sample rate
+  // Replaced as a whole under sdr.status_mutex; demodulators read it with get_tuning()
+  struct tuning tuning;
+
   struct osc doppler;
-  struct osc second_LO;
+  struct osc fine;   // Tuning residual (and shift, if possible), at the output sample rate
   struct osc shift;
 
   // Zero IF pre-demod filter params
@@ -129,7 +150,8 @@ struct demod {
   struct {
     float if_power;   // Input level, unity == 0dBFS, power ratio
     float bb_power;   // Average power of signal after filter, power ratio
-    float n0;         // Noise spectral density esimate (experimemtal), power/Hz ratio
+    float n0;         // Noise spectral density around our passband, power/Hz ratio
+    float passband_snr; // Passband power over the noise floor, from the input spectrum, power ratio
     float snr;        // Estimated signal-to-noise ratio (only some demodulators), power ratio
     float foffset;    // Frequency offset Hz (FM, coherent AM, dsb)
     float pdeviation; // Peak frequency deviation Hz (FM)
@@ -142,6 +164,7 @@ struct demod {
   // Output
   struct {
     int samprate;       // Audio D/A sample rate (usually 48 kHz)
+    enum encoding encoding; // S16BE or F32BE
     // RTP network streaming
     bool silent; // last packet was suppressed (used to generate RTP mark bit)
     struct rtp_state rtp;
@@ -161,11 +184,24 @@ struct demod {
     float level;    // Output level
     uint64_t samples;
     uint64_t commands;
+    struct state *state; // Last status sent, for compact_packet()
   } output;
+
+  // Multichannel operation
+  struct demod *next;   // Next in Channels list
+  bool dynamic;         // Created through control channel; doesn't own the front end
+  bool terminate;       // Tell demod threads to exit
+  pthread_t fm_thread;
+  pthread_t linear_thread;
 };
 extern char Libdir[];
 extern int Verbose;
 
+// All active demods; the first is the one created at startup that owns the front end
+extern struct demod *Channels;
+extern pthread_mutex_t Channel_mutex;
+extern int Max_channels;
+
 // Functions/methods to control a demod instance
 int LO2_in_range(struct demod *,double f,int);
 double get_freq(struct demod *);
@@ -176,13 +212,23 @@ double get_first_LO(struct demod const *);
 double set_first_LO(struct demod *,double);
 double get_second_LO(struct demod *);
 double set_second_LO(struct demod *,double);
+void set_input_samprate(struct demod *,int);
+void follow_filter_input(struct demod *);
+struct tuning get_tuning(struct demod *);
+void fine_tune(struct demod *,complex float *,int,double);
+enum filtertype output_type(enum demod_type,int channels,bool isb,bool pll,bool env,bool exact);
 double get_doppler(struct demod *);
 double get_doppler_rate(struct demod *);
 int set_doppler(struct demod *,double,double);
 int preset_mode(struct demod *,const char *);
+void limit_filter_edges(struct demod *);
+int start_demod(struct demod *);
+struct demod *create_channel(struct demod *,uint32_t);
+struct demod *lookup_channel(uint32_t);
+int delete_channel(struct demod *);
 
 void *proc_samples(void *);
-const float compute_n0(struct demod const *);
+void *estimate_noise(void *);
 
 // Demodulator thread entry points
 void *demod_fm(void *);
@@ -29,17 +29,16 @@
 void send_radio_status(struct demod *demod,int full);
 void decode_radio_commands(struct demod *, unsigned char *, int);
 void decode_sdr_status(struct demod *demod,unsigned char *buffer,int length);
-
-struct state State[256];
+static void route_radio_commands(struct demod *,unsigned char *,int);
+static void update_channels(struct demod *);
 
 // Status reception and transmission
+// Also handles commands and status for any additional channels
 void *send_status(void *arg){
   pthread_setname("status");
   assert(arg != NULL);
   struct demod * const demod = arg;
 
-  memset(State,0,sizeof(State));
-  
   // Solicit immediate full status
   unsigned char packet[8192],*bp;
   memset(packet,0,sizeof(packet));
@@ -100,11 +99,16 @@ void *send_status(void *arg){
 	if(cr == 0)
 	  continue; // Ignore our own status messages
 	demod->output.commands++;
-	decode_radio_commands(demod,cp,length-1);
+	route_radio_commands(demod,cp,length-1);
 	full_status_counter = 0; // Send complete status in response
       }
     }
-    send_radio_status(demod,(full_status_counter == 0));
+    follow_filter_input(demod); // Only does anything with --fbus-in
+    update_channels(demod);
+    pthread_mutex_lock(&Channel_mutex);
+    for(struct demod *chan = Channels; chan != NULL; chan = chan->next)
+      send_radio_status(chan,(full_status_counter == 0));
+    pthread_mutex_unlock(&Channel_mutex);
     if(full_status_counter-- <= 0)
       full_status_counter = 10;
   }
@@ -140,6 +144,7 @@ void send_radio_status(struct demod *demod,int full){
   encode_int64(&bp,INPUT_SAMPLES,demod->input.samples);
   encode_int64(&bp,INPUT_DROPS,demod->input.rtp.drops);
   encode_int64(&bp,INPUT_DUPES,demod->input.rtp.dupes);
+  encode_int64(&bp,INPUT_LATE,demod->input.late);
 
   // Source address we're using to send data
   encode_socket(&bp,OUTPUT_DATA_SOURCE_SOCKET,&demod->output.data_source_address);
@@ -149,6 +154,7 @@ void send_radio_status(struct demod *demod,int full){
   encode_int32(&bp,OUTPUT_SSRC,demod->output.rtp.ssrc);
   encode_byte(&bp,OUTPUT_TTL,Mcast_ttl);
   encode_int32(&bp,OUTPUT_SAMPRATE,demod->output.samprate);
+  encode_byte(&bp,OUTPUT_ENCODING,demod->output.encoding);
   encode_int64(&bp,OUTPUT_DATA_PACKETS,demod->output.rtp.packets);
   encode_int64(&bp,OUTPUT_METADATA_PACKETS,demod->output.metadata_packets);
   
@@ -169,13 +175,16 @@ void send_radio_status(struct demod *demod,int full){
   encode_float(&bp,KAISER_BETA,demod->filter.kaiser_beta);
   encode_int32(&bp,FILTER_BLOCKSIZE,demod->filter.L);
   encode_int32(&bp,FILTER_FIR_LENGTH,demod->filter.M);
-  if(demod->filter.out)
+  if(demod->filter.out){
     encode_float(&bp,NOISE_BANDWIDTH,demod->input.samprate * demod->filter.out->noise_gain); // Hz
+    encode_int64(&bp,FILTER_DROPS,demod->filter.out->skipped + demod->filter.out->overruns);
+  }
   
   // Signals - these ALWAYS change
   encode_float(&bp,IF_POWER,power2dB(demod->sig.if_power));
   encode_float(&bp,BASEBAND_POWER,power2dB(demod->sig.bb_power));
   encode_float(&bp,NOISE_DENSITY,power2dB(demod->sig.n0));
+  encode_float(&bp,PASSBAND_SNR,power2dB(demod->sig.passband_snr));
   
   // Demodulation mode
   encode_byte(&bp,DEMOD_TYPE,demod->demod_type);
@@ -211,11 +220,80 @@ void send_radio_status(struct demod *demod,int full){
 
   encode_eol(&bp);
   
-  int len = compact_packet(&State[0],packet,full);
+  int len = compact_packet(demod->output.state,packet,full);
   send(demod->output.status_fd,packet,len,0);
   demod->output.metadata_packets++;
 }
 
+// With multiple channels, a command goes to the channel named by its OUTPUT_SSRC
+// An unknown SSRC with a nonzero RADIO_FREQUENCY creates a channel; a zero frequency deletes it
+static void route_radio_commands(struct demod * const master,unsigned char * const buffer,int const length){
+  unsigned char *cp = buffer;
+  bool have_ssrc = false;
+  uint32_t ssrc = 0;
+  double freq = NAN;
+
+  while(cp - buffer < length){
+    enum status_type type = *cp++;
+    if(type == EOL)
+      break;
+    unsigned int optlen = *cp++;
+    if(cp - buffer + optlen >= length)
+      break;
+    if(type == OUTPUT_SSRC){
+      ssrc = decode_int(cp,optlen);
+      have_ssrc = true;
+    } else if(type == RADIO_FREQUENCY)
+      freq = decode_double(cp,optlen);
+    cp += optlen;
+  }
+  if(Max_channels <= 1 || !have_ssrc || ssrc == master->output.rtp.ssrc){
+    decode_radio_commands(master,buffer,length);
+    return;
+  }
+  struct demod *demod = lookup_channel(ssrc);
+  if(demod == NULL){
+    if(isnan(freq) || freq == 0)
+      return;
+    if((demod = create_channel(master,ssrc)) == NULL)
+      return; // Too many channels?
+  } else if(freq == 0){
+    delete_channel(demod);
+    return;
+  }
+  demod->output.commands++;
+  decode_radio_commands(demod,buffer,length);
+}
+
+// Keep the channels sharing the front end up to date with it, retuning them when LO1 moves
+static void update_channels(struct demod * const master){
+  pthread_mutex_lock(&Channel_mutex);
+  for(struct demod *demod = Channels; demod != NULL; demod = demod->next){
+    if(!demod->dynamic)
+      continue;
+    // The input thread updates master->input as packets arrive, so copy it under the master's lock
+    // Always take the master's lock before a channel's
+    pthread_mutex_lock(&master->sdr.status_mutex);
+    pthread_mutex_lock(&demod->sdr.status_mutex);
+    bool const retune = demod->sdr.status.frequency != master->sdr.status.frequency;
+    bool const new_rate = demod->input.samprate != master->input.samprate;
+    demod->input = master->input;
+    demod->sdr.status = master->sdr.status;
+    demod->sig.if_power = master->sig.if_power; // N0 is per channel, set by estimate_noise()
+    pthread_mutex_unlock(&demod->sdr.status_mutex);
+    pthread_mutex_unlock(&master->sdr.status_mutex);
+    if(new_rate && demod->input.samprate != 0)
+      set_input_samprate(demod,demod->input.samprate); // Also retunes LO2 for the new rate
+    demod->sdr.direct_conversion = master->sdr.direct_conversion;
+    demod->sdr.min_IF = master->sdr.min_IF;
+    demod->sdr.max_IF = master->sdr.max_IF;
+    demod->sdr.gain_factor = master->sdr.gain_factor;
+    if(retune && demod->input.samprate != 0)
+      set_freq(demod,demod->tune.freq,NAN); // Leaves it alone if now out of range
+  }
+  pthread_mutex_unlock(&Channel_mutex);
+}
+
 void decode_radio_commands(struct demod *demod,unsigned char *buffer,int length){
   unsigned char *cp = buffer;
   int fset = 0;
@@ -302,6 +380,11 @@ void decode_radio_commands(struct demod *demod,unsigned char *buffer,int length)
     case OUTPUT_CHANNELS: // integer (1 or 2)
       demod->output.channels = decode_int(cp,optlen);
       break;
+    case OUTPUT_ENCODING: // S16BE or F32BE
+      i = decode_int(cp,optlen);
+      if(i == S16BE || i == F32BE)
+	demod->output.encoding = i;
+      break;
     case COMMAND_TAG:     // dimensionless, opaque integer
       demod->output.command_tag = decode_int(cp,optlen);
       break;
@@ -343,6 +426,7 @@ void decode_radio_commands(struct demod *demod,unsigned char *buffer,int length)
   if(fset && !isnan(new_high) && !isnan(new_low) && new_high >= new_low){
     demod->filter.low = new_low;
     demod->filter.high = new_high;
+    limit_filter_edges(demod);
     double samptime = 1./demod->output.samprate;
     set_filter(demod->filter.out,samptime*demod->filter.low,samptime*demod->filter.high,demod->filter.kaiser_beta);
   }
@@ -353,7 +437,7 @@ void decode_radio_commands(struct demod *demod,unsigned char *buffer,int length)
     // Tune around with fixed LO1
     nrf = get_freq(demod) - (nlo2 - get_second_LO(demod));
     set_freq(demod,nrf,nlo2);
-  } else if(!isnan(nlo1)){
+  } else if(!isnan(nlo1) && !demod->dynamic){
     // Will automatically change LO2 when LO1 actually changes
     set_first_LO(demod,nlo1);
   }
@@ -395,24 +479,8 @@ void decode_sdr_status(struct demod *demod,unsigned char *buffer,int length){
       break;
     case OUTPUT_SAMPRATE:
       nsamprate = decode_int(cp,optlen);
-      if(nsamprate != demod->input.samprate){
-	demod->input.samprate = nsamprate;
-	// Oscillator and filter frequencies are fractions of the sample rate
-	set_osc(&demod->second_LO,demod->tune.second_LO/nsamprate,0);
-	set_osc(&demod->doppler,demod->tune.doppler/nsamprate,demod->tune.doppler_rate/((double)nsamprate*nsamprate));
-	set_osc(&demod->shift,demod->tune.shift/nsamprate,0);
-	demod->sdr.min_IF = -nsamprate/2; // in case they're not set explicitly
-	demod->sdr.max_IF = +nsamprate/2;
-
-	demod->filter.decimate = demod->input.samprate / demod->output.samprate;
-	if(demod->filter.out){
-	  // this probably doesn't actually change
-	  set_filter(demod->filter.out,
-		     demod->filter.low/demod->output.samprate,
-		     demod->filter.high/demod->output.samprate,
-		     demod->filter.kaiser_beta);
-	}
-      }
+      if(nsamprate != demod->input.samprate)
+	set_input_samprate(demod,nsamprate);
       break;
     case GPS_TIME:
       demod->sdr.status.timestamp = decode_int(cp,optlen);
@@ -97,6 +97,13 @@ enum status_type {
   OPUS_TTL,
   OPUS_BITRATE,
   OPUS_PACKETS,
+
+  FILTER_DROPS,   // Blocks missed or overrun by a filter slave that fell behind
+  INPUT_LATE,     // I/Q packets that arrived after the reorder window gave up on them
+  PASSBAND_SNR,   // Channel passband power over the noise floor, from the input spectrum
+  OUTPUT_ENCODING, // PCM sample encoding (enum encoding in multicast.h)
+  INPUT_OVERRUNS,  // Front end USB transfers dropped because the decimator fell behind
+  INPUT_UNDERRUNS, // Front end decimator waits that timed out for lack of samples
 };
 
 